@@ -3,6 +3,10 @@
 
 #define _FILE_OFFSET_BITS  64
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* mremap, recvmmsg, splice */
+#endif
+
 #include <sys/types.h>
 #include <string.h>
 #include <stdlib.h>
@@ -94,6 +98,10 @@ extern int is_WinNT;
 
 #if defined(_MSC_VER) || defined(__BORLANDC__)
 typedef __int64	int64_t;
+typedef unsigned __int64	uint64_t;
+typedef unsigned int	uint32_t;
+#else
+#include <stdint.h>
 #endif
 
 #define INT64_MAKE(lo,hi)	(((int64_t) (hi) << 32) | (unsigned int) (lo))
@@ -106,6 +114,7 @@ typedef __int64	int64_t;
  */
 
 #define FD_TYPENAME	"sys.handle"
+#define SD_TYPENAME	"sys.sock.handle"
 
 #ifdef _WIN32
 typedef HANDLE	fd_t;
@@ -143,9 +152,15 @@ void sys_buffer_write_init (lua_State *L, int idx, struct sys_buffer *sb,
                             char *buf, size_t buflen);
 int sys_buffer_write_next (lua_State *L, struct sys_buffer *sb,
                            char *buf, size_t buflen);
+int sys_buffer_write_reserve (lua_State *L, struct sys_buffer *sb,
+                              char *buf, size_t n);
 int sys_buffer_write_done (lua_State *L, struct sys_buffer *sb,
                            char *buf, size_t tail);
 
+#ifndef _WIN32
+ssize_t sys_buffer_writev (lua_State *L, int idx, int fd, int *donep);
+#endif
+
 
 /*
  * Error Reporting
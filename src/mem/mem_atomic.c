@@ -0,0 +1,293 @@
+/* Lua System: Memory Buffers: Atomic Operations */
+
+#if defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__ >= 407 \
+ || defined(__clang__))
+
+#define SYSMEM_HAVE_ATOMIC
+
+static const int atomic_orders[] = {
+    __ATOMIC_RELAXED, __ATOMIC_ACQUIRE, __ATOMIC_RELEASE,
+    __ATOMIC_ACQ_REL, __ATOMIC_SEQ_CST
+};
+
+#elif defined(_MSC_VER)
+
+#define SYSMEM_HAVE_ATOMIC
+
+/* Interlocked functions are full barriers */
+static const int atomic_orders[] = {0, 0, 0, 0, 0};
+
+#endif
+
+
+#ifdef SYSMEM_HAVE_ATOMIC
+
+static const char *const atomic_order_names[] = {
+    "relaxed", "acquire", "release", "acq_rel", "seq_cst", NULL
+};
+
+enum {
+    ATOMIC_RELAXED, ATOMIC_ACQUIRE, ATOMIC_RELEASE,
+    ATOMIC_ACQ_REL, ATOMIC_SEQ_CST
+};
+
+/* Operations */
+enum {
+    ATOMIC_ADD,
+    ATOMIC_XCHG,
+    ATOMIC_CAS,
+    ATOMIC_LOAD,
+    ATOMIC_STORE,
+    ATOMIC_OR
+};
+
+
+/*
+ * Arguments: ..., [order (string)]
+ */
+static int
+atomic_checkorder (lua_State *L, int idx, int op)
+{
+    int order = luaL_checkoption(L, idx, "seq_cst", atomic_order_names);
+
+    /* drop invalid parts of the ordering */
+    if (op == ATOMIC_LOAD && (order == ATOMIC_RELEASE || order == ATOMIC_ACQ_REL))
+	order = ATOMIC_ACQUIRE;
+    else if (op == ATOMIC_STORE && (order == ATOMIC_ACQUIRE || order == ATOMIC_ACQ_REL))
+	order = ATOMIC_RELEASE;
+    return order;
+}
+
+/*
+ * Arguments: membuf_udata, index (number), ...
+ * Returns: address of the element
+ */
+static void *
+atomic_checkptr (lua_State *L, struct membuf *mb)
+{
+    const int type = memtype(mb);
+    const int size = memtypesize(mb);
+    const int idx = luaL_checkinteger(L, 2);
+    char *ptr;
+
+    if (type != SYSMEM_TINT && type != SYSMEM_TUINT
+     && type != SYSMEM_TLONG && type != SYSMEM_TULONG)
+	luaL_argerror(L, 1, "integral type expected");
+    if (!mb->data || idx < 0 || (mb->len && (idx + 1) * size > mb->len))
+	luaL_argerror(L, 2, "out of bounds");
+
+    ptr = mb->data + idx * size;
+    if ((size_t) ptr & (size - 1))
+	luaL_argerror(L, 2, "unaligned element");
+    return ptr;
+}
+
+static int64_t
+atomic_tointeger (lua_State *L, int idx)
+{
+    const lua_Number num = luaL_checknumber(L, idx);
+
+    return (num < 0) ? (int64_t) num : (int64_t) (uint64_t) num;
+}
+
+static void
+atomic_pushinteger (lua_State *L, struct membuf *mb, int64_t v)
+{
+    lua_Number num;
+
+    switch (memtype(mb)) {
+    case SYSMEM_TINT: num = (int) v; break;
+    case SYSMEM_TUINT: num = (unsigned int) v; break;
+    case SYSMEM_TLONG: num = (long) v; break;
+    default: num = (lua_Number) (unsigned long) v;
+    }
+    lua_pushnumber(L, num);
+}
+
+/*
+ * Returns: previous value
+ */
+static int64_t
+atomic_op (void *ptr, int size, int op, int64_t v, int64_t *cmp, int order)
+{
+#ifndef _MSC_VER
+    const int mo = atomic_orders[order];
+    const int fail_mo = atomic_orders[(order == ATOMIC_RELEASE)
+     ? ATOMIC_RELAXED : (order == ATOMIC_ACQ_REL) ? ATOMIC_ACQUIRE : order];
+
+    if (size == 4) {
+	int32_t *p = ptr;
+	int32_t expected;
+
+	switch (op) {
+	case ATOMIC_ADD: return __atomic_fetch_add(p, (int32_t) v, mo);
+	case ATOMIC_XCHG: return __atomic_exchange_n(p, (int32_t) v, mo);
+	case ATOMIC_CAS:
+	    expected = (int32_t) *cmp;
+	    *cmp = __atomic_compare_exchange_n(p, &expected, (int32_t) v,
+	     0, mo, fail_mo);
+	    return expected;
+	case ATOMIC_LOAD: return __atomic_load_n(p, mo);
+	case ATOMIC_OR: return __atomic_fetch_or(p, (int32_t) v, mo);
+	default: __atomic_store_n(p, (int32_t) v, mo);
+	}
+    } else {
+	int64_t *p = ptr;
+	int64_t expected;
+
+	switch (op) {
+	case ATOMIC_ADD: return __atomic_fetch_add(p, v, mo);
+	case ATOMIC_XCHG: return __atomic_exchange_n(p, v, mo);
+	case ATOMIC_CAS:
+	    expected = *cmp;
+	    *cmp = __atomic_compare_exchange_n(p, &expected, v,
+	     0, mo, fail_mo);
+	    return expected;
+	case ATOMIC_LOAD: return __atomic_load_n(p, mo);
+	case ATOMIC_OR: return __atomic_fetch_or(p, v, mo);
+	default: __atomic_store_n(p, v, mo);
+	}
+    }
+#else
+    (void) order;
+
+    if (size == 4) {
+	LONG volatile *p = ptr;
+	LONG old;
+
+	switch (op) {
+	case ATOMIC_ADD: return InterlockedExchangeAdd(p, (LONG) v);
+	case ATOMIC_CAS:
+	    old = InterlockedCompareExchange(p, (LONG) v, (LONG) *cmp);
+	    *cmp = (old == (LONG) *cmp);
+	    return old;
+	case ATOMIC_LOAD: return InterlockedCompareExchange(p, 0, 0);
+	case ATOMIC_OR: return InterlockedOr(p, (LONG) v);
+	default: return InterlockedExchange(p, (LONG) v);
+	}
+    } else {
+	LONGLONG volatile *p = ptr;
+	LONGLONG old;
+
+	switch (op) {
+	case ATOMIC_ADD: return InterlockedExchangeAdd64(p, v);
+	case ATOMIC_CAS:
+	    old = InterlockedCompareExchange64(p, v, *cmp);
+	    *cmp = (old == *cmp);
+	    return old;
+	case ATOMIC_LOAD: return InterlockedCompareExchange64(p, 0, 0);
+	case ATOMIC_OR: return InterlockedOr64(p, v);
+	default: return InterlockedExchange64(p, v);
+	}
+    }
+#endif
+    return 0;
+}
+
+
+static int
+atomic_add (lua_State *L, int is_sub)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    void *ptr = atomic_checkptr(L, mb);
+    const int64_t v = atomic_tointeger(L, 3);
+    const int order = atomic_checkorder(L, 4, ATOMIC_ADD);
+
+    atomic_pushinteger(L, mb, atomic_op(ptr, memtypesize(mb),
+     ATOMIC_ADD, is_sub ? -v : v, NULL, order));
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, index (number), value (number),
+ *	[order (string: "relaxed", "acquire", "release", "acq_rel", "seq_cst")]
+ * Returns: previous value (number)
+ */
+static int
+mem_atomic_add (lua_State *L)
+{
+    return atomic_add(L, 0);
+}
+
+/*
+ * Arguments: membuf_udata, index (number), value (number), [order (string)]
+ * Returns: previous value (number)
+ */
+static int
+mem_atomic_sub (lua_State *L)
+{
+    return atomic_add(L, 1);
+}
+
+/*
+ * Arguments: membuf_udata, index (number), expected (number),
+ *	desired (number), [order (string)]
+ * Returns: success (boolean), previous value (number)
+ */
+static int
+mem_atomic_cas (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    void *ptr = atomic_checkptr(L, mb);
+    int64_t cmp = atomic_tointeger(L, 3);
+    const int64_t v = atomic_tointeger(L, 4);
+    const int order = atomic_checkorder(L, 5, ATOMIC_CAS);
+    const int64_t old = atomic_op(ptr, memtypesize(mb),
+     ATOMIC_CAS, v, &cmp, order);
+
+    lua_pushboolean(L, (int) cmp);
+    atomic_pushinteger(L, mb, old);
+    return 2;
+}
+
+/*
+ * Arguments: membuf_udata, index (number), value (number), [order (string)]
+ * Returns: previous value (number)
+ */
+static int
+mem_atomic_xchg (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    void *ptr = atomic_checkptr(L, mb);
+    const int64_t v = atomic_tointeger(L, 3);
+    const int order = atomic_checkorder(L, 4, ATOMIC_XCHG);
+
+    atomic_pushinteger(L, mb, atomic_op(ptr, memtypesize(mb),
+     ATOMIC_XCHG, v, NULL, order));
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, index (number), [order (string)]
+ * Returns: value (number)
+ */
+static int
+mem_atomic_load (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    void *ptr = atomic_checkptr(L, mb);
+    const int order = atomic_checkorder(L, 3, ATOMIC_LOAD);
+
+    atomic_pushinteger(L, mb, atomic_op(ptr, memtypesize(mb),
+     ATOMIC_LOAD, 0, NULL, order));
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, index (number), value (number), [order (string)]
+ * Returns: membuf_udata
+ */
+static int
+mem_atomic_store (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    void *ptr = atomic_checkptr(L, mb);
+    const int64_t v = atomic_tointeger(L, 3);
+    const int order = atomic_checkorder(L, 4, ATOMIC_STORE);
+
+    atomic_op(ptr, memtypesize(mb), ATOMIC_STORE, v, NULL, order);
+    lua_settop(L, 1);
+    return 1;
+}
+
+#endif /* SYSMEM_HAVE_ATOMIC */
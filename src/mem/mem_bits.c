@@ -0,0 +1,284 @@
+/* Lua System: Memory Buffers: Bitsets */
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* Binary operations */
+enum {
+    BITS_AND,
+    BITS_OR,
+    BITS_XOR,
+    BITS_ANDNOT
+};
+
+#if defined(__GNUC__)
+#define bits_popcount64(w)	__builtin_popcountll(w)
+#else
+static int
+bits_popcount64 (uint64_t w)
+{
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int) ((w * 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+#define bits_popcount8(b)	bits_popcount64((uint64_t) (b))
+
+
+static int
+bits_ctz8 (unsigned int b)
+{
+    int n = 0;
+
+    while (!(b & 1)) {
+	b >>= 1;
+	++n;
+    }
+    return n;
+}
+
+/*
+ * Arguments: ..., membuf_udata ("bitstring"), ...
+ * Returns: number of bytes of the buffer
+ */
+static size_t
+bits_checkbuffer (lua_State *L, int idx, struct membuf **mbp)
+{
+    struct membuf *mb = mem_checkbuffer(L, idx);
+
+    if (memtype(mb) != SYSMEM_TBITSTRING)
+	luaL_argerror(L, idx, "bitstring expected");
+    if (!mb->data)
+	luaL_argerror(L, idx, "membuf is closed");
+    *mbp = mb;
+    return mb->len;
+}
+
+static void
+bits_op (int op, unsigned char *d, const unsigned char *s, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __AVX2__
+    for (; i + 32 <= n; i += 32) {
+	__m256i a = _mm256_loadu_si256((const __m256i *) (d + i));
+	const __m256i b = _mm256_loadu_si256((const __m256i *) (s + i));
+
+	switch (op) {
+	case BITS_AND: a = _mm256_and_si256(a, b); break;
+	case BITS_OR: a = _mm256_or_si256(a, b); break;
+	case BITS_XOR: a = _mm256_xor_si256(a, b); break;
+	default: a = _mm256_andnot_si256(b, a);
+	}
+	_mm256_storeu_si256((__m256i *) (d + i), a);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+	uint64_t a, b;
+
+	memcpy(&a, d + i, 8);
+	memcpy(&b, s + i, 8);
+	switch (op) {
+	case BITS_AND: a &= b; break;
+	case BITS_OR: a |= b; break;
+	case BITS_XOR: a ^= b; break;
+	default: a &= ~b;
+	}
+	memcpy(d + i, &a, 8);
+    }
+    for (; i < n; ++i) {
+	switch (op) {
+	case BITS_AND: d[i] &= s[i]; break;
+	case BITS_OR: d[i] |= s[i]; break;
+	case BITS_XOR: d[i] ^= s[i]; break;
+	default: d[i] &= ~s[i];
+	}
+    }
+}
+
+/*
+ * Arguments: membuf_udata, source (membuf_udata)
+ * Returns: membuf_udata
+ */
+static int
+bits_binop (lua_State *L, int op)
+{
+    struct membuf *mb, *src;
+    size_t n = bits_checkbuffer(L, 1, &mb);
+    const size_t srclen = bits_checkbuffer(L, 2, &src);
+
+    if (n > srclen) n = srclen;
+    bits_op(op, (unsigned char *) mb->data,
+     (const unsigned char *) src->data, n);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+mem_bits_and (lua_State *L)
+{
+    return bits_binop(L, BITS_AND);
+}
+
+static int
+mem_bits_or (lua_State *L)
+{
+    return bits_binop(L, BITS_OR);
+}
+
+static int
+mem_bits_xor (lua_State *L)
+{
+    return bits_binop(L, BITS_XOR);
+}
+
+static int
+mem_bits_andnot (lua_State *L)
+{
+    return bits_binop(L, BITS_ANDNOT);
+}
+
+/*
+ * Arguments: membuf_udata, [from_bit (number), num_bits (number)]
+ * Returns: count (number)
+ */
+static int
+mem_bits_popcount (lua_State *L)
+{
+    struct membuf *mb;
+    const size_t len = bits_checkbuffer(L, 1, &mb);
+    const size_t from = (size_t) luaL_optinteger(L, 2, 0);
+    size_t end = len * 8;
+    const unsigned char *p = (const unsigned char *) mb->data;
+    size_t i, last, cnt = 0;
+
+    if (!lua_isnoneornil(L, 3)) {
+	const size_t nbits = (size_t) luaL_checkinteger(L, 3);
+	if (from + nbits < end) end = from + nbits;
+    }
+    if (from >= end) {
+	lua_pushinteger(L, 0);
+	return 1;
+    }
+
+    i = from >> 3;
+    last = (end - 1) >> 3;
+    if (i == last) {
+	const unsigned int mask = (0xFF << (from & 7))
+	 & (0xFF >> (7 - ((end - 1) & 7)));
+	cnt = bits_popcount8(p[i] & mask);
+    }
+    else {
+	cnt = bits_popcount8(p[i] & (0xFF << (from & 7)));
+	for (++i; i + 8 <= last; i += 8) {
+	    uint64_t w;
+
+	    memcpy(&w, p + i, 8);
+	    cnt += bits_popcount64(w);
+	}
+	for (; i < last; ++i)
+	    cnt += bits_popcount8(p[i]);
+	cnt += bits_popcount8(p[last] & (0xFF >> (7 - ((end - 1) & 7))));
+    }
+    lua_pushnumber(L, (lua_Number) cnt);
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, [from_bit (number), value (boolean)]
+ * Returns: [bit_index (number)]
+ */
+static int
+mem_bits_next (lua_State *L)
+{
+    struct membuf *mb;
+    const size_t len = bits_checkbuffer(L, 1, &mb);
+    const size_t from = (size_t) luaL_optinteger(L, 2, 0);
+    const unsigned int inv = (lua_isnoneornil(L, 3) || lua_toboolean(L, 3))
+     ? 0 : 0xFF;
+    const uint64_t winv = inv ? ~((uint64_t) 0) : 0;
+    const unsigned char *p = (const unsigned char *) mb->data;
+    size_t i = from >> 3;
+    unsigned int b;
+
+    if (i >= len) return 0;
+
+    b = (p[i] ^ inv) & (0xFF << (from & 7));
+    if (b) goto found;
+
+    for (++i; i + 8 <= len; i += 8) {
+	uint64_t w;
+
+	memcpy(&w, p + i, 8);
+	if (w ^ winv) break;
+    }
+    for (; i < len; ++i) {
+	b = (p[i] ^ inv) & 0xFF;
+	if (b) goto found;
+    }
+    return 0;
+ found:
+    lua_pushnumber(L, (lua_Number) (i * 8 + bits_ctz8(b)));
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, indexes (membuf_udata: "int", "uint", "long", "ulong"),
+ *	[from_bit (number)]
+ * Returns: count (number), [next_bit (number)]
+ */
+static int
+mem_bits_indexes (lua_State *L)
+{
+    struct membuf *mb, *out;
+    const size_t len = bits_checkbuffer(L, 1, &mb);
+    const size_t from = (size_t) luaL_optinteger(L, 3, 0);
+    const unsigned char *p = (const unsigned char *) mb->data;
+    size_t i = from >> 3, cnt = 0, max;
+    unsigned int b;
+    int type;
+
+    out = mem_checkbuffer(L, 2);
+    type = memtype(out);
+    if (type != SYSMEM_TINT && type != SYSMEM_TUINT
+     && type != SYSMEM_TLONG && type != SYSMEM_TULONG)
+	luaL_argerror(L, 2, "integral type expected");
+    if (!out->data)
+	luaL_argerror(L, 2, "membuf is closed");
+    max = out->len / memtypesize(out);
+
+    if (i >= len) goto end;
+    b = p[i] & (0xFF << (from & 7));
+    for (; ; ) {
+	while (b) {
+	    const size_t bit = i * 8 + bits_ctz8(b);
+
+	    if (cnt == max) {
+		lua_pushnumber(L, (lua_Number) cnt);
+		lua_pushnumber(L, (lua_Number) bit);
+		return 2;
+	    }
+	    if (memtypesize(out) == sizeof(int))
+		((unsigned int *) out->data)[cnt] = (unsigned int) bit;
+	    else
+		((unsigned long *) out->data)[cnt] = (unsigned long) bit;
+	    ++cnt;
+	    b &= b - 1;
+	}
+	/* skip zero words */
+	for (++i; i + 8 <= len; i += 8) {
+	    uint64_t w;
+
+	    memcpy(&w, p + i, 8);
+	    if (w) break;
+	}
+	if (i >= len) break;
+	b = p[i];
+    }
+ end:
+    lua_pushnumber(L, (lua_Number) cnt);
+    return 1;
+}
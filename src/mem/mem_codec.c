@@ -0,0 +1,533 @@
+/* Lua System: Memory Buffers: Base64 and Hex Codecs */
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#define CODEC_TYPENAME	"sys.mem.codec"
+
+#define CODEC_INCHUNK	3072  /* input bytes per step */
+#define CODEC_OUTMAX	(2 * CODEC_INCHUNK + 8)  /* max. output bytes per step */
+
+#ifndef _WIN32
+#define CODEC_EINVAL	EINVAL
+#else
+#define CODEC_EINVAL	ERROR_INVALID_DATA
+#endif
+
+/* Codecs */
+enum {
+    CODEC_BASE64,
+    CODEC_BASE64URL,
+    CODEC_HEX
+};
+
+static const char *const codec_names[] = {
+    "base64", "base64url", "hex", NULL
+};
+
+static const char *const base64_alphabets[] = {
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+#define CODEC_BAD	0xFF
+
+static unsigned char base64_dectable[2][256];
+static unsigned char hex_dectable[256];
+static volatile int codec_tables_ready;
+
+/* Codec state */
+struct codec {
+    int kind;
+    int decode;
+    int padded;  /* decoder: padding seen */
+    unsigned int npend;  /* pending input bytes or sextets/nibbles */
+    unsigned char pend[4];
+};
+
+
+static void
+codec_inittables (void)
+{
+    int i, j;
+
+    memset(base64_dectable, CODEC_BAD, sizeof(base64_dectable));
+    memset(hex_dectable, CODEC_BAD, sizeof(hex_dectable));
+    for (j = 0; j < 2; ++j) {
+	for (i = 0; i < 64; ++i)
+	    base64_dectable[j][(unsigned char) base64_alphabets[j][i]] = i;
+    }
+    for (i = 0; i < 16; ++i) {
+	hex_dectable[(unsigned char) hex_digits[i]] = i;
+	hex_dectable[(unsigned char) "0123456789ABCDEF"[i]] = i;
+    }
+    /* concurrent initializations write the same values */
+    codec_tables_ready = 1;
+}
+
+
+#ifdef __SSSE3__
+
+/*
+ * 12 input bytes to 16 base64 characters.
+ */
+static __m128i
+base64_encode16 (__m128i in, __m128i lut)
+{
+    __m128i t0, t1, t2, t3, idx;
+
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+     4, 5, 3, 4, 1, 2, 0, 1));
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003F03F0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    in = _mm_or_si128(t1, t3);  /* sextets */
+
+    /* translate sextets to characters by ranges */
+    idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+    return _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+}
+
+#endif
+
+/*
+ * Returns: number of output characters
+ */
+static size_t
+base64_encode (struct codec *cs, const unsigned char *s, size_t n,
+               int final, char *d)
+{
+    const char *alphabet = base64_alphabets[cs->kind == CODEC_BASE64URL];
+    const int pad = (cs->kind == CODEC_BASE64);
+    char *p = d;
+
+    if (cs->npend) {
+	while (cs->npend < 3 && n) {
+	    cs->pend[cs->npend++] = *s++;
+	    --n;
+	}
+	if (cs->npend < 3 && !final)
+	    return 0;
+	if (cs->npend == 3) {
+	    const unsigned char *q = cs->pend;
+
+	    *p++ = alphabet[q[0] >> 2];
+	    *p++ = alphabet[((q[0] & 3) << 4) | (q[1] >> 4)];
+	    *p++ = alphabet[((q[1] & 0xF) << 2) | (q[2] >> 6)];
+	    *p++ = alphabet[q[2] & 0x3F];
+	    cs->npend = 0;
+	}
+	else {
+	    s = cs->pend;
+	    n = cs->npend;
+	    cs->npend = 0;
+	}
+    }
+
+#ifdef __SSSE3__
+    {
+	const __m128i lut = pad
+	 ? _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+	  -19, -16, 0, 0)
+	 : _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+	  -17, 32, 0, 0);
+
+	for (; n >= 16; n -= 12, s += 12, p += 16) {
+	    const __m128i in = _mm_loadu_si128((const __m128i *) s);
+
+	    _mm_storeu_si128((__m128i *) p, base64_encode16(in, lut));
+	}
+    }
+#endif
+    for (; n >= 3; n -= 3, s += 3) {
+	*p++ = alphabet[s[0] >> 2];
+	*p++ = alphabet[((s[0] & 3) << 4) | (s[1] >> 4)];
+	*p++ = alphabet[((s[1] & 0xF) << 2) | (s[2] >> 6)];
+	*p++ = alphabet[s[2] & 0x3F];
+    }
+
+    if (n) {
+	if (!final) {
+	    memcpy(cs->pend, s, n);
+	    cs->npend = n;
+	}
+	else {
+	    *p++ = alphabet[s[0] >> 2];
+	    if (n == 1) {
+		*p++ = alphabet[(s[0] & 3) << 4];
+		if (pad) {
+		    *p++ = '=';
+		    *p++ = '=';
+		}
+	    }
+	    else {
+		*p++ = alphabet[((s[0] & 3) << 4) | (s[1] >> 4)];
+		*p++ = alphabet[(s[1] & 0xF) << 2];
+		if (pad) *p++ = '=';
+	    }
+	}
+    }
+    return p - d;
+}
+
+/*
+ * Returns: number of output bytes or -1 (malformed input)
+ */
+static int
+base64_decode (struct codec *cs, const unsigned char *s, size_t n,
+               int final, char *d)
+{
+    const unsigned char *table = base64_dectable[cs->kind == CODEC_BASE64URL];
+    unsigned char *q = cs->pend;
+    char *p = d;
+
+    for (; ; ) {
+	/* whole quartets */
+	if (!cs->npend && !cs->padded) {
+	    for (; n >= 4; n -= 4, s += 4) {
+		const unsigned int a = table[s[0]], b = table[s[1]];
+		const unsigned int c = table[s[2]], e = table[s[3]];
+
+		if ((a | b | c | e) & 0xC0) break;  /* not a sextet */
+		*p++ = (char) ((a << 2) | (b >> 4));
+		*p++ = (char) ((b << 4) | (c >> 2));
+		*p++ = (char) ((c << 6) | e);
+	    }
+	}
+	if (!n) break;
+
+	/* character by character */
+	if (*s == '=') {
+	    if (!cs->padded) {
+		if (cs->npend < 2) return -1;
+		*p++ = (char) ((q[0] << 2) | (q[1] >> 4));
+		if (cs->npend == 3)
+		    *p++ = (char) ((q[1] << 4) | (q[2] >> 2));
+		cs->npend = 0;
+		cs->padded = 1;
+	    }
+	}
+	else {
+	    const unsigned int v = table[*s];
+
+	    if (v == CODEC_BAD || cs->padded) return -1;
+	    q[cs->npend++] = v;
+	    if (cs->npend == 4) {
+		*p++ = (char) ((q[0] << 2) | (q[1] >> 4));
+		*p++ = (char) ((q[1] << 4) | (q[2] >> 2));
+		*p++ = (char) ((q[2] << 6) | q[3]);
+		cs->npend = 0;
+	    }
+	}
+	++s;
+	--n;
+    }
+
+    if (final && cs->npend) {
+	/* unpadded tail */
+	if (cs->npend < 2) return -1;
+	*p++ = (char) ((q[0] << 2) | (q[1] >> 4));
+	if (cs->npend == 3)
+	    *p++ = (char) ((q[1] << 4) | (q[2] >> 2));
+	cs->npend = 0;
+    }
+    return p - d;
+}
+
+/*
+ * Returns: number of output characters
+ */
+static size_t
+hex_encode (const unsigned char *s, size_t n, char *d)
+{
+    char *p = d;
+
+#ifdef __SSSE3__
+    {
+	const __m128i lut = _mm_loadu_si128((const __m128i *) hex_digits);
+	const __m128i mask = _mm_set1_epi8(0x0F);
+
+	for (; n >= 16; n -= 16, s += 16, p += 32) {
+	    const __m128i in = _mm_loadu_si128((const __m128i *) s);
+	    const __m128i hi = _mm_shuffle_epi8(lut,
+	     _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+	    const __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(in, mask));
+
+	    _mm_storeu_si128((__m128i *) p, _mm_unpacklo_epi8(hi, lo));
+	    _mm_storeu_si128((__m128i *) (p + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+    }
+#endif
+    for (; n; --n, ++s) {
+	*p++ = hex_digits[*s >> 4];
+	*p++ = hex_digits[*s & 0xF];
+    }
+    return p - d;
+}
+
+/*
+ * Returns: number of output bytes or -1 (malformed input)
+ */
+static int
+hex_decode (struct codec *cs, const unsigned char *s, size_t n,
+            int final, char *d)
+{
+    char *p = d;
+
+    if (cs->npend && n) {
+	const unsigned int v = hex_dectable[*s++];
+
+	if (v == CODEC_BAD) return -1;
+	*p++ = (char) ((cs->pend[0] << 4) | v);
+	cs->npend = 0;
+	--n;
+    }
+    for (; n >= 2; n -= 2, s += 2) {
+	const unsigned int hi = hex_dectable[s[0]], lo = hex_dectable[s[1]];
+
+	if (hi == CODEC_BAD || lo == CODEC_BAD) return -1;
+	*p++ = (char) ((hi << 4) | lo);
+    }
+    if (n) {
+	const unsigned int v = hex_dectable[*s];
+
+	if (v == CODEC_BAD) return -1;
+	cs->pend[0] = v;
+	cs->npend = 1;
+    }
+    if (final && cs->npend) return -1;
+    return p - d;
+}
+
+/*
+ * Returns: number of output bytes or -1 (malformed input)
+ */
+static int
+codec_step (struct codec *cs, const char *s, size_t n, int final, char *d)
+{
+    const unsigned char *us = (const unsigned char *) s;
+
+    if (!cs->decode) {
+	return (int) ((cs->kind == CODEC_HEX) ? hex_encode(us, n, d)
+	 : base64_encode(cs, us, n, final, d));
+    }
+    return (cs->kind == CODEC_HEX) ? hex_decode(cs, us, n, final, d)
+     : base64_decode(cs, us, n, final, d);
+}
+
+/*
+ * Copy the output to the buffer windows.
+ * Returns: 0 (out of memory) | 1
+ */
+static int
+codec_write (lua_State *L, struct sys_buffer *sb, char *buf, size_t *posp,
+             const char *s, size_t n)
+{
+    size_t pos = *posp;
+
+    for (; ; ) {
+	size_t len = sb->size - pos;
+
+	if (len > n) len = n;
+	memcpy(sb->ptr.w + pos, s, len);
+	pos += len;
+	s += len;
+	n -= len;
+	if (!n) break;
+
+	if (!sys_buffer_write_next(L, sb, buf, 0))
+	    return 0;
+	pos = 0;
+    }
+    *posp = pos;
+    return 1;
+}
+
+/*
+ * Arguments: ..., data (string | membuf_udata), [membuf_udata]
+ * Returns: [string | count (number)]
+ */
+static int
+codec_run (lua_State *L, struct codec *cs, int idx, int final)
+{
+    struct sys_buffer sb, isb;
+    const char *s;
+    size_t n, pos = 0, total = 0;
+    char buf[SYS_BUFSIZE];
+    char tmp[CODEC_OUTMAX];
+    int offset, err = 0;
+
+    if (!codec_tables_ready) codec_inittables();
+
+    if (lua_isnoneornil(L, idx)) {
+	s = NULL;
+	n = 0;
+    }
+    else if (!sys_buffer_read_init(L, idx, &isb))
+	return luaL_typeerror(L, idx, "string or membuf");
+    else {
+	s = isb.ptr.r;
+	n = isb.size;
+    }
+
+    sys_buffer_write_init(L, idx + 1, &sb, buf, sizeof(buf));
+    offset = sb.mb ? sb.mb->offset : 0;
+    do {
+	const size_t len = (n < CODEC_INCHUNK) ? n : CODEC_INCHUNK;
+	const int is_final = final && (len == n);
+	const int direct = (sb.size - pos >= CODEC_OUTMAX);
+	char *d = direct ? sb.ptr.w + pos : tmp;
+	const int nout = codec_step(cs, s, len, is_final, d);
+
+	if (nout < 0) {
+	    err = CODEC_EINVAL;
+	    break;
+	}
+	if (direct)
+	    pos += nout;
+	else if (!codec_write(L, &sb, buf, &pos, tmp, nout)) {
+	    err = ENOMEM;
+	    break;
+	}
+	total += nout;
+	s += len;
+	n -= len;
+    } while (n);
+
+    if (sys_buffer_write_done(L, &sb, buf, pos)) {
+	if (err) lua_pop(L, 1);
+    }
+    else if (err)
+	sb.mb->offset = offset;  /* discard the partial output */
+    else
+	lua_pushnumber(L, (lua_Number) total);
+
+    return err ? sys_seterror(L, err) : 1;
+}
+
+
+/*
+ * Arguments: codec (string: "base64", "base64url", "hex"),
+ *	data (string | membuf_udata), [membuf_udata]
+ * Returns: [string | count (number)]
+ */
+static int
+mem_encode (lua_State *L)
+{
+    struct codec cs;
+
+    memset(&cs, 0, sizeof(struct codec));
+    cs.kind = luaL_checkoption(L, 1, NULL, codec_names);
+    luaL_checkany(L, 2);
+    return codec_run(L, &cs, 2, 1);
+}
+
+/*
+ * Arguments: codec (string: "base64", "base64url", "hex"),
+ *	data (string | membuf_udata), [membuf_udata]
+ * Returns: [string | count (number)]
+ */
+static int
+mem_decode (lua_State *L)
+{
+    struct codec cs;
+
+    memset(&cs, 0, sizeof(struct codec));
+    cs.kind = luaL_checkoption(L, 1, NULL, codec_names);
+    cs.decode = 1;
+    luaL_checkany(L, 2);
+    return codec_run(L, &cs, 2, 1);
+}
+
+static int
+codec_new (lua_State *L, int decode)
+{
+    struct codec *cs = lua_newuserdata(L, sizeof(struct codec));
+
+    memset(cs, 0, sizeof(struct codec));
+    cs->kind = luaL_checkoption(L, 1, NULL, codec_names);
+    cs->decode = decode;
+    luaL_getmetatable(L, CODEC_TYPENAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/*
+ * Arguments: codec (string: "base64", "base64url", "hex")
+ * Returns: codec_udata
+ */
+static int
+mem_encoder (lua_State *L)
+{
+    return codec_new(L, 0);
+}
+
+/*
+ * Arguments: codec (string: "base64", "base64url", "hex")
+ * Returns: codec_udata
+ */
+static int
+mem_decoder (lua_State *L)
+{
+    return codec_new(L, 1);
+}
+
+/*
+ * Arguments: codec_udata, data (string | membuf_udata), [membuf_udata]
+ * Returns: [string | count (number)]
+ */
+static int
+codec_update (lua_State *L)
+{
+    struct codec *cs = checkudata(L, 1, CODEC_TYPENAME);
+
+    luaL_checkany(L, 2);
+    return codec_run(L, cs, 2, 0);
+}
+
+/*
+ * Arguments: codec_udata, [membuf_udata]
+ * Returns: [string | count (number)]
+ */
+static int
+codec_finish (lua_State *L)
+{
+    struct codec *cs = checkudata(L, 1, CODEC_TYPENAME);
+    int res;
+
+    lua_settop(L, 2);
+    lua_pushnil(L);  /* no data */
+    lua_insert(L, 2);
+    res = codec_run(L, cs, 2, 1);
+
+    cs->npend = 0;
+    cs->padded = 0;
+    return res;
+}
+
+/*
+ * Arguments: codec_udata
+ * Returns: string
+ */
+static int
+codec_tostring (lua_State *L)
+{
+    struct codec *cs = checkudata(L, 1, CODEC_TYPENAME);
+
+    lua_pushfstring(L, CODEC_TYPENAME " (%s %s %p)", codec_names[cs->kind],
+     cs->decode ? "decoder" : "encoder", cs);
+    return 1;
+}
+
+
+static luaL_reg codec_meth[] = {
+    {"update",		codec_update},
+    {"finish",		codec_finish},
+    {"__tostring",	codec_tostring},
+    {NULL, NULL}
+};
@@ -0,0 +1,218 @@
+/* Lua System: Memory Buffers: Delimited Text Tokenizer */
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Tokenizer parameters */
+struct csv_spec {
+    int fdelim;  /* field delimiter */
+    int rdelim;  /* record delimiter */
+    int quote;  /* quote character or -1 */
+};
+
+/* Output integral buffer */
+struct csv_out {
+    char *data;
+    size_t size;  /* element size */
+    size_t max;  /* capacity in elements */
+    size_t n;  /* number of elements */
+};
+
+
+/*
+ * Returns: pointer to the first of the characters c1 or c2 or end
+ */
+static const char *
+csv_scan2 (const char *s, const char *end, int c1, int c2)
+{
+#if defined(__AVX2__)
+    const __m256i v1 = _mm256_set1_epi8((char) c1);
+    const __m256i v2 = _mm256_set1_epi8((char) c2);
+
+    for (; s + 32 <= end; s += 32) {
+	const __m256i v = _mm256_loadu_si256((const __m256i *) s);
+	const unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+	 _mm256_or_si256(_mm256_cmpeq_epi8(v, v1), _mm256_cmpeq_epi8(v, v2)));
+
+	if (mask) return s + mem_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i v1 = _mm_set1_epi8((char) c1);
+    const __m128i v2 = _mm_set1_epi8((char) c2);
+
+    for (; s + 16 <= end; s += 16) {
+	const __m128i v = _mm_loadu_si128((const __m128i *) s);
+	const unsigned int mask = (unsigned int) _mm_movemask_epi8(
+	 _mm_or_si128(_mm_cmpeq_epi8(v, v1), _mm_cmpeq_epi8(v, v2)));
+
+	if (mask) return s + mem_ctz(mask);
+    }
+#endif
+    for (; s < end; ++s) {
+	if (*s == (char) c1 || *s == (char) c2)
+	    break;
+    }
+    return s;
+}
+
+/*
+ * Arguments: ..., membuf_udata (integral type), ...
+ */
+static void
+csv_checkout (lua_State *L, int idx, struct csv_out *out)
+{
+    struct membuf *mb = mem_checkbuffer(L, idx);
+    const int type = memtype(mb);
+
+    if (!mb->data || (type != SYSMEM_TINT && type != SYSMEM_TUINT
+     && type != SYSMEM_TLONG && type != SYSMEM_TULONG))
+	luaL_argerror(L, idx, "integral type expected");
+
+    out->data = mb->data;
+    out->size = memtypesize(mb);
+    out->max = mb->len / out->size;
+    out->n = 0;
+}
+
+static void
+csv_put (struct csv_out *out, long v)
+{
+    char *p = out->data + out->n++ * out->size;
+
+    if (out->size == sizeof(int))
+	*((int *) p) = (int) v;
+    else
+	*((long *) p) = v;
+}
+
+static int
+csv_checkchar (lua_State *L, int idx, const char *def)
+{
+    size_t len;
+    const char *s = luaL_optlstring(L, idx, def, &len);
+
+    if (len > 1)
+	luaL_argerror(L, idx, "single character expected");
+    return len ? (unsigned char) *s : -1;
+}
+
+/*
+ * Arguments: membuf_udata, fields (membuf_udata: "int", "uint", "long", "ulong"),
+ *	[records (membuf_udata), offset (number), eof (boolean),
+ *	field_delimiter (string: ","), record_delimiter (string: "\n"),
+ *	quote (string: "\"")]
+ * Returns: number of fields (number), number of records (number),
+ *	next_offset (number)
+ *
+ * Fails with ENOBUFS when the first record doesn't fit in the output.
+ */
+static int
+mem_tokenize (lua_State *L)
+{
+    struct sys_buffer sb;
+    struct csv_spec spec;
+    struct csv_out fields, records;
+    const int has_records = !lua_isnoneornil(L, 3);
+    const size_t off = (size_t) luaL_optinteger(L, 4, 0);
+    const int eof = lua_toboolean(L, 5);
+    const char *base, *s, *end;
+    const char *rec;  /* start of the current record */
+    size_t nrec = 0, rec_fields = 0;
+    int full = 0;  /* output buffers are full */
+
+    mem_checkbuffer(L, 1);
+    mem_read_init(L, 1, &sb);
+    csv_checkout(L, 2, &fields);
+    if (has_records)
+	csv_checkout(L, 3, &records);
+    else
+	records.max = records.n = 0;
+
+    spec.fdelim = csv_checkchar(L, 6, ",");
+    spec.rdelim = csv_checkchar(L, 7, "\n");
+    spec.quote = csv_checkchar(L, 8, "\"");
+    if (spec.fdelim == -1 || spec.rdelim == -1)
+	luaL_argerror(L, 6, "delimiter expected");
+
+    if (off > sb.size)
+	luaL_argerror(L, 4, "out of bounds");
+
+    base = sb.ptr.r;
+    rec = s = base + off;
+    end = base + sb.size;
+
+    while (s < end || (eof && s == end && s != rec)) {
+	const char *field = s, *p;
+	long len;
+	int is_last;  /* last field of record */
+
+	if (fields.n + 2 > fields.max
+	 || (has_records && records.n == records.max)) {
+	    full = 1;
+	    break;
+	}
+
+	if (spec.quote != -1 && s < end && *s == (char) spec.quote) {
+	    /* quoted field */
+	    int escaped = 0;
+
+	    field = ++s;
+	    for (; ; ) {
+		p = memchr(s, spec.quote, end - s);
+		if (!p) goto partial;
+		if (p + 1 < end && p[1] == (char) spec.quote) {
+		    escaped = 1;
+		    s = p + 2;
+		    continue;
+		}
+		if (p + 1 == end && !eof) goto partial;
+		break;
+	    }
+	    len = (long) (p - field);
+	    if (escaped) len = -len;
+
+	    /* ignore characters after the closing quote */
+	    s = csv_scan2(p + 1, end, spec.fdelim, spec.rdelim);
+	}
+	else {
+	    s = csv_scan2(s, end, spec.fdelim, spec.rdelim);
+	    len = (long) (s - field);
+
+	    /* CRLF */
+	    if (spec.rdelim == '\n' && len && s[-1] == '\r'
+	     && (s == end || *s == '\n'))
+		--len;
+	}
+
+	if (s == end) {
+	    if (!eof) goto partial;
+	    is_last = 1;
+	}
+	else {
+	    is_last = (*s == (char) spec.rdelim);
+	    ++s;
+	}
+
+	csv_put(&fields, (long) (field - base));
+	csv_put(&fields, len);
+
+	if (is_last) {
+	    rec_fields = fields.n;
+	    if (has_records)
+		csv_put(&records, (long) (rec_fields / 2));
+	    ++nrec;
+	    rec = s;
+	}
+    }
+ partial:
+    /* the record doesn't fit: don't make the caller loop forever */
+    if (full && !nrec)
+	return sys_seterror(L, ENOBUFS);
+
+    /* fields of incomplete record are dropped */
+    lua_pushnumber(L, (lua_Number) (rec_fields / 2));
+    lua_pushnumber(L, (lua_Number) nrec);
+    lua_pushnumber(L, (lua_Number) (rec - base));
+    return 3;
+}
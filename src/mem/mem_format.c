@@ -0,0 +1,412 @@
+/* Lua System: Memory Buffers: Formatted Output */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FMT_NUMMAX	512  /* max. length of formatted number */
+#define FMT_SPECMAX	16  /* max. length of conversion specification */
+#define FMT_FLAGS	"-+ #0"
+
+#define fmt_isdigit(c)	((c) >= '0' && (c) <= '9')
+
+static const char fmt_digits2[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+
+/*
+ * Returns: pointer to the tail of buffer with room for n bytes or NULL
+ */
+static char *
+fmt_reserve (lua_State *L, struct membuf *mb, size_t n)
+{
+    return membuf_addlstring(L, mb, NULL, n) ? mb->data + mb->offset : NULL;
+}
+
+/*
+ * Returns: number of digits written backwards from the end
+ */
+static int
+fmt_uint64 (char *end, uint64_t v)
+{
+    char *p = end;
+
+    while (v >= 100) {
+	const unsigned int i = (unsigned int) (v % 100) * 2;
+
+	v /= 100;
+	*(--p) = fmt_digits2[i + 1];
+	*(--p) = fmt_digits2[i];
+    }
+    if (v >= 10) {
+	const unsigned int i = (unsigned int) v * 2;
+
+	*(--p) = fmt_digits2[i + 1];
+	*(--p) = fmt_digits2[i];
+    }
+    else
+	*(--p) = (char) ('0' + (int) v);
+    return (int) (end - p);
+}
+
+/*
+ * Returns: length of the integer part of number
+ */
+static size_t
+fmt_int (char *s, lua_Number num)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    int n;
+
+    if (!(num > -9.2233720368547e18 && num < 9.2233720368547e18))
+	return (size_t) sprintf(s, "%.0f", (double) num);
+
+    {
+	const int64_t v = (int64_t) num;
+
+	n = fmt_uint64(end, (v < 0) ? (uint64_t) 0 - (uint64_t) v : (uint64_t) v);
+	if (v < 0) end[-(++n)] = '-';
+    }
+    memcpy(s, end - n, n);
+    return n;
+}
+
+/*
+ * Returns: length of number formatted as LUA_NUMBER_FMT
+ */
+static size_t
+fmt_number (char *s, lua_Number num)
+{
+    /* integral values print the same as "%.14g" */
+    if (num != 0 && num > -1e14 && num < 1e14 && num == (lua_Number) (int64_t) num)
+	return fmt_int(s, num);
+    return (size_t) sprintf(s, LUA_NUMBER_FMT, (double) num);
+}
+
+/*
+ * Returns: pointer to the first character needing JSON escaping or end
+ */
+static const char *
+fmt_jsonscan (const char *s, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i vctl = _mm_set1_epi8(0x1F);
+    const __m128i vquote = _mm_set1_epi8('"');
+    const __m128i vslash = _mm_set1_epi8('\\');
+
+    for (; s + 16 <= end; s += 16) {
+	const __m128i v = _mm_loadu_si128((const __m128i *) s);
+	const __m128i ctl = _mm_cmpeq_epi8(_mm_max_epu8(v, vctl), vctl);
+	const unsigned int mask = (unsigned int) _mm_movemask_epi8(
+	 _mm_or_si128(ctl, _mm_or_si128(_mm_cmpeq_epi8(v, vquote),
+	 _mm_cmpeq_epi8(v, vslash))));
+
+	if (mask) return s + mem_ctz(mask);
+    }
+#endif
+    for (; s < end; ++s) {
+	const unsigned char c = *s;
+	if (c < 0x20 || c == '"' || c == '\\')
+	    break;
+    }
+    return s;
+}
+
+/*
+ * Append JSON string contents (without enclosing quotes).
+ */
+static int
+fmt_addjson (lua_State *L, struct membuf *mb, const char *s, size_t len)
+{
+    const char *end = s + len;
+
+    while (s < end) {
+	const char *p = fmt_jsonscan(s, end);
+	unsigned char c;
+	char *out;
+
+	if (p != s && !membuf_addlstring(L, mb, s, p - s))
+	    return 0;
+	if (p == end) break;
+
+	if (!(out = fmt_reserve(L, mb, 6)))
+	    return 0;
+	c = *p;
+	out[0] = '\\';
+	switch (c) {
+	case '"': case '\\': out[1] = c; break;
+	case '\b': out[1] = 'b'; break;
+	case '\f': out[1] = 'f'; break;
+	case '\n': out[1] = 'n'; break;
+	case '\r': out[1] = 'r'; break;
+	case '\t': out[1] = 't'; break;
+	default:
+	    out[1] = 'u';
+	    out[2] = out[3] = '0';
+	    out[4] = hex_digits[c >> 4];
+	    out[5] = hex_digits[c & 15];
+	    mb->offset += 4;
+	}
+	mb->offset += 2;
+	s = p + 1;
+    }
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, ..., string | membuf_udata, ...
+ */
+static void
+fmt_checkdata (lua_State *L, int idx, struct membuf *mb, struct sys_buffer *sb)
+{
+    if (!sys_buffer_read_init(L, idx, sb))
+	luaL_typerror(L, idx, "string or membuf");
+    if (sb->mb == mb)
+	luaL_argerror(L, idx, "source and target buffers are the same");
+}
+
+/*
+ * Append string with width and precision of "%s" conversion.
+ */
+static int
+fmt_addpadded (lua_State *L, struct membuf *mb, const char *s, size_t len,
+               int left, int width, int prec)
+{
+    size_t pad = 0;
+
+    if (prec >= 0 && len > (size_t) prec)
+	len = prec;
+    if ((size_t) width > len)
+	pad = width - len;
+
+    if (pad && !left) {
+	char *out = fmt_reserve(L, mb, pad);
+	if (!out) return 0;
+	memset(out, ' ', pad);
+	mb->offset += pad;
+    }
+    if (len && !membuf_addlstring(L, mb, s, len))
+	return 0;
+    if (pad && left) {
+	char *out = fmt_reserve(L, mb, pad);
+	if (!out) return 0;
+	memset(out, ' ', pad);
+	mb->offset += pad;
+    }
+    return 1;
+}
+
+/*
+ * Returns: pointer to the conversion character
+ */
+static const char *
+fmt_scanspec (lua_State *L, const char *p, char *spec, int *widthp, int *precp)
+{
+    const char *start = p;
+    int width = 0, prec = -1;
+
+    while (*p && strchr(FMT_FLAGS, *p))
+	++p;
+    if ((size_t) (p - start) >= sizeof(FMT_FLAGS))
+	luaL_error(L, "invalid format (repeated flags)");
+    if (fmt_isdigit(*p))
+	width = *p++ - '0';
+    if (fmt_isdigit(*p))
+	width = width * 10 + (*p++ - '0');
+    if (*p == '.') {
+	++p;
+	prec = 0;
+	if (fmt_isdigit(*p))
+	    prec = *p++ - '0';
+	if (fmt_isdigit(*p))
+	    prec = prec * 10 + (*p++ - '0');
+    }
+    if (fmt_isdigit(*p))
+	luaL_error(L, "invalid format (width or precision too long)");
+
+    *spec++ = '%';
+    memcpy(spec, start, p - start);
+    spec[p - start] = '\0';
+    *widthp = width;
+    *precp = prec;
+    return p;
+}
+
+/*
+ * Append spec with length modifier and conversion character.
+ */
+static void
+fmt_addconv (char *spec, const char *mod, int conv)
+{
+    const size_t n = strlen(spec), m = strlen(mod);
+
+    memcpy(spec + n, mod, m);
+    spec[n + m] = (char) conv;
+    spec[n + m + 1] = '\0';
+}
+
+/*
+ * Arguments: membuf_udata, format (string), ...
+ * Returns: [boolean]
+ */
+static int
+mem_writef (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    size_t fmt_len;
+    const char *fmt = luaL_checklstring(L, 2, &fmt_len);
+    const char *fmt_end = fmt + fmt_len;
+    int arg = 2;
+
+    while (fmt < fmt_end) {
+	const char *p = memchr(fmt, '%', fmt_end - fmt);
+	char spec[FMT_SPECMAX];
+	int width, prec, conv;
+	char *out;
+
+	if (!p) p = fmt_end;
+	if (p != fmt && !membuf_addlstring(L, mb, fmt, p - fmt))
+	    return 0;
+	if (p == fmt_end) break;
+
+	if (p[1] == '%') {
+	    if (!membuf_addlstring(L, mb, p, 1))
+		return 0;
+	    fmt = p + 2;
+	    continue;
+	}
+
+	p = fmt_scanspec(L, p + 1, spec, &width, &prec);
+	conv = (unsigned char) *p;
+	fmt = p + 1;
+	++arg;
+
+	switch (conv) {
+	case 'd': case 'i':
+	    {
+		const lua_Number num = luaL_checknumber(L, arg);
+
+		if (!(out = fmt_reserve(L, mb, FMT_NUMMAX)))
+		    return 0;
+		if (spec[1]) {
+		    fmt_addconv(spec, "l", 'd');
+		    mb->offset += sprintf(out, spec, (long) num);
+		}
+		else
+		    mb->offset += fmt_int(out, num);
+	    }
+	    break;
+	case 'u': case 'o': case 'x': case 'X':
+	    {
+		const lua_Number num = luaL_checknumber(L, arg);
+
+		if (!(out = fmt_reserve(L, mb, FMT_NUMMAX)))
+		    return 0;
+		fmt_addconv(spec, "l", conv);
+		mb->offset += sprintf(out, spec, (unsigned long) (long) num);
+	    }
+	    break;
+	case 'c':
+	    {
+		const int c = (int) luaL_checkinteger(L, arg);
+
+		if (!(out = fmt_reserve(L, mb, FMT_NUMMAX)))
+		    return 0;
+		fmt_addconv(spec, "", 'c');
+		mb->offset += sprintf(out, spec, c);
+	    }
+	    break;
+	case 'e': case 'E': case 'f': case 'g': case 'G':
+	    {
+		const lua_Number num = luaL_checknumber(L, arg);
+
+		if (!(out = fmt_reserve(L, mb, FMT_NUMMAX)))
+		    return 0;
+		if (spec[1] || conv != 'g') {
+		    fmt_addconv(spec, "", conv);
+		    mb->offset += sprintf(out, spec, (double) num);
+		}
+		else
+		    mb->offset += fmt_number(out, num);
+	    }
+	    break;
+	case 's': case 'j':
+	    {
+		struct sys_buffer sb;
+
+		fmt_checkdata(L, arg, mb, &sb);
+		if (!(conv == 's'
+		 ? fmt_addpadded(L, mb, sb.ptr.r, sb.size,
+		 (strchr(spec, '-') != NULL), width, prec)
+		 : fmt_addjson(L, mb, sb.ptr.r, sb.size)))
+		    return 0;
+	    }
+	    break;
+	default:
+	    return luaL_error(L, "invalid option '%%%c' to 'writef'", conv);
+	}
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, number
+ * Returns: [boolean]
+ */
+static int
+mem_append_int (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const lua_Number num = luaL_checknumber(L, 2);
+    char *out;
+
+    if (!(out = fmt_reserve(L, mb, FMT_NUMMAX)))
+	return 0;
+    mb->offset += fmt_int(out, num);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, number, [precision (number)]
+ * Returns: [boolean]
+ */
+static int
+mem_append_float (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const lua_Number num = luaL_checknumber(L, 2);
+    const int prec = (int) luaL_optinteger(L, 3, -1);
+    char *out;
+
+    if (prec > 99)
+	luaL_argerror(L, 3, "precision too long");
+
+    if (!(out = fmt_reserve(L, mb, FMT_NUMMAX)))
+	return 0;
+    mb->offset += (prec < 0) ? fmt_number(out, num)
+     : (size_t) sprintf(out, "%.*f", prec, (double) num);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, string | membuf_udata
+ * Returns: [boolean]
+ */
+static int
+mem_append_escaped_json (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    struct sys_buffer sb;
+
+    fmt_checkdata(L, 2, mb, &sb);
+    if (!fmt_addjson(L, mb, sb.ptr.r, sb.size))
+	return 0;
+    lua_pushboolean(L, 1);
+    return 1;
+}
@@ -0,0 +1,523 @@
+/* Lua System: Memory Buffers: Hashing */
+
+#define HASH_UINT64(hi,lo)	(((uint64_t) (hi) << 32) | (uint32_t) (lo))
+
+#define XXH_PRIME64_1	HASH_UINT64(0x9E3779B1, 0x85EBCA87)
+#define XXH_PRIME64_2	HASH_UINT64(0xC2B2AE3D, 0x27D4EB4F)
+#define XXH_PRIME64_3	HASH_UINT64(0x165667B1, 0x9E3779F9)
+#define XXH_PRIME64_4	HASH_UINT64(0x85EBCA77, 0xC2B2AE63)
+#define XXH_PRIME64_5	HASH_UINT64(0x27D4EB2F, 0x165667C5)
+
+#define hash_rotl64(x,r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+
+static uint64_t
+hash_read64 (const unsigned char *p)
+{
+    return HASH_UINT64(p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24),
+     p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24));
+}
+
+static uint32_t
+hash_read32 (const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+#else
+
+static uint64_t
+hash_read64 (const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+    return v;
+}
+
+static uint32_t
+hash_read32 (const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+#endif
+
+
+static uint64_t
+xxh64_round (uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = hash_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static uint64_t
+xxh64_merge (uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/*
+ * Process the tail (less than 32 bytes) and avalanche.
+ */
+static uint64_t
+xxh64_finalize (uint64_t h, const unsigned char *p, size_t n)
+{
+    const unsigned char *endp = p + n;
+
+    for (; p + 8 <= endp; p += 8) {
+	h ^= xxh64_round(0, hash_read64(p));
+	h = hash_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= endp) {
+	h ^= (uint64_t) hash_read32(p) * XXH_PRIME64_1;
+	h = hash_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+	p += 4;
+    }
+    for (; p < endp; ++p) {
+	h ^= (uint64_t) *p * XXH_PRIME64_5;
+	h = hash_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * Process the 32-byte stripes.
+ * Returns: pointer to the rest of data
+ */
+static const unsigned char *
+xxh64_stripes (uint64_t v[4], const unsigned char *p, size_t n)
+{
+    const unsigned char *endp = p + n;
+
+    for (; p + 32 <= endp; p += 32) {
+	v[0] = xxh64_round(v[0], hash_read64(p));
+	v[1] = xxh64_round(v[1], hash_read64(p + 8));
+	v[2] = xxh64_round(v[2], hash_read64(p + 16));
+	v[3] = xxh64_round(v[3], hash_read64(p + 24));
+    }
+    return p;
+}
+
+static void
+xxh64_initstripes (uint64_t v[4], uint64_t seed)
+{
+    v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    v[1] = seed + XXH_PRIME64_2;
+    v[2] = seed;
+    v[3] = seed - XXH_PRIME64_1;
+}
+
+static uint64_t
+xxh64_mergestripes (const uint64_t v[4])
+{
+    uint64_t h = hash_rotl64(v[0], 1) + hash_rotl64(v[1], 7)
+     + hash_rotl64(v[2], 12) + hash_rotl64(v[3], 18);
+
+    h = xxh64_merge(h, v[0]);
+    h = xxh64_merge(h, v[1]);
+    h = xxh64_merge(h, v[2]);
+    h = xxh64_merge(h, v[3]);
+    return h;
+}
+
+/*
+ * XXH64 of the data.
+ */
+static uint64_t
+hash_xxh64 (const char *s, size_t n, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    uint64_t h;
+
+    if (n >= 32) {
+	uint64_t v[4];
+
+	xxh64_initstripes(v, seed);
+	p = xxh64_stripes(v, p, n);
+	h = xxh64_mergestripes(v);
+    }
+    else
+	h = seed + XXH_PRIME64_5;
+
+    h += (uint64_t) n;
+    return xxh64_finalize(h, p, n - (p - (const unsigned char *) s));
+}
+
+
+/*
+ * CRC-32C (Castagnoli)
+ */
+
+#if defined(__SSE4_2__) && (defined(__x86_64__) || defined(_M_X64))
+
+#include <nmmintrin.h>
+
+static uint32_t
+hash_crc32c (uint32_t crc, const char *s, size_t n)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    uint64_t c = ~crc;
+
+    for (; n && ((size_t) p & 7); --n)
+	c = _mm_crc32_u8((uint32_t) c, *p++);
+    for (; n >= 8; n -= 8, p += 8)
+	c = _mm_crc32_u64(c, *((const uint64_t *) p));
+    for (; n; --n)
+	c = _mm_crc32_u8((uint32_t) c, *p++);
+    return ~(uint32_t) c;
+}
+
+#elif defined(__ARM_FEATURE_CRC32)
+
+#include <arm_acle.h>
+
+static uint32_t
+hash_crc32c (uint32_t crc, const char *s, size_t n)
+{
+    const unsigned char *p = (const unsigned char *) s;
+
+    crc = ~crc;
+    for (; n && ((size_t) p & 7); --n)
+	crc = __crc32cb(crc, *p++);
+    for (; n >= 8; n -= 8, p += 8)
+	crc = __crc32cd(crc, *((const uint64_t *) p));
+    for (; n; --n)
+	crc = __crc32cb(crc, *p++);
+    return ~crc;
+}
+
+#else
+
+#define CRC32C_POLY	0x82F63B78U  /* reflected */
+
+static uint32_t crc32c_table[8][256];
+static volatile int crc32c_table_ready;
+
+static void
+crc32c_inittable (void)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < 256; ++i) {
+	uint32_t c = i;
+
+	for (j = 0; j < 8; ++j)
+	    c = (c >> 1) ^ ((c & 1) ? CRC32C_POLY : 0);
+	crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; ++i) {
+	uint32_t c = crc32c_table[0][i];
+
+	for (j = 1; j < 8; ++j) {
+	    c = (c >> 8) ^ crc32c_table[0][c & 0xFF];
+	    crc32c_table[j][i] = c;
+	}
+    }
+    /* concurrent initializations write the same values */
+    crc32c_table_ready = 1;
+}
+
+/*
+ * Slicing-by-8.
+ */
+static uint32_t
+hash_crc32c (uint32_t crc, const char *s, size_t n)
+{
+    const unsigned char *p = (const unsigned char *) s;
+
+    if (!crc32c_table_ready) crc32c_inittable();
+
+    crc = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+	const uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16)
+	 | ((uint32_t) p[3] << 24));
+
+	crc = crc32c_table[7][lo & 0xFF]
+	 ^ crc32c_table[6][(lo >> 8) & 0xFF]
+	 ^ crc32c_table[5][(lo >> 16) & 0xFF]
+	 ^ crc32c_table[4][lo >> 24]
+	 ^ crc32c_table[3][p[4]]
+	 ^ crc32c_table[2][p[5]]
+	 ^ crc32c_table[1][p[6]]
+	 ^ crc32c_table[0][p[7]];
+    }
+    for (; n; --n)
+	crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+#endif
+
+
+#define HASHER_TYPENAME	"sys.mem.hasher"
+
+/* Hash functions */
+enum {
+    HASH_CRC32C,
+    HASH_XXH64
+};
+
+static const char *const hash_names[] = {"crc32c", "xxh64", NULL};
+
+/* Streaming state */
+struct hasher {
+    int kind;
+    unsigned int buflen;  /* buffered bytes of incomplete stripe */
+    uint32_t crc;
+    uint64_t seed;
+    uint64_t total;
+    uint64_t v[4];
+    unsigned char buf[32];
+};
+
+
+/*
+ * Arguments: ..., data (string | membuf_udata), ...,
+ *	[offset (number), num_bytes (number)]
+ * Returns: pointer to data
+ */
+static const char *
+hash_checkdata (lua_State *L, int idx, int off_idx, size_t *np)
+{
+    struct sys_buffer sb;
+    const lua_Integer off = luaL_optinteger(L, off_idx, 0);
+    lua_Integer n;
+
+    if (!mem_read_init(L, idx, &sb))
+	luaL_typeerror(L, idx, "string or membuf");
+
+    n = luaL_optinteger(L, off_idx + 1, (lua_Integer) sb.size - off);
+    if (off < 0 || n < 0 || (size_t) off + (size_t) n > sb.size)
+	luaL_argerror(L, off_idx, "out of bounds");
+
+    *np = (size_t) n;
+    return sb.ptr.r + off;
+}
+
+static uint64_t
+hash_checkseed (lua_State *L, int idx)
+{
+    const lua_Number num = luaL_optnumber(L, idx, 0);
+
+    return (num < 0) ? (uint64_t) (int64_t) num : (uint64_t) num;
+}
+
+static void
+hash_pushuint64 (lua_State *L, uint64_t h)
+{
+    lua_pushnumber(L, (lua_Number) (uint32_t) h);
+    lua_pushnumber(L, (lua_Number) (uint32_t) (h >> 32));
+}
+
+/*
+ * Arguments: data (string | membuf_udata), [crc (number),
+ *	offset (number), num_bytes (number)]
+ * Returns: crc (number)
+ */
+static int
+mem_crc32c (lua_State *L)
+{
+    const uint32_t crc = (uint32_t) hash_checkseed(L, 2);
+    size_t n;
+    const char *s = hash_checkdata(L, 1, 3, &n);
+
+    lua_pushnumber(L, hash_crc32c(crc, s, n));
+    return 1;
+}
+
+/*
+ * Arguments: data (string | membuf_udata), [seed (number),
+ *	offset (number), num_bytes (number)]
+ * Returns: low_32bits (number), high_32bits (number)
+ */
+static int
+mem_hash64 (lua_State *L)
+{
+    const uint64_t seed = hash_checkseed(L, 2);
+    size_t n;
+    const char *s = hash_checkdata(L, 1, 3, &n);
+
+    hash_pushuint64(L, hash_xxh64(s, n, seed));
+    return 2;
+}
+
+/*
+ * Arguments: data (string | membuf_udata), record_size (number),
+ *	hashes (membuf_udata: "int", "uint", "long", "ulong"),
+ *	[seed (number), offset (number), num_bytes (number)]
+ * Returns: number of hashed records (number)
+ */
+static int
+mem_hash_records (lua_State *L)
+{
+    const lua_Integer recsize = luaL_checkinteger(L, 2);
+    struct membuf *out = mem_checkbuffer(L, 3);
+    const uint64_t seed = hash_checkseed(L, 4);
+    const int type = memtype(out);
+    const int size = memtypesize(out);
+    size_t n, i, nrec;
+    const char *s = hash_checkdata(L, 1, 5, &n);
+
+    if (recsize <= 0)
+	luaL_argerror(L, 2, "positive number expected");
+    if (!out->data || (type != SYSMEM_TINT && type != SYSMEM_TUINT
+     && type != SYSMEM_TLONG && type != SYSMEM_TULONG))
+	luaL_argerror(L, 3, "integral type expected");
+
+    nrec = n / (size_t) recsize;
+    if (nrec > (size_t) out->len / size)
+	nrec = (size_t) out->len / size;
+
+    for (i = 0; i < nrec; ++i, s += recsize) {
+	const uint64_t h = hash_xxh64(s, (size_t) recsize, seed);
+
+	if (size == 4) {
+	    const uint32_t v = (uint32_t) h;
+	    memcpy(out->data + i * 4, &v, 4);
+	} else
+	    memcpy(out->data + i * 8, &h, 8);
+    }
+    lua_pushnumber(L, (lua_Number) nrec);
+    return 1;
+}
+
+
+static void
+hasher_reset (struct hasher *hs, uint64_t seed)
+{
+    hs->buflen = 0;
+    hs->crc = (uint32_t) seed;
+    hs->seed = seed;
+    hs->total = 0;
+    xxh64_initstripes(hs->v, seed);
+}
+
+/*
+ * Arguments: [function (string: "crc32c", "xxh64"), seed (number)]
+ * Returns: hasher_udata
+ */
+static int
+mem_hasher (lua_State *L)
+{
+    const int kind = luaL_checkoption(L, 1, "xxh64", hash_names);
+    const uint64_t seed = hash_checkseed(L, 2);
+    struct hasher *hs = lua_newuserdata(L, sizeof(struct hasher));
+
+    hs->kind = kind;
+    hasher_reset(hs, seed);
+    luaL_getmetatable(L, HASHER_TYPENAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/*
+ * Arguments: hasher_udata, data (string | membuf_udata),
+ *	[offset (number), num_bytes (number)]
+ * Returns: hasher_udata
+ */
+static int
+hasher_update (lua_State *L)
+{
+    struct hasher *hs = checkudata(L, 1, HASHER_TYPENAME);
+    size_t n;
+    const unsigned char *p = (const unsigned char *) hash_checkdata(L, 2, 3, &n);
+
+    if (hs->kind == HASH_CRC32C) {
+	hs->crc = hash_crc32c(hs->crc, (const char *) p, n);
+	goto end;
+    }
+
+    hs->total += n;
+    if (hs->buflen) {
+	size_t len = sizeof(hs->buf) - hs->buflen;
+
+	if (len > n) len = n;
+	memcpy(hs->buf + hs->buflen, p, len);
+	hs->buflen += len;
+	p += len;
+	n -= len;
+	if (hs->buflen < sizeof(hs->buf)) goto end;
+
+	xxh64_stripes(hs->v, hs->buf, sizeof(hs->buf));
+	hs->buflen = 0;
+    }
+    {
+	const unsigned char *rest = xxh64_stripes(hs->v, p, n);
+
+	hs->buflen = n - (rest - p);
+	memcpy(hs->buf, rest, hs->buflen);
+    }
+ end:
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: hasher_udata
+ * Returns: crc (number) | low_32bits (number), high_32bits (number)
+ */
+static int
+hasher_digest (lua_State *L)
+{
+    struct hasher *hs = checkudata(L, 1, HASHER_TYPENAME);
+    uint64_t h;
+
+    if (hs->kind == HASH_CRC32C) {
+	lua_pushnumber(L, hs->crc);
+	return 1;
+    }
+
+    h = (hs->total >= 32) ? xxh64_mergestripes(hs->v)
+     : hs->seed + XXH_PRIME64_5;
+    h += hs->total;
+    hash_pushuint64(L, xxh64_finalize(h, hs->buf, hs->buflen));
+    return 2;
+}
+
+/*
+ * Arguments: hasher_udata, [seed (number)]
+ * Returns: hasher_udata
+ */
+static int
+hasher_reset_state (lua_State *L)
+{
+    struct hasher *hs = checkudata(L, 1, HASHER_TYPENAME);
+
+    hasher_reset(hs, lua_isnoneornil(L, 2) ? hs->seed : hash_checkseed(L, 2));
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: hasher_udata
+ * Returns: string
+ */
+static int
+hasher_tostring (lua_State *L)
+{
+    struct hasher *hs = checkudata(L, 1, HASHER_TYPENAME);
+
+    lua_pushfstring(L, HASHER_TYPENAME " (%s %p)", hash_names[hs->kind], hs);
+    return 1;
+}
+
+
+static luaL_reg hasher_meth[] = {
+    {"update",		hasher_update},
+    {"digest",		hasher_digest},
+    {"reset",		hasher_reset_state},
+    {"__tostring",	hasher_tostring},
+    {NULL, NULL}
+};
@@ -0,0 +1,546 @@
+/* Lua System: Memory Buffers: Line Index */
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define LINES_TYPENAME	"sys.mem.lineindex"
+
+#define LINES_MAGIC	0x78646E4C  /* "Lndx" */
+#define LINES_CHUNK	(64 * 1024)  /* scan step */
+#define LINES_WINDOW	(16 * 1024 * 1024)  /* default window size */
+
+/* Persistent index header; newline offsets follow it */
+struct lines_header {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t nlines;  /* number of newline characters */
+    uint64_t scanned;  /* number of scanned bytes */
+};
+
+struct lineindex {
+    struct membuf *text;  /* text buffer or mapped window */
+    struct membuf *index;  /* index storage */
+    lua_Integer *fdp;  /* window mode: file handle */
+    size_t window;  /* window mode: window size */
+};
+
+/* Line index environ. table reserved indexes */
+enum {
+    LINES_TEXT = 1,
+    LINES_INDEX,
+    LINES_FD
+};
+
+#define lines_header(lx)	((struct lines_header *) (lx)->index->data)
+#define lines_offsets(lx)	((uint64_t *) (lines_header(lx) + 1))
+
+#define lines_textlen(mb) \
+    ((size_t) ((mb)->offset ? (mb)->offset : (mb)->len))
+
+
+/*
+ * Returns: number of newlines in the data
+ */
+static size_t
+lines_count (const char *s, size_t n)
+{
+    const char *endp = s + n;
+    size_t cnt = 0;
+
+#if defined(__AVX2__)
+    {
+	const __m256i nl = _mm256_set1_epi8('\n');
+
+	for (; s + 32 <= endp; s += 32) {
+	    const __m256i v = _mm256_loadu_si256((const __m256i *) s);
+	    cnt += bits_popcount64((uint32_t)
+	     _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+	}
+    }
+#elif defined(__SSE2__)
+    {
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	for (; s + 16 <= endp; s += 16) {
+	    const __m128i v = _mm_loadu_si128((const __m128i *) s);
+	    cnt += bits_popcount64((uint32_t)
+	     _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+	}
+    }
+#endif
+    for (; (s = memchr(s, '\n', endp - s)); ++s)
+	++cnt;
+    return cnt;
+}
+
+/*
+ * Store offsets of newlines in the data.
+ */
+static void
+lines_record (const char *s, size_t n, uint64_t base, uint64_t *out)
+{
+    const char *start = s, *endp = s + n;
+
+#if defined(__AVX2__)
+    {
+	const __m256i nl = _mm256_set1_epi8('\n');
+
+	for (; s + 32 <= endp; s += 32) {
+	    const __m256i v = _mm256_loadu_si256((const __m256i *) s);
+	    unsigned int mask = (unsigned int)
+	     _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+	    for (; mask; mask &= mask - 1)
+		*out++ = base + (s - start) + mem_ctz(mask);
+	}
+    }
+#elif defined(__SSE2__)
+    {
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	for (; s + 16 <= endp; s += 16) {
+	    const __m128i v = _mm_loadu_si128((const __m128i *) s);
+	    unsigned int mask = (unsigned int)
+	     _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+	    for (; mask; mask &= mask - 1)
+		*out++ = base + (s - start) + mem_ctz(mask);
+	}
+    }
+#endif
+    for (; (s = memchr(s, '\n', endp - s)); ++s)
+	*out++ = base + (s - start);
+}
+
+/*
+ * Index newlines of the data.
+ * Returns: 0 (out of memory) | 1
+ */
+static int
+lines_scan (struct lineindex *lx, const char *s, size_t n)
+{
+    while (n) {
+	const size_t len = (n < LINES_CHUNK) ? n : LINES_CHUNK;
+	const size_t cnt = lines_count(s, len);
+	struct lines_header *hdr;
+
+	if (cnt) {
+	    if (!membuf_reserve(lx->index, cnt * sizeof(uint64_t)))
+		return 0;
+	    hdr = lines_header(lx);
+	    lines_record(s, len, hdr->scanned, lines_offsets(lx) + hdr->nlines);
+	    hdr->nlines += cnt;
+	    lx->index->offset += cnt * sizeof(uint64_t);
+	}
+	else
+	    hdr = lines_header(lx);
+	hdr->scanned += len;
+	s += len;
+	n -= len;
+    }
+    return 1;
+}
+
+/*
+ * Validate the persisted index or initialize it.
+ * Returns: 0 (out of memory) | 1
+ */
+static int
+lines_initindex (struct membuf *mb)
+{
+    const struct lines_header *hdr = (const struct lines_header *) mb->data;
+    const size_t hdr_size = sizeof(struct lines_header);
+
+    if (hdr && (size_t) mb->len >= hdr_size && hdr->magic == LINES_MAGIC
+     && hdr->nlines <= ((size_t) mb->len - hdr_size) / sizeof(uint64_t)) {
+	mb->offset = (int) (hdr_size + hdr->nlines * sizeof(uint64_t));
+	return 1;
+    }
+
+    mb->offset = 0;
+    if (!membuf_reserve(mb, hdr_size))
+	return 0;
+    memset(mb->data, 0, hdr_size);
+    ((struct lines_header *) mb->data)->magic = LINES_MAGIC;
+    mb->offset = hdr_size;
+    return 1;
+}
+
+/*
+ * Arguments: text (membuf_udata | fd_udata), [index (membuf_udata),
+ *	window_size (number)]
+ * Returns: [lineindex_udata]
+ */
+static int
+mem_lineindex (lua_State *L)
+{
+    struct membuf *text = mem_tobuffer(L, 1);
+    lua_Integer *fdp = NULL;
+    struct membuf *index;
+    struct lineindex *lx;
+
+    if (text)
+	mem_checkbuffer(L, 1);
+    else {
+#if defined(SYSMEM_HAVE_MMAP) && !defined(_WIN32)
+	fdp = checkudata(L, 1, FD_TYPENAME);
+#else
+	luaL_typeerror(L, 1, "membuf");
+#endif
+    }
+
+    lua_settop(L, 3);
+    if (lua_isnil(L, 2)) {
+	/* internal index storage */
+	lua_pushcfunction(L, mem_new);
+	lua_call(L, 0, 1);
+	lua_replace(L, 2);
+	index = lua_touserdata(L, 2);
+	index->flags |= SYSMEM_ALLOC;
+    }
+    else
+	index = mem_checkbuffer(L, 2);
+
+    if (index->flags & SYSMEM_VIEW)
+	luaL_argerror(L, 2, "membuf is view");
+    if (!lines_initindex(index))
+	return sys_seterror(L, ENOMEM);
+
+    if (luaL_optinteger(L, 3, LINES_WINDOW) <= 0)
+	luaL_argerror(L, 3, "positive number expected");
+
+    lx = lua_newuserdata(L, sizeof(struct lineindex));
+    lx->text = text;
+    lx->index = index;
+    lx->fdp = fdp;
+    lx->window = (size_t) luaL_optinteger(L, 3, LINES_WINDOW);
+    luaL_getmetatable(L, LINES_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, LINES_FD, 0);  /* environ. */
+    if (text) {
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, LINES_TEXT);
+    }
+    else {
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, LINES_FD);
+    }
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, LINES_INDEX);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+
+#if defined(SYSMEM_HAVE_MMAP) && !defined(_WIN32)
+
+static size_t
+lines_pagemask (void)
+{
+    return (size_t) sysconf(_SC_PAGESIZE) - 1;
+}
+
+/*
+ * Scan the file through transient window mappings.
+ * Returns: 0 (error) | 1
+ */
+static int
+lines_updatefile (struct lineindex *lx)
+{
+    const int fd = (int) *lx->fdp;
+    const size_t mask = lines_pagemask();
+    struct stat st;
+    int res = 1;
+
+    sys_vm_leave();
+    if (fstat(fd, &st) == -1)
+	res = 0;
+    while (res && lines_header(lx)->scanned < (uint64_t) st.st_size) {
+	const uint64_t scanned = lines_header(lx)->scanned;
+	const off_t off = (off_t) (scanned & ~((uint64_t) mask));
+	const size_t skip = (size_t) (scanned - off);
+	const size_t len = ((uint64_t) (st.st_size - off) < lx->window + skip)
+	 ? (size_t) (st.st_size - off) : lx->window + skip;
+	char *p = mmap(0, len, PROT_READ, MAP_SHARED, fd, off);
+
+	if (p == MAP_FAILED) {
+	    res = 0;
+	    break;
+	}
+	madvise(p, len, MADV_SEQUENTIAL);
+	sys_vm_enter();
+	if (!lines_scan(lx, p + skip, len - skip)) {
+	    errno = ENOMEM;
+	    res = 0;
+	}
+	sys_vm_leave();
+	munmap(p, len);
+    }
+    sys_vm_enter();
+    return res;
+}
+
+/*
+ * Map the window covering the range, closing views of the previous window.
+ * Returns: 0 (error) | 1
+ */
+static int
+lines_mapwindow (lua_State *L, struct lineindex *lx, uint64_t start,
+                 uint64_t end)
+{
+    struct membuf *win = lx->text;
+    const size_t mask = lines_pagemask();
+    const uint64_t off = start & ~((uint64_t) mask);
+    const uint64_t scanned = lines_header(lx)->scanned;
+    size_t len = lx->window;
+    char *p;
+
+    if (win && win->data && (uint64_t) win->map_off <= start
+     && end <= (uint64_t) win->map_off + win->len)
+	return 1;
+
+    /* don't map beyond the indexed data */
+    if (scanned - off < len) len = (size_t) (scanned - off);
+    if (end - off > len) len = (size_t) (end - off);
+
+    sys_vm_leave();
+    p = mmap(0, len, PROT_READ, MAP_SHARED, (int) *lx->fdp, (off_t) off);
+    sys_vm_enter();
+    if (p == MAP_FAILED) return 0;
+
+    if (win && win->data) {
+	munmap(win->data, win->len);
+	memchanged(win);
+	win->data = NULL;
+	win->flags &= SYSMEM_TYPE_MASK;
+    }
+
+    /* new window */
+    lua_pushcfunction(L, mem_new);
+    lua_call(L, 0, 1);
+    win = lua_touserdata(L, -1);
+    win->data = p;
+    win->len = (int) len;
+    win->flags |= SYSMEM_MAP | SYSMEM_MAP_SHARED;
+    win->map_off = (int64_t) off;
+
+    lua_getfenv(L, 1);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, LINES_TEXT);
+    lua_pop(L, 1);
+    lx->text = win;
+    return 1;
+}
+
+#endif
+
+
+/*
+ * Arguments: lineindex_udata, [drop_scanned (boolean)]
+ * Returns: [number of lines (number)]
+ *
+ * drop_scanned releases the pages of shared file mappings only.
+ */
+static int
+lines_update (lua_State *L)
+{
+    struct lineindex *lx = checkudata(L, 1, LINES_TYPENAME);
+    struct membuf *text = lx->text;
+
+#if defined(SYSMEM_HAVE_MMAP) && !defined(_WIN32)
+    if (lx->fdp) {
+	if (!lines_updatefile(lx))
+	    return sys_seterror(L, 0);
+	goto end;
+    }
+#endif
+
+    if (text->flags & SYSMEM_VIEW) mem_checkview(text);
+    if (!text->data)
+	luaL_argerror(L, 1, "text membuf is closed");
+    {
+	const uint64_t scanned = lines_header(lx)->scanned;
+	const size_t len = lines_textlen(text);
+
+	if (scanned < len) {
+	    if (!lines_scan(lx, text->data + scanned, len - (size_t) scanned))
+		return sys_seterror(L, ENOMEM);
+
+#if defined(SYSMEM_HAVE_MMAP) && !defined(_WIN32)
+	    /* release pages of the scanned mapping: only a shared file
+	     * mapping can read them back */
+	    if (lua_toboolean(L, 2) && (text->flags & SYSMEM_MAP)
+	     && (text->flags & SYSMEM_MAP_SHARED) && text->map_off >= 0) {
+		const size_t mask = lines_pagemask();
+		char *p = (char *) ((size_t) text->data & ~mask);
+		const size_t n = ((size_t) (text->data + len) & ~mask) - (size_t) p;
+
+		if (n) madvise(p, n, MADV_DONTNEED);
+	    }
+#endif
+	}
+    }
+#if defined(SYSMEM_HAVE_MMAP) && !defined(_WIN32)
+ end:
+#endif
+    lua_pushnumber(L, (lua_Number) lines_header(lx)->nlines);
+    return 1;
+}
+
+/*
+ * Arguments: lineindex_udata
+ * Returns: number of lines (number), number of scanned bytes (number)
+ */
+static int
+lines_count_lines (lua_State *L)
+{
+    struct lineindex *lx = checkudata(L, 1, LINES_TYPENAME);
+    const struct lines_header *hdr = lines_header(lx);
+
+    lua_pushnumber(L, (lua_Number) hdr->nlines);
+    lua_pushnumber(L, (lua_Number) hdr->scanned);
+    return 2;
+}
+
+/*
+ * Get the range of the line, excluding the newline.
+ * Returns: 0 (no such line) | 1
+ */
+static int
+lines_range (struct lineindex *lx, uint64_t n, uint64_t *startp,
+             uint64_t *endp)
+{
+    const struct lines_header *hdr = lines_header(lx);
+    const uint64_t *nl = lines_offsets(lx);
+
+    if (n < 1 || n > hdr->nlines + 1)
+	return 0;
+    *startp = (n == 1) ? 0 : nl[n - 2] + 1;
+    *endp = (n <= hdr->nlines) ? nl[n - 1] : hdr->scanned;
+    return (n <= hdr->nlines) || (*startp < *endp);  /* unterminated tail */
+}
+
+/*
+ * Arguments: lineindex_udata, ...
+ * Returns: [view (membuf_udata)]
+ */
+static int
+lines_pushview (lua_State *L, struct lineindex *lx, uint64_t start,
+                uint64_t end)
+{
+    struct membuf *text;
+    uint64_t base = 0;
+
+#if defined(SYSMEM_HAVE_MMAP) && !defined(_WIN32)
+    if (lx->fdp) {
+	if (!lines_mapwindow(L, lx, start, end))
+	    return sys_seterror(L, 0);
+	base = (uint64_t) lx->text->map_off;
+    }
+#endif
+    text = lx->text;
+    if (text->flags & SYSMEM_VIEW) mem_checkview(text);
+    if (!text->data || end - base > (uint64_t) text->len)
+	return 0;
+
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, LINES_TEXT);
+    mem_pushview(L, lua_gettop(L), text, (int) (start - base),
+     (int) (end - start));
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: lineindex_udata, line_number (number: 1 ..)
+ * Returns: [view (membuf_udata)]
+ */
+static int
+lines_line (lua_State *L)
+{
+    struct lineindex *lx = checkudata(L, 1, LINES_TYPENAME);
+    const lua_Number num = luaL_checknumber(L, 2);
+    uint64_t start, end;
+
+    if (num < 1 || !lines_range(lx, (uint64_t) num, &start, &end))
+	return 0;
+    return lines_pushview(L, lx, start, end);
+}
+
+/*
+ * Arguments: lineindex_udata, line_number (number)
+ * Returns: [line_number (number), view (membuf_udata)]
+ */
+static int
+lines_iter (lua_State *L)
+{
+    struct lineindex *lx = checkudata(L, 1, LINES_TYPENAME);
+    const lua_Number num = lua_tonumber(L, 2) + 1;
+    const lua_Number last = lua_tonumber(L, lua_upvalueindex(1));
+    uint64_t start, end;
+
+    if (num > last || !lines_range(lx, (uint64_t) num, &start, &end))
+	return 0;
+
+    lua_pushnumber(L, num);
+    return (lines_pushview(L, lx, start, end) == 1) ? 2 : 0;
+}
+
+/*
+ * Arguments: lineindex_udata, [first (number), last (number)]
+ * Returns: iterator (function), lineindex_udata, line_number (number)
+ */
+static int
+lines_lines (lua_State *L)
+{
+    struct lineindex *lx = checkudata(L, 1, LINES_TYPENAME);
+    const lua_Number first = luaL_optnumber(L, 2, 1);
+    const lua_Number last = luaL_optnumber(L, 3,
+     (lua_Number) lines_header(lx)->nlines + 1);
+
+    lua_pushnumber(L, last);
+    lua_pushcclosure(L, lines_iter, 1);
+    lua_pushvalue(L, 1);
+    lua_pushnumber(L, (first < 1 ? 1 : first) - 1);
+    return 3;
+}
+
+/*
+ * Arguments: lineindex_udata
+ * Returns: index (membuf_udata)
+ */
+static int
+lines_buffer (lua_State *L)
+{
+    checkudata(L, 1, LINES_TYPENAME);
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, LINES_INDEX);
+    return 1;
+}
+
+/*
+ * Arguments: lineindex_udata
+ * Returns: string
+ */
+static int
+lines_tostring (lua_State *L)
+{
+    struct lineindex *lx = checkudata(L, 1, LINES_TYPENAME);
+
+    lua_pushfstring(L, LINES_TYPENAME " (%p)", lx->index->data);
+    return 1;
+}
+
+
+static luaL_reg lines_meth[] = {
+    {"update",		lines_update},
+    {"count",		lines_count_lines},
+    {"line",		lines_line},
+    {"lines",		lines_lines},
+    {"buffer",		lines_buffer},
+    {"__tostring",	lines_tostring},
+    {NULL, NULL}
+};
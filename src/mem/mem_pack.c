@@ -0,0 +1,524 @@
+/* Lua System: Memory Buffers: Binary Packing */
+
+#define PACK_MAXVARINT	10  /* maximum length of 64-bit varint */
+
+/* Format options */
+enum {
+    PACK_INT,		/* signed integer */
+    PACK_UINT,		/* unsigned integer */
+    PACK_FLOAT,
+    PACK_DOUBLE,
+    PACK_NUMBER,
+    PACK_VARINT,	/* unsigned LEB128 */
+    PACK_ZIGZAG,	/* signed LEB128 with zigzag encoding */
+    PACK_STRING,	/* string prefixed with fixed-size length */
+    PACK_VSTRING,	/* string prefixed with varint length */
+    PACK_CHARS,		/* fixed-size string */
+    PACK_PADDING	/* zero byte */
+};
+
+struct pack_op {
+    unsigned char code;
+    unsigned char little;  /* little-endian byte order */
+    unsigned int size;
+};
+
+/* Compiled format */
+struct pack_format {
+    int nops;
+    int nvalues;  /* number of Lua values */
+    struct pack_op ops[1];
+};
+
+/* Registry key of compiled formats cache */
+static const char pack_cache_key = 0;
+
+
+static int
+pack_nativelittle (void)
+{
+    const int one = 1;
+    return *((const char *) &one);
+}
+
+static unsigned int
+pack_optsize (const char **fmtp, unsigned int def)
+{
+    const char *fmt = *fmtp;
+    unsigned int n = 0;
+
+    if (*fmt < '0' || *fmt > '9')
+	return def;
+    do n = n * 10 + (*fmt++ - '0');
+    while (*fmt >= '0' && *fmt <= '9' && n < 0xFFFF);
+    *fmtp = fmt;
+    return n;
+}
+
+/*
+ * Returns: pack_udata
+ */
+static struct pack_format *
+pack_compile (lua_State *L, const char *fmt, size_t len)
+{
+    const int native_little = pack_nativelittle();
+    struct pack_format *pf = lua_newuserdata(L,
+     sizeof(struct pack_format) + len * sizeof(struct pack_op));
+    struct pack_op *op = pf->ops;
+    int little = native_little;
+
+    pf->nvalues = 0;
+    while (*fmt) {
+	const int opt = *fmt++;
+	unsigned int size = 0;
+	int code;
+
+	switch (opt) {
+	case ' ': continue;
+	case '<': little = 1; continue;
+	case '>': little = 0; continue;
+	case '=': little = native_little; continue;
+	case 'b': code = PACK_INT; size = 1; break;
+	case 'B': code = PACK_UINT; size = 1; break;
+	case 'h': code = PACK_INT; size = 2; break;
+	case 'H': code = PACK_UINT; size = 2; break;
+	case 'i': code = PACK_INT; size = pack_optsize(&fmt, 4); break;
+	case 'I': code = PACK_UINT; size = pack_optsize(&fmt, 4); break;
+	case 'l': code = PACK_INT; size = 8; break;
+	case 'L': code = PACK_UINT; size = 8; break;
+	case 'f': code = PACK_FLOAT; size = sizeof(float); break;
+	case 'd': code = PACK_DOUBLE; size = sizeof(double); break;
+	case 'n': code = PACK_NUMBER; size = sizeof(lua_Number); break;
+	case 'v': code = PACK_VARINT; break;
+	case 'z': code = PACK_ZIGZAG; break;
+	case 's':
+	    if (*fmt == 'v') {
+		++fmt;
+		code = PACK_VSTRING;
+	    } else {
+		code = PACK_STRING;
+		size = pack_optsize(&fmt, 4);
+	    }
+	    break;
+	case 'c':
+	    code = PACK_CHARS;
+	    size = pack_optsize(&fmt, 0);
+	    if (!size) luaL_error(L, "missing size for format option 'c'");
+	    break;
+	case 'x': code = PACK_PADDING; size = 1; break;
+	default:
+	    luaL_error(L, "invalid format option '%c'", opt);
+	    return NULL;
+	}
+	if ((code == PACK_INT || code == PACK_UINT || code == PACK_STRING)
+	 && (size < 1 || size > 8))
+	    luaL_error(L, "integral size (%d) out of limits [1,8]", size);
+
+	op->code = (unsigned char) code;
+	op->little = (unsigned char) little;
+	op->size = size;
+	++op;
+	if (code != PACK_PADDING)
+	    pf->nvalues++;
+    }
+    pf->nops = op - pf->ops;
+    return pf;
+}
+
+/*
+ * Arguments: ..., format (string), ...
+ * Returns: ..., pack_udata
+ */
+static struct pack_format *
+pack_getformat (lua_State *L, int idx)
+{
+    size_t len;
+    const char *fmt = luaL_checklstring(L, idx, &len);
+    struct pack_format *pf;
+
+    lua_pushlightuserdata(L, (void *) &pack_cache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    pf = lua_touserdata(L, -1);
+    if (!pf) {
+	lua_pop(L, 1);
+	pf = pack_compile(L, fmt, len);
+	lua_pushvalue(L, idx);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+    }
+    lua_remove(L, -2);  /* keep compiled format on the stack */
+    return pf;
+}
+
+
+static uint64_t
+pack_tounsigned (lua_Number num)
+{
+    return (num < 0) ? (uint64_t) (int64_t) num : (uint64_t) num;
+}
+
+static size_t
+pack_varintlen (uint64_t v)
+{
+    size_t n = 1;
+
+    while (v >= 0x80) {
+	v >>= 7;
+	++n;
+    }
+    return n;
+}
+
+static char *
+pack_putvarint (char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+	*p++ = (char) (v | 0x80);
+	v >>= 7;
+    }
+    *p++ = (char) v;
+    return p;
+}
+
+static const char *
+pack_getvarint (const char *p, const char *endp, uint64_t *vp)
+{
+    uint64_t v = 0;
+    int shift;
+
+    for (shift = 0; p < endp && shift < 7 * PACK_MAXVARINT; shift += 7) {
+	const unsigned int c = (unsigned char) *p++;
+
+	v |= (uint64_t) (c & 0x7F) << shift;
+	if (!(c & 0x80)) {
+	    *vp = v;
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+static char *
+pack_putint (char *p, uint64_t v, const struct pack_op *op)
+{
+    const unsigned int size = op->size;
+    unsigned int i;
+
+    if (op->little) {
+	for (i = 0; i < size; ++i, v >>= 8)
+	    p[i] = (char) v;
+    } else {
+	for (i = size; i--; v >>= 8)
+	    p[i] = (char) v;
+    }
+    return p + size;
+}
+
+static uint64_t
+pack_getint (const char *p, const struct pack_op *op)
+{
+    const unsigned int size = op->size;
+    const unsigned char *cp = (const unsigned char *) p;
+    uint64_t v = 0;
+    unsigned int i;
+
+    if (op->little) {
+	for (i = size; i--; )
+	    v = (v << 8) | cp[i];
+    } else {
+	for (i = 0; i < size; ++i)
+	    v = (v << 8) | cp[i];
+    }
+    /* sign extension */
+    if (op->code == PACK_INT && size < 8
+     && (v & ((uint64_t) 1 << (size * 8 - 1))))
+	v |= ~((uint64_t) 0) << (size * 8);
+    return v;
+}
+
+/* Copy floating-point value in requested byte order */
+static void
+pack_copyfloat (char *dst, const char *src, const struct pack_op *op)
+{
+    const unsigned int size = op->size;
+
+    if (op->little == pack_nativelittle())
+	memcpy(dst, src, size);
+    else {
+	unsigned int i;
+	for (i = 0; i < size; ++i)
+	    dst[i] = src[size - 1 - i];
+    }
+}
+
+
+/*
+ * Arguments: ..., values (any) ...
+ */
+static size_t
+pack_size (lua_State *L, const struct pack_format *pf, int idx)
+{
+    const struct pack_op *op = pf->ops;
+    const struct pack_op *endop = op + pf->nops;
+    size_t size = 0;
+
+    for (; op < endop; ++op) {
+	struct sys_buffer sb;
+
+	switch (op->code) {
+	case PACK_VARINT:
+	    size += pack_varintlen(pack_tounsigned(luaL_checknumber(L, idx++)));
+	    break;
+	case PACK_ZIGZAG:
+	    {
+		const uint64_t v = pack_tounsigned(luaL_checknumber(L, idx++));
+		size += pack_varintlen((v << 1) ^ (0 - (v >> 63)));
+	    }
+	    break;
+	case PACK_STRING:
+	case PACK_VSTRING:
+	    if (!sys_buffer_read_init(L, idx, &sb))
+		luaL_argerror(L, idx, "buffer expected");
+	    if (op->code == PACK_VSTRING)
+		size += pack_varintlen(sb.size);
+	    else {
+		if (op->size < 8 && (uint64_t) sb.size >> (op->size * 8))
+		    luaL_argerror(L, idx, "string length does not fit");
+		size += op->size;
+	    }
+	    size += sb.size;
+	    ++idx;
+	    break;
+	case PACK_CHARS:
+	    if (!sys_buffer_read_init(L, idx, &sb))
+		luaL_argerror(L, idx, "buffer expected");
+	    if (sb.size > op->size)
+		luaL_argerror(L, idx, "string is longer than given size");
+	    size += op->size;
+	    ++idx;
+	    break;
+	case PACK_PADDING:
+	    size += op->size;
+	    break;
+	default:
+	    luaL_checknumber(L, idx++);
+	    size += op->size;
+	}
+    }
+    return size;
+}
+
+/*
+ * Arguments: ..., values (any) ...
+ */
+static char *
+pack_write (lua_State *L, const struct pack_format *pf, int idx, char *p)
+{
+    const struct pack_op *op = pf->ops;
+    const struct pack_op *endop = op + pf->nops;
+
+    for (; op < endop; ++op) {
+	struct sys_buffer sb;
+
+	switch (op->code) {
+	case PACK_INT:
+	case PACK_UINT:
+	    p = pack_putint(p, pack_tounsigned(lua_tonumber(L, idx++)), op);
+	    break;
+	case PACK_FLOAT:
+	    {
+		const float num = (float) lua_tonumber(L, idx++);
+		pack_copyfloat(p, (const char *) &num, op);
+		p += sizeof(float);
+	    }
+	    break;
+	case PACK_DOUBLE:
+	    {
+		const double num = (double) lua_tonumber(L, idx++);
+		pack_copyfloat(p, (const char *) &num, op);
+		p += sizeof(double);
+	    }
+	    break;
+	case PACK_NUMBER:
+	    {
+		const lua_Number num = lua_tonumber(L, idx++);
+		pack_copyfloat(p, (const char *) &num, op);
+		p += sizeof(lua_Number);
+	    }
+	    break;
+	case PACK_VARINT:
+	    p = pack_putvarint(p, pack_tounsigned(lua_tonumber(L, idx++)));
+	    break;
+	case PACK_ZIGZAG:
+	    {
+		const uint64_t v = pack_tounsigned(lua_tonumber(L, idx++));
+		p = pack_putvarint(p, (v << 1) ^ (0 - (v >> 63)));
+	    }
+	    break;
+	case PACK_STRING:
+	case PACK_VSTRING:
+	case PACK_CHARS:
+	    sys_buffer_read_init(L, idx++, &sb);
+	    if (op->code == PACK_VSTRING)
+		p = pack_putvarint(p, sb.size);
+	    else if (op->code == PACK_STRING)
+		p = pack_putint(p, sb.size, op);
+	    memmove(p, sb.ptr.r, sb.size);
+	    p += sb.size;
+	    if (op->code == PACK_CHARS) {
+		const size_t n = op->size - sb.size;
+		memset(p, 0, n);
+		p += n;
+	    }
+	    break;
+	case PACK_PADDING:
+	    *p++ = 0;
+	    break;
+	}
+    }
+    return p;
+}
+
+
+/*
+ * Arguments: membuf_udata, offset (number) | nil (append),
+ *	format (string), values (any) ...
+ * Returns: [next_offset (number)]
+ */
+static int
+mem_pack (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const int is_append = lua_isnoneornil(L, 2);
+    const struct pack_format *pf = pack_getformat(L, 3);
+    const size_t size = pack_size(L, pf, 4);
+    lua_Integer off;
+    char *p;
+
+    if (is_append) {
+	if (!membuf_addlstring(L, mb, NULL, size))
+	    return 0;
+	off = mb->offset;
+    } else {
+	off = luaL_checkinteger(L, 2);
+	if (off < 0 || (mb->len && (size_t) mb->len < off + size))
+	    luaL_argerror(L, 2, "out of bounds");
+    }
+    p = pack_write(L, pf, 4, mb->data + off);
+    off = p - mb->data;
+    if (is_append)
+	mb->offset = off;
+
+    lua_pushinteger(L, off);
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, offset (number), format (string)
+ * Returns: [values (any) ..., next_offset (number)]
+ */
+static int
+mem_unpack (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const lua_Integer off = luaL_optinteger(L, 2, 0);
+    const struct pack_format *pf = pack_getformat(L, 3);
+    const struct pack_op *op = pf->ops;
+    const struct pack_op *endop = op + pf->nops;
+    const char *p = mb->data + off;
+    const char *endp = mb->len ? mb->data + mb->len
+     : (const char *) ~((size_t) 0);  /* raw pointer */
+    int nresults = 0;
+
+    if (off < 0 || p > endp)
+	luaL_argerror(L, 2, "out of bounds");
+    luaL_checkstack(L, pf->nvalues + 1, "too many results");
+
+    for (; op < endop; ++op) {
+	uint64_t v;
+
+	if (op->size > (size_t) (endp - p))
+	    goto short_data;
+
+	switch (op->code) {
+	case PACK_INT:
+	    v = pack_getint(p, op);
+	    lua_pushnumber(L, (lua_Number) (int64_t) v);
+	    break;
+	case PACK_UINT:
+	    v = pack_getint(p, op);
+	    lua_pushnumber(L, (lua_Number) v);
+	    break;
+	case PACK_FLOAT:
+	    {
+		float num;
+		pack_copyfloat((char *) &num, p, op);
+		lua_pushnumber(L, num);
+	    }
+	    break;
+	case PACK_DOUBLE:
+	    {
+		double num;
+		pack_copyfloat((char *) &num, p, op);
+		lua_pushnumber(L, num);
+	    }
+	    break;
+	case PACK_NUMBER:
+	    {
+		lua_Number num;
+		pack_copyfloat((char *) &num, p, op);
+		lua_pushnumber(L, num);
+	    }
+	    break;
+	case PACK_VARINT:
+	case PACK_ZIGZAG:
+	case PACK_VSTRING:
+	    {
+		const char *q = pack_getvarint(p, endp, &v);
+
+		if (!q) {
+		    if (endp - p < PACK_MAXVARINT)
+			goto short_data;
+		    return luaL_error(L, "malformed varint");
+		}
+		p = q;
+	    }
+	    if (op->code == PACK_VARINT)
+		lua_pushnumber(L, (lua_Number) v);
+	    else if (op->code == PACK_ZIGZAG)
+		lua_pushnumber(L, (lua_Number) (int64_t) ((v >> 1) ^ (0 - (v & 1))));
+	    else {
+		if (v > (uint64_t) (endp - p))
+		    goto short_data;
+		lua_pushlstring(L, p, (size_t) v);
+		p += (size_t) v;
+	    }
+	    ++nresults;
+	    continue;
+	case PACK_STRING:
+	    v = pack_getint(p, op);
+	    p += op->size;
+	    if (v > (uint64_t) (endp - p))
+		goto short_data;
+	    lua_pushlstring(L, p, (size_t) v);
+	    p += (size_t) v;
+	    ++nresults;
+	    continue;
+	case PACK_CHARS:
+	    lua_pushlstring(L, p, op->size);
+	    break;
+	case PACK_PADDING:
+	    ++p;
+	    continue;
+	}
+	p += op->size;
+	++nresults;
+    }
+    lua_pushinteger(L, p - mb->data);
+    return nresults + 1;
+ short_data:
+    lua_pushnil(L);
+    return 1;
+}
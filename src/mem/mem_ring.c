@@ -0,0 +1,502 @@
+/* Lua System: Memory Buffers: Ring Queue */
+
+#ifdef SYSMEM_HAVE_ATOMIC
+
+#define RING_TYPENAME	"sys.mem.ring"
+
+#define RING_MAGIC	0x676E6952  /* "Ring" */
+#define RING_CACHELINE	64
+#define RING_MINSIZE	64
+#define RING_WRAP	0xFFFFFFFFU  /* record length to skip to start */
+#define RING_ALIGN(n)	(((n) + 7) & ~((uint32_t) 7))
+#define RING_SPINS	100  /* spins before yield */
+
+/* Shared header; records follow it */
+struct ring_header {
+    uint32_t magic;
+    uint32_t capacity;  /* size of records area, power of 2 */
+#define RING_MPMC	1  /* multiple producers and consumers */
+    uint32_t flags;
+    char pad0[RING_CACHELINE - 3 * sizeof(uint32_t)];
+
+    /* producers side */
+    uint32_t head;  /* write position */
+    uint32_t head_lock;
+    uint32_t nwriters;  /* number of blocked producers */
+    char pad1[RING_CACHELINE - 3 * sizeof(uint32_t)];
+
+    /* consumers side */
+    uint32_t tail;  /* read position */
+    uint32_t tail_lock;
+    uint32_t nreaders;  /* number of blocked consumers */
+    uint32_t armed;  /* consumer waits for doorbell */
+    char pad2[RING_CACHELINE - 4 * sizeof(uint32_t)];
+};
+
+struct memring {
+    struct membuf *mb;
+    lua_Integer *doorbell;  /* boxed fd */
+};
+
+/* Ring environ. table reserved indexes */
+enum {
+    RING_MEMBUF = 1,
+    RING_DOORBELL
+};
+
+#define ring_load(p) \
+    ((uint32_t) atomic_op((void *) (p), 4, ATOMIC_LOAD, 0, NULL, ATOMIC_SEQ_CST))
+#define ring_store(p,v) \
+    atomic_op((void *) (p), 4, ATOMIC_STORE, (v), NULL, ATOMIC_SEQ_CST)
+#define ring_add(p,v) \
+    atomic_op((void *) (p), 4, ATOMIC_ADD, (v), NULL, ATOMIC_SEQ_CST)
+#define ring_xchg(p,v) \
+    ((uint32_t) atomic_op((void *) (p), 4, ATOMIC_XCHG, (v), NULL, ATOMIC_SEQ_CST))
+
+
+static void
+ring_lock (uint32_t *lock)
+{
+    int spins = 0;
+
+    for (; ; ) {
+	int64_t cmp = 0;
+
+	atomic_op(lock, 4, ATOMIC_CAS, 1, &cmp, ATOMIC_ACQUIRE);
+	if (cmp) break;
+	if (++spins >= RING_SPINS) {
+	    spins = 0;
+#ifndef _WIN32
+	    sched_yield();
+#else
+	    Sleep(0);
+#endif
+	}
+    }
+}
+
+static void
+ring_unlock (uint32_t *lock)
+{
+    atomic_op(lock, 4, ATOMIC_STORE, 0, NULL, ATOMIC_RELEASE);
+}
+
+/*
+ * Wait for change of the position.
+ */
+static void
+ring_wait (uint32_t *addr, uint32_t val, msec_t timeout)
+{
+#ifdef __linux__
+    struct timespec ts, *tsp = NULL;
+
+    if (timeout != TIMEOUT_INFINITE) {
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	tsp = &ts;
+    }
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, tsp, NULL, 0);
+#else
+    /* polling */
+    (void) addr;
+    (void) val;
+    (void) timeout;
+#ifndef _WIN32
+    usleep(1000);
+#else
+    Sleep(1);
+#endif
+#endif
+}
+
+static void
+ring_wake (uint32_t *addr)
+{
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, 0x7FFFFFFF, NULL, NULL, 0);
+#else
+    (void) addr;
+#endif
+}
+
+static struct ring_header *
+ring_checkheader (lua_State *L, struct memring *mr)
+{
+    struct membuf *mb = mr->mb;
+
+    if (mb->flags & SYSMEM_VIEW) mem_checkview(mb);
+    if (!mb->data)
+	luaL_argerror(L, 1, "ring memory is closed");
+    return (struct ring_header *) mb->data;
+}
+
+
+/*
+ * Arguments: membuf_udata, [initialize (boolean), mode (string: "spsc", "mpmc")]
+ * Returns: ring_udata
+ */
+static int
+mem_ring (lua_State *L)
+{
+    static const char *const mode_names[] = {"spsc", "mpmc", NULL};
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const int init = lua_toboolean(L, 2);
+    const int mode = luaL_checkoption(L, 3, "spsc", mode_names);
+    const size_t len = mb->len;
+    struct ring_header *hdr = (struct ring_header *) mb->data;
+    struct memring *mr;
+
+    if (!hdr || len < sizeof(struct ring_header) + RING_MINSIZE
+     || ((size_t) hdr & 7))
+	luaL_argerror(L, 1, "buffer too small");
+
+    if (init) {
+	const size_t size = len - sizeof(struct ring_header);
+	uint32_t cap = RING_MINSIZE;
+
+	while ((size_t) cap * 2 <= size && cap < 0x40000000)
+	    cap *= 2;
+
+	memset(hdr, 0, sizeof(struct ring_header));
+	hdr->capacity = cap;
+	hdr->flags = mode ? RING_MPMC : 0;
+	ring_store(&hdr->magic, RING_MAGIC);
+    }
+    else if (hdr->magic != RING_MAGIC || hdr->capacity < RING_MINSIZE
+     || (hdr->capacity & (hdr->capacity - 1))
+     || hdr->capacity > len - sizeof(struct ring_header))
+	luaL_argerror(L, 1, "ring expected");
+
+    mr = lua_newuserdata(L, sizeof(struct memring));
+    mr->mb = mb;
+    mr->doorbell = NULL;
+    luaL_getmetatable(L, RING_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, RING_DOORBELL, 0);  /* environ. */
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, RING_MEMBUF);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+#ifndef _WIN32
+
+/*
+ * Arguments: ring_udata, [fd_udata]
+ * Returns: ring_udata
+ */
+static int
+ring_doorbell (lua_State *L)
+{
+    struct memring *mr = checkudata(L, 1, RING_TYPENAME);
+    lua_Integer *fdp = lua_isnoneornil(L, 2) ? NULL
+     : checkudata(L, 2, FD_TYPENAME);
+
+    if (fdp) {
+	const int fd = (int) *fdp;
+	const int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	    return sys_seterror(L, 0);
+    }
+    mr->doorbell = fdp;
+
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, RING_DOORBELL);
+    lua_settop(L, 1);
+    return 1;
+}
+
+#endif
+
+/*
+ * Returns: 0 (ring is full) | 1
+ */
+static int
+ring_tryput (struct ring_header *hdr, const char *s, uint32_t n,
+             uint32_t *tailp)
+{
+    const uint32_t cap = hdr->capacity;
+    const uint32_t head = hdr->head;
+    const uint32_t tail = ring_load(&hdr->tail);
+    const uint32_t off = head & (cap - 1);
+    const uint32_t need = RING_ALIGN(sizeof(uint32_t) + n);
+    const uint32_t skip = (cap - off < need) ? cap - off : 0;
+    char *data = (char *) (hdr + 1);
+    char *p = data + ((off + skip) & (cap - 1));
+
+    *tailp = tail;
+    if (cap - (head - tail) < skip + need)
+	return 0;
+
+    if (skip) *((uint32_t *) (data + off)) = RING_WRAP;
+    *((uint32_t *) p) = n;
+    memcpy(p + sizeof(uint32_t), s, n);
+    ring_store(&hdr->head, head + skip + need);
+    return 1;
+}
+
+/*
+ * Returns: 0 (ring is empty) | 1 | -1 (corrupt record)
+ */
+static int
+ring_tryget (struct ring_header *hdr, const char **sp, uint32_t *np,
+             uint32_t *headp, uint32_t *tailp)
+{
+    const uint32_t cap = hdr->capacity;
+    uint32_t tail = hdr->tail;
+    const uint32_t head = ring_load(&hdr->head);
+    uint32_t off = tail & (cap - 1);
+    char *data = (char *) (hdr + 1);
+    uint32_t n;
+
+    *headp = head;
+    if (head == tail)
+	return 0;
+
+    n = *((uint32_t *) (data + off));
+    if (n == RING_WRAP) {
+	tail += cap - off;
+	off = 0;
+	n = *((uint32_t *) data);
+    }
+    /* producers never write such records */
+    if (n > cap / 2 || n > cap - off - sizeof(uint32_t))
+	return -1;
+    *sp = data + off + sizeof(uint32_t);
+    *np = n;
+    *tailp = tail + RING_ALIGN(sizeof(uint32_t) + n);
+    return 1;
+}
+
+static void
+ring_ringbell (struct memring *mr, struct ring_header *hdr)
+{
+#ifndef _WIN32
+    if (mr->doorbell && ring_load(&hdr->armed)
+     && ring_xchg(&hdr->armed, 0)) {
+	const char ch = 1;
+	int nw;
+
+	do nw = write((int) *mr->doorbell, &ch, 1);
+	while (nw == -1 && SYS_ERRNO == EINTR);
+    }
+#else
+    (void) mr;
+    (void) hdr;
+#endif
+}
+
+/*
+ * Returns: 0 (ring got data) | 1
+ */
+static int
+ring_arm (struct memring *mr, struct ring_header *hdr, uint32_t head)
+{
+#ifndef _WIN32
+    if (mr->doorbell) {
+	char buf[64];
+
+	while (read((int) *mr->doorbell, buf, sizeof(buf)) > 0)
+	    continue;
+	ring_store(&hdr->armed, 1);
+	return ring_load(&hdr->head) == head;
+    }
+#else
+    (void) mr;
+    (void) hdr;
+    (void) head;
+#endif
+    return 1;
+}
+
+/*
+ * Arguments: ring_udata, data (string | membuf_udata), [timeout (milliseconds)]
+ * Returns: [boolean]
+ */
+static int
+ring_put (lua_State *L)
+{
+    struct memring *mr = checkudata(L, 1, RING_TYPENAME);
+    struct ring_header *hdr = ring_checkheader(L, mr);
+    const msec_t timeout = lua_isnoneornil(L, 3)
+     ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, 3);
+    const int is_mpmc = (hdr->flags & RING_MPMC);
+    const msec_t start = get_milliseconds();
+    struct sys_buffer sb;
+    int res;
+
+    if (!sys_buffer_read_init(L, 2, &sb))
+	luaL_typeerror(L, 2, "string or membuf");
+    if (RING_ALIGN(sizeof(uint32_t) + sb.size) > hdr->capacity / 2)
+	luaL_argerror(L, 2, "record too large");
+
+    for (; ; ) {
+	msec_t wait = timeout;
+	uint32_t tail;
+
+	if (is_mpmc) ring_lock(&hdr->head_lock);
+	res = ring_tryput(hdr, sb.ptr.r, (uint32_t) sb.size, &tail);
+	if (is_mpmc) ring_unlock(&hdr->head_lock);
+
+	if (res || !timeout) break;
+
+	/* wait for consumers */
+	if (timeout != TIMEOUT_INFINITE) {
+	    const msec_t elapsed = get_milliseconds() - start;
+
+	    if (elapsed >= timeout) break;
+	    wait = timeout - elapsed;
+	}
+	sys_vm_leave();
+	ring_add(&hdr->nwriters, 1);
+	if (ring_load(&hdr->tail) == tail)
+	    ring_wait(&hdr->tail, tail, wait);
+	ring_add(&hdr->nwriters, -1);
+	sys_vm_enter();
+    }
+
+    if (res) {
+	sys_buffer_read_next(&sb, sb.size);
+	if (ring_load(&hdr->nreaders))
+	    ring_wake(&hdr->head);
+	ring_ringbell(mr, hdr);
+    }
+    lua_pushboolean(L, res);
+    return 1;
+}
+
+/*
+ * Arguments: ring_udata, [membuf_udata, timeout (milliseconds)]
+ * Returns: [string | count (number) | false (empty)]
+ */
+static int
+ring_get (lua_State *L)
+{
+    struct memring *mr = checkudata(L, 1, RING_TYPENAME);
+    struct ring_header *hdr = ring_checkheader(L, mr);
+    struct membuf *mb = (lua_type(L, 2) == LUA_TUSERDATA)
+     ? mem_checkbuffer(L, 2) : NULL;
+    const int tidx = mb ? 3 : 2;
+    const msec_t timeout = lua_isnoneornil(L, tidx)
+     ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, tidx);
+    const int is_mpmc = (hdr->flags & RING_MPMC);
+    const msec_t start = get_milliseconds();
+    char buf[SYS_BUFSIZE];
+    char *dest = buf;
+    size_t room = mb ? (size_t) (mb->len - mb->offset) : sizeof(buf);
+
+    for (; ; ) {
+	msec_t wait = timeout;
+	const char *s;
+	uint32_t n, head, tail;
+	int res;
+
+	if (is_mpmc) ring_lock(&hdr->tail_lock);
+	res = ring_tryget(hdr, &s, &n, &head, &tail);
+	if (res < 0) {
+	    if (is_mpmc) ring_unlock(&hdr->tail_lock);
+	    return luaL_error(L, "corrupt ring record");
+	}
+	if (res) {
+	    if (n > room) {
+		if (is_mpmc) ring_unlock(&hdr->tail_lock);
+
+		/* make room out of the lock and retry */
+		if (mb) {
+		    if (!membuf_reserve(mb, n))
+			return sys_seterror(L, ENOMEM);
+		    room = mb->len - mb->offset;
+		}
+		else {
+		    dest = lua_newuserdata(L, n);
+		    room = n;
+		}
+		continue;
+	    }
+	    if (mb) dest = mb->data + mb->offset;
+	    if (n) memcpy(dest, s, n);
+	    ring_store(&hdr->tail, tail);
+	    if (is_mpmc) ring_unlock(&hdr->tail_lock);
+
+	    if (ring_load(&hdr->nwriters))
+		ring_wake(&hdr->tail);
+	    if (mb) {
+		mb->offset += n;
+		lua_pushinteger(L, n);
+	    }
+	    else
+		lua_pushlstring(L, dest, n);
+	    return 1;
+	}
+	if (is_mpmc) ring_unlock(&hdr->tail_lock);
+
+	if (!timeout) {
+	    if (!ring_arm(mr, hdr, head))
+		continue;
+	    break;
+	}
+
+	/* wait for producers */
+	if (timeout != TIMEOUT_INFINITE) {
+	    const msec_t elapsed = get_milliseconds() - start;
+
+	    if (elapsed >= timeout) break;
+	    wait = timeout - elapsed;
+	}
+	sys_vm_leave();
+	ring_add(&hdr->nreaders, 1);
+	if (ring_load(&hdr->head) == head)
+	    ring_wait(&hdr->head, head, wait);
+	ring_add(&hdr->nreaders, -1);
+	sys_vm_enter();
+    }
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+/*
+ * Arguments: ring_udata
+ * Returns: used_bytes (number), capacity (number)
+ */
+static int
+ring_size (lua_State *L)
+{
+    struct memring *mr = checkudata(L, 1, RING_TYPENAME);
+    struct ring_header *hdr = ring_checkheader(L, mr);
+
+    lua_pushnumber(L, (lua_Number) (uint32_t)
+     (ring_load(&hdr->head) - ring_load(&hdr->tail)));
+    lua_pushnumber(L, hdr->capacity);
+    return 2;
+}
+
+/*
+ * Arguments: ring_udata
+ * Returns: string
+ */
+static int
+ring_tostring (lua_State *L)
+{
+    struct memring *mr = checkudata(L, 1, RING_TYPENAME);
+
+    lua_pushfstring(L, RING_TYPENAME " (%p)", mr->mb->data);
+    return 1;
+}
+
+
+static luaL_reg ring_meth[] = {
+#ifndef _WIN32
+    {"doorbell",	ring_doorbell},
+#endif
+    {"put",		ring_put},
+    {"get",		ring_get},
+    {"size",		ring_size},
+    {"__tostring",	ring_tostring},
+    {NULL, NULL}
+};
+
+#endif /* SYSMEM_HAVE_ATOMIC */
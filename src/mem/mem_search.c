@@ -0,0 +1,428 @@
+/* Lua System: Memory Buffers: Searching */
+
+#define MATCHER_TYPENAME	"sys.mem.matcher"
+
+#define MATCHER_MAXTABLE	((size_t) 1 << 30)  /* max. size of transitions */
+
+#define matcher_lower(c)	((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+/* Aho-Corasick automaton with compressed alphabet */
+struct matcher {
+    int *delta;  /* transitions: nstates x nclasses */
+    int *out;  /* pattern ending at state (1..) or 0 */
+    int *dict;  /* next state with output on the failure path or 0 */
+    int *nout;  /* number of patterns ending at state */
+    int *lens;  /* lengths of patterns */
+    int nstates, nclasses, npatterns;
+    unsigned char classes[256];  /* byte -> class */
+};
+
+
+/*
+ * Arguments: patterns (table), nocase (boolean)
+ * Returns: total length of patterns
+ */
+static size_t
+matcher_classes (lua_State *L, struct matcher *m, int nocase)
+{
+    size_t total = 0;
+    int i, c;
+
+    memset(m->classes, 0, sizeof(m->classes));
+    m->nclasses = 1;  /* class 0: bytes absent from patterns */
+
+    for (i = 1; i <= m->npatterns; ++i) {
+	struct sys_buffer sb;
+	const unsigned char *s;
+	size_t j;
+
+	lua_rawgeti(L, 1, i);
+	if (!mem_read_init(L, -1, &sb) || !sb.size)
+	    luaL_argerror(L, 1, "non-empty strings expected");
+	lua_pop(L, 1);
+
+	if (sb.size > (size_t) INT_MAX - total)
+	    luaL_argerror(L, 1, "patterns too long");
+	total += sb.size;
+
+	s = (const unsigned char *) sb.ptr.r;
+	for (j = 0; j < sb.size; ++j) {
+	    c = nocase ? matcher_lower(s[j]) : s[j];
+	    if (!m->classes[c])
+		m->classes[c] = (unsigned char) m->nclasses++;
+	}
+    }
+    if (nocase) {
+	for (c = 0; c < 256; ++c) {
+	    if (m->classes[matcher_lower(c)])
+		m->classes[c] = m->classes[matcher_lower(c)];
+	}
+    }
+    return total;
+}
+
+/*
+ * Build the trie and convert it to a DFA.
+ */
+static int
+matcher_build (lua_State *L, struct matcher *m, size_t maxstates)
+{
+    const int ncls = m->nclasses;
+    int *delta = m->delta, *fail, *queue;
+    int head = 0, tail = 0;
+    int i, c;
+
+    for (i = 0; i < (int) maxstates * ncls; ++i)
+	delta[i] = -1;
+    memset(m->out, 0, maxstates * sizeof(int));
+    m->nstates = 1;
+
+    /* trie */
+    for (i = 1; i <= m->npatterns; ++i) {
+	struct sys_buffer sb;
+	const unsigned char *s;
+	size_t j;
+	int st = 0;
+
+	lua_rawgeti(L, 1, i);
+	mem_read_init(L, -1, &sb);
+	lua_pop(L, 1);
+
+	s = (const unsigned char *) sb.ptr.r;
+	for (j = 0; j < sb.size; ++j) {
+	    int *next = &delta[st * ncls + m->classes[s[j]]];
+
+	    if (*next < 0) *next = m->nstates++;
+	    st = *next;
+	}
+	if (!m->out[st]) m->out[st] = i;
+	m->lens[i - 1] = (int) sb.size;
+    }
+
+    fail = malloc(2 * m->nstates * sizeof(int));
+    if (!fail) return 0;
+    queue = fail + m->nstates;
+
+    /* failure links by breadth-first traversal */
+    m->dict[0] = 0;
+    m->nout[0] = 0;
+    fail[0] = 0;
+    for (c = 0; c < ncls; ++c) {
+	int *next = &delta[c];
+
+	if (*next < 0)
+	    *next = 0;
+	else {
+	    fail[*next] = 0;
+	    queue[tail++] = *next;
+	}
+    }
+    while (head < tail) {
+	const int st = queue[head++];
+	const int f = fail[st];
+
+	m->dict[st] = m->out[f] ? f : m->dict[f];
+	m->nout[st] = (m->out[st] != 0) + m->nout[f];
+
+	for (c = 0; c < ncls; ++c) {
+	    int *next = &delta[st * ncls + c];
+
+	    if (*next < 0)
+		*next = delta[f * ncls + c];
+	    else {
+		fail[*next] = delta[f * ncls + c];
+		queue[tail++] = *next;
+	    }
+	}
+    }
+    free(fail);
+    return 1;
+}
+
+/*
+ * Arguments: patterns (table of strings | membufs), [nocase (boolean)]
+ * Returns: [matcher_udata]
+ */
+static int
+mem_matcher (lua_State *L)
+{
+    const int nocase = lua_toboolean(L, 2);
+    struct matcher *m;
+    size_t maxstates, total;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    m = lua_newuserdata(L, sizeof(struct matcher));
+    memset(m, 0, sizeof(struct matcher));
+    luaL_getmetatable(L, MATCHER_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    m->npatterns = (int) lua_objlen(L, 1);
+    if (!m->npatterns)
+	luaL_argerror(L, 1, "patterns expected");
+
+    total = matcher_classes(L, m, nocase);
+    maxstates = total + 1;
+    if (maxstates > MATCHER_MAXTABLE / sizeof(int) / m->nclasses)
+	return sys_seterror(L, ENOMEM);
+
+    m->delta = malloc(maxstates * m->nclasses * sizeof(int));
+    m->out = malloc(maxstates * sizeof(int));
+    m->dict = malloc(maxstates * sizeof(int));
+    m->nout = malloc(maxstates * sizeof(int));
+    m->lens = malloc(m->npatterns * sizeof(int));
+    if (!m->delta || !m->out || !m->dict || !m->nout || !m->lens
+     || !matcher_build(L, m, maxstates))
+	return sys_seterror(L, ENOMEM);
+
+    /* release the unused trie capacity */
+    if ((size_t) m->nstates < maxstates) {
+	void *p = realloc(m->delta, m->nstates * m->nclasses * sizeof(int));
+	if (p) m->delta = p;
+    }
+    return 1;
+}
+
+/*
+ * Arguments: matcher_udata
+ */
+static int
+matcher_close (lua_State *L)
+{
+    struct matcher *m = checkudata(L, 1, MATCHER_TYPENAME);
+
+    free(m->delta);
+    free(m->out);
+    free(m->dict);
+    free(m->nout);
+    free(m->lens);
+    m->delta = m->out = m->dict = m->nout = m->lens = NULL;
+    m->nstates = 0;
+    return 0;
+}
+
+static struct matcher *
+matcher_check (lua_State *L)
+{
+    struct matcher *m = checkudata(L, 1, MATCHER_TYPENAME);
+
+    if (!m->delta)
+	luaL_argerror(L, 1, "matcher is closed");
+    return m;
+}
+
+/*
+ * Returns: offset
+ */
+static size_t
+matcher_checkdata (lua_State *L, int idx, int off_idx, struct sys_buffer *sb)
+{
+    const lua_Number off = luaL_optnumber(L, off_idx, 0);
+
+    if (!mem_read_init(L, idx, sb))
+	luaL_typeerror(L, idx, "string or membuf");
+    if (off < 0 || off > (lua_Number) sb->size)
+	luaL_argerror(L, off_idx, "out of bounds");
+    return (size_t) off;
+}
+
+/*
+ * Arguments: matcher_udata, data (string | membuf_udata), [offset (number)]
+ * Returns: [pattern_index (number), offset (number)]
+ */
+static int
+matcher_find (lua_State *L)
+{
+    struct matcher *m = matcher_check(L);
+    struct sys_buffer sb;
+    const size_t off = matcher_checkdata(L, 2, 3, &sb);
+    const unsigned char *s = (const unsigned char *) sb.ptr.r + off;
+    const unsigned char *end = (const unsigned char *) sb.ptr.r + sb.size;
+    const int *delta = m->delta;
+    const int ncls = m->nclasses;
+    int st = 0;
+
+    for (; s < end; ++s) {
+	st = delta[st * ncls + m->classes[*s]];
+	if (m->nout[st]) {
+	    /* the longest pattern ending here */
+	    const int i = m->out[st] ? m->out[st] : m->out[m->dict[st]];
+
+	    lua_pushinteger(L, i);
+	    lua_pushnumber(L, (lua_Number)
+	     ((const char *) s + 1 - sb.ptr.r - m->lens[i - 1]));
+	    return 2;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Arguments: matcher_udata, data (string | membuf_udata),
+ *	matches (membuf_udata: "int", "uint", "long", "ulong"),
+ *	[offset (number), state (number)]
+ * Returns: number of matches (number), next_offset (number),
+ *	state (number)
+ *
+ * Matches are stored as pairs of pattern index and start offset;
+ * pass the state to continue with the next data chunk, then the offset
+ * of a match spanning chunks is negative.
+ */
+static int
+matcher_match (lua_State *L)
+{
+    struct matcher *m = matcher_check(L);
+    struct sys_buffer sb;
+    struct csv_out matches;
+    const size_t off = matcher_checkdata(L, 2, 4, &sb);
+    const char *base = sb.ptr.r;
+    const unsigned char *s = (const unsigned char *) base + off;
+    const unsigned char *end = (const unsigned char *) base + sb.size;
+    const int *delta = m->delta;
+    const int ncls = m->nclasses;
+    int st = (int) luaL_optinteger(L, 5, 0);
+
+    csv_checkout(L, 3, &matches);
+    if (st < 0 || st >= m->nstates)
+	luaL_argerror(L, 5, "invalid state");
+
+    for (; s < end; ++s) {
+	const int next = delta[st * ncls + m->classes[*s]];
+
+	if (m->nout[next]) {
+	    const long pos = (long) ((const char *) s + 1 - base);
+	    int i = next;
+
+	    if (matches.n + 2 * m->nout[next] > matches.max)
+		break;
+
+	    if (!m->out[i]) i = m->dict[i];
+	    while (i) {
+		const int k = m->out[i];
+
+		csv_put(&matches, k);
+		csv_put(&matches, pos - m->lens[k - 1]);
+		i = m->dict[i];
+	    }
+	}
+	st = next;
+    }
+
+    lua_pushinteger(L, (int) (matches.n / 2));
+    lua_pushnumber(L, (lua_Number) ((const char *) s - base));
+    lua_pushinteger(L, st);
+    return 3;
+}
+
+/*
+ * Arguments: matcher_udata
+ * Returns: string
+ */
+static int
+matcher_tostring (lua_State *L)
+{
+    struct matcher *m = checkudata(L, 1, MATCHER_TYPENAME);
+
+    lua_pushfstring(L, MATCHER_TYPENAME " (%d patterns, %d states, %p)",
+     m->npatterns, m->nstates, m);
+    return 1;
+}
+
+
+#define BSEARCH_LOWER(type) {						\
+	const type *a = (const type *) mb->data;			\
+	while (lo < hi) {						\
+	    const size_t mid = lo + (hi - lo) / 2;			\
+	    if ((lua_Number) a[mid] < key) lo = mid + 1;		\
+	    else hi = mid;						\
+	}								\
+	found = (lo < n && (lua_Number) a[lo] == key);			\
+    }
+
+/*
+ * Arguments: membuf_udata, value (number), [count (number)]
+ *	| membuf_udata, key (string | membuf_udata),
+ *	[record_size (number), count (number)]
+ * Returns: index (number), found (boolean)
+ */
+static int
+mem_bsearch (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const size_t size = mb->offset ? mb->offset : mb->len;
+    size_t lo = 0, hi, n;
+    lua_Integer count;
+    int found;
+
+    if (!mb->data)
+	luaL_argerror(L, 1, "membuf is closed");
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+	const lua_Number key = lua_tonumber(L, 2);
+	const int type = memtype(mb);
+
+	if (type == SYSMEM_TBITSTRING)
+	    luaL_argerror(L, 1, "bitstring not supported");
+
+	count = luaL_optinteger(L, 3, size / memtypesize(mb));
+	if (count < 0 || (size_t) count > (size_t) mb->len / memtypesize(mb))
+	    luaL_argerror(L, 3, "out of bounds");
+	n = (size_t) count;
+	hi = n;
+
+	switch (type) {
+	case SYSMEM_TCHAR: BSEARCH_LOWER(char); break;
+	case SYSMEM_TUCHAR: BSEARCH_LOWER(unsigned char); break;
+	case SYSMEM_TSHORT: BSEARCH_LOWER(short); break;
+	case SYSMEM_TUSHORT: BSEARCH_LOWER(unsigned short); break;
+	case SYSMEM_TINT: BSEARCH_LOWER(int); break;
+	case SYSMEM_TUINT: BSEARCH_LOWER(unsigned int); break;
+	case SYSMEM_TLONG: BSEARCH_LOWER(long); break;
+	case SYSMEM_TULONG: BSEARCH_LOWER(unsigned long); break;
+	case SYSMEM_TFLOAT: BSEARCH_LOWER(float); break;
+	case SYSMEM_TDOUBLE: BSEARCH_LOWER(double); break;
+	default: BSEARCH_LOWER(lua_Number); break;
+	}
+    }
+    else {
+	/* sorted fixed size records compared by key prefix */
+	struct sys_buffer sb;
+	size_t rec_size;
+
+	if (!mem_read_init(L, 2, &sb))
+	    luaL_typeerror(L, 2, "number, string or membuf");
+	rec_size = (size_t) luaL_optinteger(L, 3, sb.size);
+	if (!sb.size || rec_size < sb.size)
+	    luaL_argerror(L, 3, "record size less than key size");
+
+	count = luaL_optinteger(L, 4, size / rec_size);
+	if (count < 0 || (size_t) count > (size_t) mb->len / rec_size)
+	    luaL_argerror(L, 4, "out of bounds");
+	n = (size_t) count;
+	hi = n;
+
+	while (lo < hi) {
+	    const size_t mid = lo + (hi - lo) / 2;
+
+	    if (memcmp(mb->data + mid * rec_size, sb.ptr.r, sb.size) < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	found = (lo < n && !memcmp(mb->data + lo * rec_size, sb.ptr.r, sb.size));
+    }
+
+    lua_pushnumber(L, (lua_Number) lo);
+    lua_pushboolean(L, found);
+    return 2;
+}
+
+
+static luaL_reg matcher_meth[] = {
+    {"find",		matcher_find},
+    {"match",		matcher_match},
+    {"close",		matcher_close},
+    {"__gc",		matcher_close},
+    {"__tostring",	matcher_tostring},
+    {NULL, NULL}
+};
@@ -0,0 +1,508 @@
+/* Lua System: Memory Buffers: Probabilistic Sketches */
+
+#ifdef SYSMEM_HAVE_ATOMIC
+
+#define SKETCH_TYPENAME	"sys.mem.sketch"
+
+#define SKETCH_MAGIC	0x68636B53  /* "Skch" */
+#define SKETCH_MAXBITS	0xFFFFFFE0U
+
+/* Kinds of sketches */
+enum {
+    SKETCH_BLOOM,
+    SKETCH_COUNTMIN,
+    SKETCH_HLL
+};
+
+/* Shared header; cells follow it */
+struct sketch_header {
+    uint32_t magic;
+    uint32_t kind;
+    uint32_t k;  /* number of hashes | rows | precision */
+    uint32_t width;  /* number of bits | counters per row | registers */
+};
+
+struct memsketch {
+    struct membuf *mb;
+};
+
+#define sketch_cells(hdr)	((uint32_t *) ((hdr) + 1))
+
+#define sketch_load(p) \
+    ((uint32_t) atomic_op((void *) (p), 4, ATOMIC_LOAD, 0, NULL, ATOMIC_RELAXED))
+#define sketch_or(p,v) \
+    atomic_op((void *) (p), 4, ATOMIC_OR, (v), NULL, ATOMIC_RELAXED)
+#define sketch_add(p,v) \
+    atomic_op((void *) (p), 4, ATOMIC_ADD, (v), NULL, ATOMIC_RELAXED)
+
+
+/*
+ * Returns: size of cells in bytes
+ */
+static size_t
+sketch_datasize (const struct sketch_header *hdr)
+{
+    switch (hdr->kind) {
+    case SKETCH_BLOOM: return hdr->width / 8;
+    case SKETCH_COUNTMIN: return (size_t) hdr->k * hdr->width * 4;
+    default: return hdr->width;
+    }
+}
+
+/*
+ * Check the parameters of an attached (maybe foreign) header.
+ * Returns: 0 (invalid) | 1
+ */
+static int
+sketch_checkparams (const struct sketch_header *hdr, size_t size)
+{
+    const uint32_t k = hdr->k, width = hdr->width;
+
+    switch (hdr->kind) {
+    case SKETCH_BLOOM:
+	return k && k <= 32 && width && !(width & 31)
+	 && width <= SKETCH_MAXBITS && width / 8 <= size;
+    case SKETCH_COUNTMIN:
+	return k && k <= 32 && width && width <= 0x7FFFFFFF
+	 && width <= size / 4 / k;
+    case SKETCH_HLL:
+	return k >= 4 && k <= 16 && width == (uint32_t) 1 << k
+	 && width <= size;
+    }
+    return 0;
+}
+
+/*
+ * Arguments: membuf_udata, [initialize (boolean), parameter (number)]
+ * Returns: sketch_udata
+ */
+static int
+sketch_new (lua_State *L, int kind)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const int init = lua_toboolean(L, 2);
+    struct sketch_header *hdr = (struct sketch_header *) mb->data;
+    const size_t size = (mb->len > (int) sizeof(struct sketch_header))
+     ? mb->len - sizeof(struct sketch_header) : 0;
+    struct memsketch *sk;
+
+    if (!hdr || !size || ((size_t) hdr & 7))
+	luaL_argerror(L, 1, "buffer too small");
+
+    if (init) {
+	uint32_t k, width = 0;
+
+	switch (kind) {
+	case SKETCH_BLOOM:
+	    k = (uint32_t) luaL_optinteger(L, 3, 4);
+	    width = (size / 4 > SKETCH_MAXBITS / 32)
+	     ? SKETCH_MAXBITS : (uint32_t) (size / 4 * 32);
+	    if (!k || k > 32)
+		luaL_argerror(L, 3, "number of hashes out of range");
+	    break;
+	case SKETCH_COUNTMIN:
+	    k = (uint32_t) luaL_optinteger(L, 3, 4);
+	    if (!k || k > 32)
+		luaL_argerror(L, 3, "depth out of range");
+	    width = (size / 4 / k > 0x7FFFFFFF)
+	     ? 0x7FFFFFFF : (uint32_t) (size / 4 / k);
+	    break;
+	default:
+	    k = (uint32_t) luaL_optinteger(L, 3, 0);
+	    if (!k) {
+		for (k = 16; k > 4 && ((size_t) 1 << k) > size; --k)
+		    continue;
+	    }
+	    if (k < 4 || k > 16)
+		luaL_argerror(L, 3, "precision out of range");
+	    width = (uint32_t) 1 << k;
+	    if (width > size) width = 0;
+	}
+	if (!width)
+	    luaL_argerror(L, 1, "buffer too small");
+
+	hdr->kind = kind;
+	hdr->k = k;
+	hdr->width = width;
+	memset(sketch_cells(hdr), 0, sketch_datasize(hdr));
+	atomic_op(&hdr->magic, 4, ATOMIC_STORE, SKETCH_MAGIC, NULL, ATOMIC_SEQ_CST);
+    }
+    else if (hdr->magic != SKETCH_MAGIC || hdr->kind != (uint32_t) kind
+     || !sketch_checkparams(hdr, size))
+	luaL_argerror(L, 1, "sketch expected");
+
+    sk = lua_newuserdata(L, sizeof(struct memsketch));
+    sk->mb = mb;
+    luaL_getmetatable(L, SKETCH_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, 1, 0);  /* environ. */
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);  /* keep the membuf */
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, [initialize (boolean), num_hashes (number)]
+ * Returns: sketch_udata
+ */
+static int
+mem_bloom (lua_State *L)
+{
+    return sketch_new(L, SKETCH_BLOOM);
+}
+
+/*
+ * Arguments: membuf_udata, [initialize (boolean), depth (number)]
+ * Returns: sketch_udata
+ */
+static int
+mem_countmin (lua_State *L)
+{
+    return sketch_new(L, SKETCH_COUNTMIN);
+}
+
+/*
+ * Arguments: membuf_udata, [initialize (boolean), precision (number: 4 .. 16)]
+ * Returns: sketch_udata
+ */
+static int
+mem_hll (lua_State *L)
+{
+    return sketch_new(L, SKETCH_HLL);
+}
+
+
+static struct sketch_header *
+sketch_checkheader (lua_State *L, int idx)
+{
+    struct memsketch *sk = checkudata(L, idx, SKETCH_TYPENAME);
+    struct membuf *mb = sk->mb;
+
+    if (mb->flags & SYSMEM_VIEW) mem_checkview(mb);
+    if (!mb->data)
+	luaL_argerror(L, idx, "sketch memory is closed");
+    return (struct sketch_header *) mb->data;
+}
+
+/*
+ * Arguments: ..., key (string | membuf_udata), ...
+ */
+static uint64_t
+sketch_tohash (lua_State *L, int idx, int narg)
+{
+    struct sys_buffer sb;
+
+    if (!sys_buffer_read_init(L, idx, &sb))
+	luaL_typeerror(L, narg, "string or membuf");
+    return hash_xxh64(sb.ptr.r, sb.size, 0);
+}
+
+/*
+ * Index of the i-th cell from double hashing.
+ */
+#define sketch_index(h,i,width) \
+    (uint32_t) (((uint64_t) (uint32_t) (h) \
+     + (uint64_t) (i) * (uint32_t) ((h) >> 32)) % (width))
+
+/*
+ * Set the HyperLogLog register to maximum of it and the rank.
+ * Returns: 0 (not changed) | 1
+ */
+static int
+sketch_setmax (unsigned char *regs, uint32_t j, unsigned int rank)
+{
+    uint32_t *word = (uint32_t *) (regs + (j & ~((uint32_t) 3)));
+
+    for (; ; ) {
+	const uint32_t old = sketch_load(word);
+	uint32_t new_word;
+	unsigned char b[4];
+	int64_t cmp = (int32_t) old;
+
+	memcpy(b, &old, 4);
+	if (b[j & 3] >= rank) return 0;
+	b[j & 3] = (unsigned char) rank;
+	memcpy(&new_word, b, 4);
+
+	atomic_op(word, 4, ATOMIC_CAS, (int32_t) new_word, &cmp, ATOMIC_RELAXED);
+	if (cmp) return 1;
+    }
+}
+
+/*
+ * Returns: 0 (sketch not changed) | 1
+ */
+static int
+sketch_update (struct sketch_header *hdr, uint64_t h)
+{
+    uint32_t *cells = sketch_cells(hdr);
+    const uint32_t k = hdr->k, width = hdr->width;
+    int changed = 0;
+    uint32_t i;
+
+    switch (hdr->kind) {
+    case SKETCH_BLOOM:
+	for (i = 0; i < k; ++i) {
+	    const uint32_t bit = sketch_index(h, i, width);
+	    uint32_t *word = cells + (bit >> 5);
+	    const uint32_t mask = (uint32_t) 1 << (bit & 31);
+
+	    if (!(sketch_load(word) & mask)
+	     && !((uint32_t) sketch_or(word, (int32_t) mask) & mask))
+		changed = 1;
+	}
+	break;
+    case SKETCH_COUNTMIN:
+	for (i = 0; i < k; ++i)
+	    sketch_add(cells + (size_t) i * width + sketch_index(h, i, width), 1);
+	changed = 1;
+	break;
+    default:
+	{
+	    const uint64_t rest = h << k;
+	    const unsigned int max_rank = 64 - k + 1;
+	    unsigned int rank = 1;
+
+	    while (rank < max_rank && !(rest & ((uint64_t) 1 << (64 - rank))))
+		++rank;
+	    changed = sketch_setmax((unsigned char *) cells,
+	     (uint32_t) (h >> (64 - k)), rank);
+	}
+    }
+    return changed;
+}
+
+/*
+ * Arguments: sketch_udata, {key (string | membuf_udata) | keys (table)} ...
+ * Returns: number of keys changed the sketch (number)
+ */
+static int
+sketch_addkeys (lua_State *L)
+{
+    struct sketch_header *hdr = sketch_checkheader(L, 1);
+    const int top = lua_gettop(L);
+    int i, cnt = 0;
+
+    for (i = 2; i <= top; ++i) {
+	if (lua_istable(L, i)) {
+	    const int n = lua_objlen(L, i);
+	    int j;
+
+	    for (j = 1; j <= n; ++j) {
+		lua_rawgeti(L, i, j);
+		cnt += sketch_update(hdr, sketch_tohash(L, -1, i));
+		lua_pop(L, 1);
+	    }
+	}
+	else
+	    cnt += sketch_update(hdr, sketch_tohash(L, i, i));
+    }
+    lua_pushinteger(L, cnt);
+    return 1;
+}
+
+/*
+ * Arguments: sketch_udata, key (string | membuf_udata) ...
+ * Returns: boolean ...
+ */
+static int
+sketch_check (lua_State *L)
+{
+    struct sketch_header *hdr = sketch_checkheader(L, 1);
+    const uint32_t *cells = sketch_cells(hdr);
+    const int top = lua_gettop(L);
+    int i;
+
+    if (hdr->kind != SKETCH_BLOOM)
+	luaL_argerror(L, 1, "bloom filter expected");
+
+    for (i = 2; i <= top; ++i) {
+	const uint64_t h = sketch_tohash(L, i, i);
+	uint32_t j;
+
+	for (j = 0; j < hdr->k; ++j) {
+	    const uint32_t bit = sketch_index(h, j, hdr->width);
+
+	    if (!(sketch_load(cells + (bit >> 5)) & ((uint32_t) 1 << (bit & 31))))
+		break;
+	}
+	lua_pushboolean(L, (j == hdr->k));
+    }
+    return top - 1;
+}
+
+/*
+ * Returns: HyperLogLog cardinality estimate
+ */
+static double
+sketch_hll_estimate (const struct sketch_header *hdr)
+{
+    const unsigned char *regs = (const unsigned char *) sketch_cells(hdr);
+    const uint32_t m = hdr->width;
+    double sum = 0.0, alpha, e;
+    uint32_t j, zeros = 0;
+
+    for (j = 0; j < m; ++j) {
+	sum += ldexp(1.0, -(int) regs[j]);
+	if (!regs[j]) ++zeros;
+    }
+    switch (m) {
+    case 16: alpha = 0.673; break;
+    case 32: alpha = 0.697; break;
+    case 64: alpha = 0.709; break;
+    default: alpha = 0.7213 / (1.0 + 1.079 / m);
+    }
+    e = alpha * m * m / sum;
+
+    /* small range correction */
+    if (e <= 2.5 * m && zeros)
+	e = m * log((double) m / zeros);
+    return e;
+}
+
+/*
+ * Arguments: sketch_udata, [key (string | membuf_udata) ...]
+ * Returns: count (number) ...
+ */
+static int
+sketch_count (lua_State *L)
+{
+    struct sketch_header *hdr = sketch_checkheader(L, 1);
+    const uint32_t *cells = sketch_cells(hdr);
+    const uint32_t k = hdr->k, width = hdr->width;
+    const int top = lua_gettop(L);
+    int i;
+
+    if (top < 2) {
+	lua_Number num;
+	uint32_t j;
+
+	switch (hdr->kind) {
+	case SKETCH_BLOOM:
+	    {
+		/* estimate number of items from number of set bits */
+		double bits = 0.0;
+
+		for (j = 0; j < width / 32; ++j)
+		    bits += bits_popcount64(sketch_load(cells + j));
+		num = (lua_Number) (-(double) width / k
+		 * log(1.0 - bits / width));
+	    }
+	    break;
+	case SKETCH_COUNTMIN:
+	    /* total of increments */
+	    for (num = 0, j = 0; j < width; ++j)
+		num += sketch_load(cells + j);
+	    break;
+	default:
+	    num = (lua_Number) sketch_hll_estimate(hdr);
+	}
+	lua_pushnumber(L, num);
+	return 1;
+    }
+
+    if (hdr->kind != SKETCH_COUNTMIN)
+	luaL_argerror(L, 1, "count-min sketch expected");
+
+    for (i = 2; i <= top; ++i) {
+	const uint64_t h = sketch_tohash(L, i, i);
+	uint32_t j, min = 0xFFFFFFFFU;
+
+	for (j = 0; j < k; ++j) {
+	    const uint32_t v = sketch_load(cells + (size_t) j * width
+	     + sketch_index(h, j, width));
+	    if (min > v) min = v;
+	}
+	lua_pushnumber(L, (lua_Number) min);
+    }
+    return top - 1;
+}
+
+/*
+ * Arguments: sketch_udata, source (sketch_udata)
+ * Returns: sketch_udata
+ */
+static int
+sketch_merge (lua_State *L)
+{
+    struct sketch_header *hdr = sketch_checkheader(L, 1);
+    const struct sketch_header *src = sketch_checkheader(L, 2);
+    uint32_t *cells = sketch_cells(hdr);
+    const uint32_t *src_cells = sketch_cells(src);
+    size_t i, n;
+
+    if (hdr->kind != src->kind || hdr->k != src->k || hdr->width != src->width)
+	luaL_argerror(L, 2, "incompatible sketch");
+
+    n = sketch_datasize(hdr);
+    switch (hdr->kind) {
+    case SKETCH_BLOOM:
+	for (i = 0; i < n / 4; ++i) {
+	    const uint32_t v = sketch_load(src_cells + i);
+
+	    if (v & ~sketch_load(cells + i))
+		sketch_or(cells + i, (int32_t) v);
+	}
+	break;
+    case SKETCH_COUNTMIN:
+	for (i = 0; i < n / 4; ++i) {
+	    const uint32_t v = sketch_load(src_cells + i);
+
+	    if (v) sketch_add(cells + i, (int32_t) v);
+	}
+	break;
+    default:
+	{
+	    const unsigned char *regs = (const unsigned char *) src_cells;
+
+	    for (i = 0; i < n; ++i) {
+		if (regs[i])
+		    sketch_setmax((unsigned char *) cells, (uint32_t) i, regs[i]);
+	    }
+	}
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: sketch_udata
+ * Returns: sketch_udata
+ */
+static int
+sketch_clear (lua_State *L)
+{
+    struct sketch_header *hdr = sketch_checkheader(L, 1);
+
+    memset(sketch_cells(hdr), 0, sketch_datasize(hdr));
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: sketch_udata
+ * Returns: string
+ */
+static int
+sketch_tostring (lua_State *L)
+{
+    struct memsketch *sk = checkudata(L, 1, SKETCH_TYPENAME);
+
+    lua_pushfstring(L, SKETCH_TYPENAME " (%p)", sk->mb->data);
+    return 1;
+}
+
+
+static luaL_reg sketch_meth[] = {
+    {"add",		sketch_addkeys},
+    {"check",		sketch_check},
+    {"count",		sketch_count},
+    {"merge",		sketch_merge},
+    {"clear",		sketch_clear},
+    {"__tostring",	sketch_tostring},
+    {NULL, NULL}
+};
+
+#endif /* SYSMEM_HAVE_ATOMIC */
@@ -0,0 +1,199 @@
+/* Lua System: Memory Buffers: Views */
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define mem_ctz(x)	__builtin_ctz(x)
+#else
+static int
+mem_ctz (unsigned int x)
+{
+    int n = 0;
+
+    while (!(x & 1)) {
+	x >>= 1;
+	++n;
+    }
+    return n;
+}
+#endif
+
+/*
+ * Returns: pointer to first occurrence of the pattern or NULL
+ */
+static const char *
+mem_memmem (const char *s, size_t n, const char *pat, size_t patlen)
+{
+    const char *endp;
+    int first;
+
+    if (!patlen) return s;
+    if (patlen > n) return NULL;
+    if (patlen == 1) return memchr(s, *pat, n);
+
+    endp = s + (n - patlen + 1);  /* last candidate position + 1 */
+
+    /* filter candidates by the first and last pattern bytes */
+#if defined(__AVX2__)
+    {
+	const __m256i vfirst = _mm256_set1_epi8(pat[0]);
+	const __m256i vlast = _mm256_set1_epi8(pat[patlen - 1]);
+
+	for (; s + 32 <= endp; s += 32) {
+	    const __m256i a = _mm256_loadu_si256((const __m256i *) s);
+	    const __m256i b = _mm256_loadu_si256(
+	     (const __m256i *) (s + patlen - 1));
+	    unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+	     _mm256_and_si256(_mm256_cmpeq_epi8(a, vfirst),
+	     _mm256_cmpeq_epi8(b, vlast)));
+
+	    while (mask) {
+		const char *p = s + mem_ctz(mask);
+
+		if (!memcmp(p + 1, pat + 1, patlen - 2))
+		    return p;
+		mask &= mask - 1;
+	    }
+	}
+    }
+#elif defined(__SSE2__)
+    {
+	const __m128i vfirst = _mm_set1_epi8(pat[0]);
+	const __m128i vlast = _mm_set1_epi8(pat[patlen - 1]);
+
+	for (; s + 16 <= endp; s += 16) {
+	    const __m128i a = _mm_loadu_si128((const __m128i *) s);
+	    const __m128i b = _mm_loadu_si128((const __m128i *) (s + patlen - 1));
+	    unsigned int mask = (unsigned int) _mm_movemask_epi8(
+	     _mm_and_si128(_mm_cmpeq_epi8(a, vfirst), _mm_cmpeq_epi8(b, vlast)));
+
+	    while (mask) {
+		const char *p = s + mem_ctz(mask);
+
+		if (!memcmp(p + 1, pat + 1, patlen - 2))
+		    return p;
+		mask &= mask - 1;
+	    }
+	}
+    }
+#endif
+
+    first = *pat++;
+    --patlen;
+    while (s < endp && (s = memchr(s, first, endp - s))) {
+	if (!memcmp(++s, pat, patlen))
+	    return s - 1;
+    }
+    return NULL;
+}
+
+/*
+ * Arguments: ..., membuf_udata, ...
+ * Returns: ..., view (membuf_udata)
+ */
+static void
+mem_pushview (lua_State *L, int idx, struct membuf *mb, int off, int len)
+{
+    struct memview *mv = lua_newuserdata(L, sizeof(struct memview));
+
+    memset(mv, 0, sizeof(struct memview));
+    mv->mb.data = mb->data + off;
+    mv->mb.len = mv->mb.offset = len;
+    mv->mb.flags = memtype(mb) | SYSMEM_VIEW;
+    mv->off = off;
+
+    luaL_getmetatable(L, MEM_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    /* keep the parent alive */
+    lua_createtable(L, SYSMEM_PARENT, 0);
+    if (mb->flags & SYSMEM_VIEW) {
+	/* view of view refers to the root parent */
+	mv->off += ((struct memview *) mb)->off;
+	mb = ((struct memview *) mb)->parent;
+	lua_getfenv(L, idx);
+	lua_rawgeti(L, -1, SYSMEM_PARENT);
+	lua_remove(L, -2);
+    }
+    else
+	lua_pushvalue(L, idx);
+    lua_rawseti(L, -2, SYSMEM_PARENT);
+    lua_setfenv(L, -2);
+
+    mv->parent = mb;
+    mv->gen = mb->gen;
+}
+
+/*
+ * Arguments: membuf_udata, [offset (number), num_bytes (number)]
+ * Returns: view (membuf_udata)
+ */
+static int
+mem_view (lua_State *L)
+{
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const int off = luaL_optinteger(L, 2, 0);
+    const int end = mb->offset ? mb->offset : mb->len;
+    const int len = luaL_optinteger(L, 3, end - off);
+
+    if (!mb->data)
+	luaL_argerror(L, 1, "membuf is closed");
+    if (off < 0 || len < 0 || (mb->len && off + len > mb->len))
+	luaL_argerror(L, 2, "out of bounds");
+
+    mem_pushview(L, 1, mb, off, len);
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, {string | membuf_udata}
+ * Returns: number (-1 | 0 | 1)
+ */
+static int
+mem_compare (lua_State *L)
+{
+    struct sys_buffer sb, osb;
+    size_t n;
+    int res;
+
+    mem_checkbuffer(L, 1);
+    sys_buffer_read_init(L, 1, &sb);
+    if (!sys_buffer_read_init(L, 2, &osb))
+	luaL_typeerror(L, 2, "string or membuf");
+
+    n = (sb.size < osb.size) ? sb.size : osb.size;
+    res = n ? memcmp(sb.ptr.r, osb.ptr.r, n) : 0;
+    if (!res && sb.size != osb.size)
+	res = (sb.size < osb.size) ? -1 : 1;
+
+    lua_pushinteger(L, (res > 0) - (res < 0));
+    return 1;
+}
+
+/*
+ * Arguments: membuf_udata, pattern (string | membuf_udata),
+ *	[offset (number)]
+ * Returns: [offset (number)]
+ */
+static int
+mem_find (lua_State *L)
+{
+    struct sys_buffer sb, psb;
+    const int off = luaL_optinteger(L, 3, 0);
+    const char *s;
+
+    mem_checkbuffer(L, 1);
+    mem_read_init(L, 1, &sb);
+    if (!mem_read_init(L, 2, &psb))
+	luaL_typeerror(L, 2, "string or membuf");
+
+    if (off < 0 || (size_t) off > sb.size)
+	return 0;
+
+    s = mem_memmem(sb.ptr.r + off, sb.size - off, psb.ptr.r, psb.size);
+    if (!s) return 0;
+    lua_pushinteger(L, s - sb.ptr.r);
+    return 1;
+}
@@ -2,9 +2,193 @@
 
 #define SYSMEM_BUFLINE	256
 
+#define STREAM_FULL	(-2)  /* no room in the buffer to read ahead */
+
+
+/*
+ * Ensure room for n more bytes.
+ */
+static int
+membuf_reserve (struct membuf *mb, size_t n)
+{
+    const size_t newlen = mb->offset + n;
+    size_t len = mb->len;
+    void *p;
+
+    if (newlen < len) return 1;
+    if (!(mb->flags & SYSMEM_ALLOC)) return 0;
+
+    if (!len) len = BUFF_INITIALSIZE;
+    while ((len *= 2) <= newlen)
+	continue;
+    if (!(p = realloc(mb->data, len)))
+	return 0;
+    memchanged(mb);
+    mb->len = len;
+    mb->data = p;
+    return 1;
+}
+
+
+/*
+ * Native streams: sys.handle and sys.sock.handle
+ */
+
+/*
+ * Returns: SYSMEM_ISTREAM_FD [| SYSMEM_ISTREAM_SOCK] | 0
+ */
+static unsigned int
+stream_handletype (lua_State *L, int idx)
+{
+    unsigned int res = 0;
+
+    if (lua_type(L, idx) == LUA_TUSERDATA && lua_getmetatable(L, idx)) {
+	luaL_getmetatable(L, FD_TYPENAME);
+	if (lua_rawequal(L, -2, -1))
+	    res = SYSMEM_ISTREAM_FD;
+	else {
+	    lua_pop(L, 1);
+	    luaL_getmetatable(L, SD_TYPENAME);
+	    if (lua_rawequal(L, -2, -1))
+		res = SYSMEM_ISTREAM_FD | SYSMEM_ISTREAM_SOCK;
+	}
+	lua_pop(L, 2);
+    }
+    return res;
+}
+
+/*
+ * Returns: number of bytes read, 0 on EOF, -1 on error
+ */
+static int
+stream_fdread (struct membuf *mb, char *p, size_t n)
+{
+    const lua_Integer fd = *mb->ifd;
+    int nr;
+
+    sys_vm_leave();
+#ifndef _WIN32
+    do nr = read((int) fd, p, n);
+    while (nr == -1 && SYS_ERRNO == EINTR);
+#else
+    if (mb->flags & SYSMEM_ISTREAM_SOCK)
+	nr = recv((sd_t) fd, p, n, 0);
+    else {
+	DWORD l;
+	nr = ReadFile((fd_t) fd, p, n, &l, NULL) ? (int) l : -1;
+    }
+#endif
+    sys_vm_enter();
+    return nr;
+}
+
+/*
+ * Read ahead into free space of the buffer until at least `want' bytes
+ * are buffered or the stream has no more data.
+ * Returns: result of last read | STREAM_FULL
+ */
+static int
+stream_fdfill (struct membuf *mb, size_t want)
+{
+    int nr = 0;
+
+    while ((size_t) mb->offset < want) {
+	const size_t left = want - mb->offset;
+	size_t rlen;
+
+	/* read size grows with the buffer */
+	membuf_reserve(mb, (left < SYS_BUFSIZE) ? left : SYS_BUFSIZE);
+	rlen = mb->len - mb->offset;
+	if (!rlen) {
+	    nr = STREAM_FULL;
+	    break;
+	}
+
+	nr = stream_fdread(mb, mb->data + mb->offset, rlen);
+	if (nr <= 0) break;
+	mb->offset += nr;
+	if ((size_t) nr < rlen) break;
+    }
+    return nr;
+}
+
+/*
+ * Write the buffered data and the string.
+ * np: in: length of the string; out: number of string's bytes written
+ * Returns: 0 | -1 (error)
+ */
+static int
+stream_fdwrite (struct membuf *mb, const char *s, size_t *np)
+{
+    const lua_Integer fd = *mb->ofd;
+    const char *p = mb->data;
+    size_t len = mb->offset;
+    size_t n = *np;
+    int nw = 0, err = 0;
+
+    sys_vm_leave();
+    while (len + n) {
+#ifndef _WIN32
+	struct iovec iov[2];
+	int niov = 0;
+
+	if (len) {
+	    iov[0].iov_base = (char *) p;
+	    iov[0].iov_len = len;
+	    niov = 1;
+	}
+	if (n) {
+	    iov[niov].iov_base = (char *) s;
+	    iov[niov].iov_len = n;
+	    niov++;
+	}
+	do nw = writev((int) fd, iov, niov);
+	while (nw == -1 && SYS_ERRNO == EINTR);
+#else
+	const char *wp = len ? p : s;
+	const size_t wn = len ? len : n;
+
+	if (mb->flags & SYSMEM_OSTREAM_SOCK)
+	    nw = send((sd_t) fd, wp, wn, 0);
+	else {
+	    DWORD l;
+	    nw = WriteFile((fd_t) fd, wp, wn, &l, NULL) ? (int) l : -1;
+	}
+#endif
+	if (nw == -1) {
+	    err = SYS_ERRNO;
+	    break;
+	}
+	if ((size_t) nw < len) {
+	    p += nw;
+	    len -= nw;
+	} else {
+	    nw -= len;
+	    len = 0;
+	    s += nw;
+	    n -= nw;
+	}
+    }
+    sys_vm_enter();
+
+    if (p != mb->data || !len)
+	mem_consume(mb, mb->offset - len);
+    *np -= n;
+    if (nw == -1) {
+#ifndef _WIN32
+	errno = err;
+#else
+	SetLastError(err);
+#endif
+	return -1;
+    }
+    return 0;
+}
+
 
 /*
  * Arguments: membuf_udata, ...
+ * Returns: 1 | 0 (not written) | -1 (error of the handle)
  */
 static int
 stream_write (lua_State *L, struct membuf *mb)
@@ -12,6 +196,12 @@ stream_write (lua_State *L, struct membuf *mb)
     const int bufio = (mb->flags & SYSMEM_OSTREAM_BUFIO);
     int res;
 
+    if (mb->flags & SYSMEM_OSTREAM_FD) {
+	size_t n = 0;
+
+	return (mb->offset && stream_fdwrite(mb, NULL, &n)) ? -1 : 1;
+    }
+
     lua_getfenv(L, 1);
     lua_rawgeti(L, -1, SYSMEM_OUTPUT);  /* stream object */
     lua_getfield(L, -1, "write");
@@ -33,30 +223,30 @@ stream_write (lua_State *L, struct membuf *mb)
 static int
 membuf_addlstring (lua_State *L, struct membuf *mb, const char *s, size_t n)
 {
-    int offset = mb->offset;
-    size_t newlen = offset + n, len = mb->len;
-
-    if (newlen >= len) {
+    if ((size_t) mb->offset + n >= (size_t) mb->len) {
 	const unsigned int flags = mb->flags;
-	void *p;
 
-	if ((flags & SYSMEM_OSTREAM) && stream_write(L, mb)) {
-	    offset = mb->offset;
-	    len = mb->len;
-	    if (n < len - offset)
-		goto end;
+	if (flags & SYSMEM_OSTREAM) {
+	    if (s && (flags & SYSMEM_OSTREAM_FD)) {
+		/* write the string together with buffered data */
+		size_t nw = n;
+		const int res = stream_fdwrite(mb, s, &nw);
+
+		if (nw == n) return 1;
+		if (res && !SYS_EAGAIN(SYS_ERRNO))
+		    return 0;
+		s += nw;
+		n -= nw;
+	    }
+	    else if (stream_write(L, mb) == -1 && !SYS_EAGAIN(SYS_ERRNO))
+		return 0;
 	}
-	while ((len *= 2) <= newlen)
-	    continue;
-	if (!(flags & SYSMEM_ALLOC) || !(p = realloc(mb->data, len)))
+	if (!membuf_reserve(mb, n))
 	    return 0;
-	mb->len = len;
-	mb->data = p;
     }
- end:
     if (s != NULL) {
-	memcpy(mb->data + offset, s, n);
-	mb->offset = offset + n;
+	memcpy(mb->data + mb->offset, s, n);
+	mb->offset += n;
     }
     return 1;
 }
@@ -68,14 +258,14 @@ membuf_addlstring (lua_State *L, struct membuf *mb, const char *s, size_t n)
 static int
 membuf_write (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     int nargs, i;
 
     nargs = lua_gettop(L);
     for (i = 2; i <= nargs; ++i) {
 	size_t len = lua_rawlen(L, i);
 	if (len && !membuf_addlstring(L, mb, lua_tostring(L, i), len))
-	    return 0;
+	    return (mb->flags & SYSMEM_OSTREAM_FD) ? sys_seterror(L, 0) : 0;
     }
     lua_pushboolean(L, 1);
     return 1;
@@ -99,7 +289,7 @@ membuf_writeln (lua_State *L)
 static int
 membuf_tostring (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int len = luaL_optinteger(L, 2, mb->offset);
 
     lua_pushlstring(L, mb->data, len);
@@ -113,7 +303,7 @@ membuf_tostring (lua_State *L)
 static int
 membuf_seek (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
 
     if (lua_gettop(L) > 1) {
 	mb->offset = lua_tointeger(L, 2);
@@ -130,10 +320,14 @@ membuf_seek (lua_State *L)
 static int
 membuf_assosiate (lua_State *L, int type)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int idx = (type == SYSMEM_ISTREAM) ? SYSMEM_INPUT : SYSMEM_OUTPUT;
 
+    const int shift = (type == SYSMEM_ISTREAM) ? 0 : 1;
+    unsigned int handle_type;
+
     lua_settop(L, 2);
+    mb->flags &= ~((SYSMEM_ISTREAM_FD | SYSMEM_ISTREAM_SOCK) << shift);
     if (lua_isnoneornil(L, 2))
 	mb->flags &= ~type;
     else {
@@ -145,6 +339,18 @@ membuf_assosiate (lua_State *L, int type)
 	     ? SYSMEM_ISTREAM_BUFIO : SYSMEM_OSTREAM_BUFIO;
 	}
 	lua_pop(L, 1);
+
+	/* do I/O directly with the handle */
+	handle_type = stream_handletype(L, 2);
+	if (handle_type) {
+	    lua_Integer *fdp = lua_touserdata(L, 2);
+
+	    if (type == SYSMEM_ISTREAM)
+		mb->ifd = fdp;
+	    else
+		mb->ofd = fdp;
+	    mb->flags |= handle_type << shift;
+	}
     }
 
     lua_getfenv(L, 1);
@@ -206,23 +412,71 @@ read_bytes (lua_State *L, struct membuf *mb, size_t l)
 {
     int n = mb->offset;
 
-    if (!n && (mb->flags & SYSMEM_ISTREAM)) {
+    if (mb->flags & SYSMEM_ISTREAM_FD) {
+	const int nr = ((size_t) n < l) ? stream_fdfill(mb, l) : 0;
+
+	if (nr < 0 && !mb->offset) {
+	    if (nr == STREAM_FULL)
+		return sys_seterror(L, ENOBUFS);
+	    if (!SYS_EAGAIN(SYS_ERRNO))
+		return sys_seterror(L, 0);
+	    lua_pushboolean(L, 0);
+	    return 1;
+	}
+	n = mb->offset;
+    }
+    else if (!n && (mb->flags & SYSMEM_ISTREAM)) {
 	stream_read(L, l, (mb->flags & SYSMEM_ISTREAM_BUFIO));
 	return 1;
     }
 
     if (l > (size_t) n) l = n;
     if (l) {
-	char *p = mb->data;  /* avoid warning */
-	lua_pushlstring(L, p, l);
-	n -= l;
-	mb->offset = n;
-	if (n) memmove(p, p + 1, n);
+	lua_pushlstring(L, mb->data, l);
+	mem_consume(mb, l);
     } else
 	lua_pushnil(L);
     return 1;
 }
 
+static int
+read_fdline (lua_State *L, struct membuf *mb)
+{
+    size_t from = mb->offset;  /* buffered data has no newline */
+
+    for (; ; ) {
+	const int nr = stream_fdfill(mb, from + 1);
+	const char *nl;
+	size_t n = mb->offset;
+
+	if (nr == STREAM_FULL)
+	    return sys_seterror(L, ENOBUFS);  /* line is longer than buffer */
+	if (nr == -1) {
+	    if (!SYS_EAGAIN(SYS_ERRNO))
+		return sys_seterror(L, 0);
+	    lua_pushboolean(L, 0);  /* keep partial line buffered */
+	    return 1;
+	}
+	if (n == from) {
+	    /* end of stream: return the tail */
+	    if (n) {
+		lua_pushlstring(L, mb->data, n);
+		mb->offset = 0;
+	    } else
+		lua_pushnil(L);
+	    return 1;
+	}
+	nl = memchr(mb->data + from, '\n', n - from);
+	if (nl) {
+	    n = nl - mb->data;
+	    lua_pushlstring(L, mb->data, n);
+	    mem_consume(mb, n + 1);
+	    return 1;
+	}
+	from = n;
+    }
+}
+
 static int
 read_line (lua_State *L, struct membuf *mb)
 {
@@ -230,18 +484,17 @@ read_line (lua_State *L, struct membuf *mb)
     size_t l, n = mb->offset;
 
     if (n && (nl = memchr(s, '\n', n))) {
-	char *p = mb->data;  /* avoid warning */
-	l = nl - p;
-	lua_pushlstring(L, p, l);
-	n -= l + 1;
-	mb->offset = n;
-	if (n) memmove(p, nl + 1, n);
+	l = nl - s;
+	lua_pushlstring(L, s, l);
+	mem_consume(mb, l + 1);
 	return 1;
     }
     if (!(mb->flags & SYSMEM_ISTREAM)) {
 	n = 1;
 	goto end;
     }
+    if (mb->flags & SYSMEM_ISTREAM_FD)
+	return read_fdline(L, mb);
     for (; ; ) {
 	stream_read(L, SYSMEM_BUFLINE, 0);
 	s = lua_tolstring(L, -1, &n);
@@ -280,10 +533,10 @@ read_line (lua_State *L, struct membuf *mb)
 static int
 membuf_read (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
 
     lua_settop(L, 2);
-    if (mb->flags & SYSMEM_ISTREAM) {
+    if ((mb->flags & (SYSMEM_ISTREAM | SYSMEM_ISTREAM_FD)) == SYSMEM_ISTREAM) {
 	lua_getfenv(L, 1);
 	lua_rawgeti(L, -1, SYSMEM_INPUT);  /* stream object */
 	lua_getfield(L, -1, "read");
@@ -291,7 +544,7 @@ membuf_read (lua_State *L)
     }
 
     if (lua_type(L, 2) == LUA_TNUMBER)
-	read_bytes(L, mb, lua_tointeger(L, 2));
+	return read_bytes(L, mb, lua_tointeger(L, 2));
     else {
 	const char *s = luaL_optstring(L, 2, "*a");
 
@@ -299,8 +552,7 @@ membuf_read (lua_State *L)
 	case 'l':
 	    return read_line(L, mb);
 	case 'a':
-	    read_bytes(L, mb, ~((size_t) 0));
-	    break;
+	    return read_bytes(L, mb, ~((size_t) 0));
 	default:
 	    luaL_argerror(L, 2, "invalid option");
 	}
@@ -315,14 +567,21 @@ membuf_read (lua_State *L)
 static int
 membuf_flush (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int is_close = lua_toboolean(L, 2);
-    int res = 1;
+    int res = 1, err = 0;
 
     if (mb->flags & SYSMEM_OSTREAM) {
 	res = stream_write(L, mb);
+	if (res == -1) err = SYS_ERRNO;
 	if (is_close) mem_free(L);
     }
+    if (res == -1) {
+	if (!SYS_EAGAIN(err))
+	    return sys_seterror(L, err);
+	lua_pushboolean(L, 0);  /* rest of data is buffered */
+	return 1;
+    }
     lua_settop(L, 1);
     return res;
 }
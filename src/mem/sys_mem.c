@@ -1,5 +1,7 @@
 /* Lua System: Memory Buffers */
 
+#include <math.h>
+
 #ifdef _WIN32
 
 #define SYSMEM_HAVE_MMAP
@@ -8,6 +10,13 @@
 
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #ifdef _POSIX_MAPPED_FILES
 #define SYSMEM_HAVE_MMAP
@@ -23,6 +32,9 @@
 struct membuf {
     char *data;
     int len, offset;
+    unsigned int gen;  /* incremented when data is relocated or freed */
+    lua_Integer *ifd, *ofd;  /* handles of native input/output streams */
+    int64_t map_off;  /* file offset of mapping, -1 for anonymous */
 
 #define SYSMEM_TYPE_SHIFT	8
 #define SYSMEM_TCHAR		((0  << SYSMEM_TYPE_SHIFT) | sizeof(char))
@@ -42,15 +54,30 @@ struct membuf {
 
 #define SYSMEM_UDATA		0x010000  /* memory allocated as userdata */
 #define SYSMEM_ALLOC		0x020000  /* memory allocated */
+#define SYSMEM_VIEW		0x040000  /* view of parent buffer's memory */
 #define SYSMEM_MAP		0x080000  /* memory mapped */
 #define SYSMEM_ISTREAM		0x100000  /* buffer assosiated with input stream */
 #define SYSMEM_OSTREAM		0x200000  /* buffer assosiated with output stream */
 #define SYSMEM_ISTREAM_BUFIO	0x400000  /* input stream can operate with buffers */
 #define SYSMEM_OSTREAM_BUFIO	0x800000  /* output stream can operate with buffers */
+#define SYSMEM_ISTREAM_FD	0x1000000  /* input stream is sys.handle or socket */
+#define SYSMEM_OSTREAM_FD	0x2000000  /* output stream is sys.handle or socket */
+#define SYSMEM_ISTREAM_SOCK	0x4000000  /* input stream is sys.sock.handle */
+#define SYSMEM_OSTREAM_SOCK	0x8000000  /* output stream is sys.sock.handle */
+#define SYSMEM_MAP_SHARED	0x10000000  /* memory mapped as shared */
     unsigned int flags;
 };
 
-#define memisptr(mb)		(!((mb)->flags & (SYSMEM_UDATA | SYSMEM_ALLOC | SYSMEM_MAP)))
+/* View of parent buffer's sub-range */
+struct memview {
+    struct membuf mb;
+    struct membuf *parent;
+    unsigned int gen;  /* parent's generation */
+    int off;  /* offset in parent's memory */
+};
+
+#define memisptr(mb)		(!((mb)->flags & (SYSMEM_UDATA | SYSMEM_ALLOC | SYSMEM_MAP | SYSMEM_VIEW)))
+#define memchanged(mb)		((mb)->gen++)
 #define memtype(mb)		((mb)->flags & SYSMEM_TYPE_MASK)
 #define memtypesize(mb)		((mb)->flags & SYSMEM_SIZE_MASK)
 #define memlen(type, nitems)	((type) != SYSMEM_TBITSTRING				\
@@ -71,7 +98,8 @@ static const char *const type_names[] = {
 /* MemBuffer environ. table reserved indexes */
 enum {
     SYSMEM_INPUT = 1,
-    SYSMEM_OUTPUT
+    SYSMEM_OUTPUT,
+    SYSMEM_PARENT  /* parent of view */
 };
 
 
@@ -79,6 +107,35 @@ static int membuf_addlstring (lua_State *L, struct membuf *mb,
                               const char *s, size_t n);
 
 
+/*
+ * Follow the parent's memory, if it was relocated.
+ */
+static void
+mem_checkview (struct membuf *mb)
+{
+    struct memview *mv = (struct memview *) mb;
+    const struct membuf *parent = mv->parent;
+
+    if (mv->gen == parent->gen) return;
+
+    mv->gen = parent->gen;
+    if (parent->data && (!parent->len || mv->off + mb->len <= parent->len))
+	mb->data = parent->data + mv->off;
+    else {
+	mb->data = NULL;
+	mb->len = mb->offset = 0;
+    }
+}
+
+static struct membuf *
+mem_checkbuffer (lua_State *L, int idx)
+{
+    struct membuf *mb = checkudata(L, idx, MEM_TYPENAME);
+
+    if (mb->flags & SYSMEM_VIEW) mem_checkview(mb);
+    return mb;
+}
+
 static struct membuf *
 mem_tobuffer (lua_State *L, int idx)
 {
@@ -90,11 +147,36 @@ mem_tobuffer (lua_State *L, int idx)
 	luaL_getmetatable(L, MEM_TYPENAME);
 	is_buffer = lua_rawequal(L, -2, -1);
 	lua_pop(L, 2);
-	if (is_buffer) return mb;
+	if (is_buffer) {
+	    if (mb->flags & SYSMEM_VIEW) mem_checkview(mb);
+	    return mb;
+	}
     }
     return NULL;
 }
 
+/*
+ * Drop the first n bytes of buffered data.
+ */
+static void
+mem_consume (struct membuf *mb, size_t n)
+{
+    if (mb->flags & SYSMEM_VIEW) {
+	/* do not touch the parent's memory */
+	mb->data += n;
+	mb->len -= n;
+	mb->offset -= n;
+	((struct memview *) mb)->off += n;
+    }
+    else if (mb->offset == (int) n)
+	mb->offset = 0;
+    else {
+	/* move tail */
+	mb->offset -= n;
+	memmove(mb->data, mb->data + n, mb->offset);
+    }
+}
+
 /*
  * Arguments: ..., {string | membuf_udata}
  */
@@ -119,20 +201,26 @@ sys_buffer_read_init (lua_State *L, int idx, struct sys_buffer *sb)
     return 0;
 }
 
+/*
+ * Like sys_buffer_read_init(), but an unwritten membuf
+ * (e.g. mapped file) is read in whole length.
+ */
+static int
+mem_read_init (lua_State *L, int idx, struct sys_buffer *sb)
+{
+    if (!sys_buffer_read_init(L, idx, sb))
+	return 0;
+    if (sb->mb && !sb->size)
+	sb->size = sb->mb->len;
+    return 1;
+}
+
 void
 sys_buffer_read_next (struct sys_buffer *sb, size_t n)
 {
     struct membuf *mb = sb->mb;
 
-    if (!mb) return;
-
-    if (mb->offset == (int) n)
-	mb->offset = 0;
-    else {
-	/* move tail */
-	mb->offset -= n;
-	memmove(mb->data, mb->data + n, mb->offset);
-    }
+    if (mb) mem_consume(mb, n);
 }
 
 /*
@@ -143,7 +231,7 @@ sys_buffer_write_init (lua_State *L, int idx, struct sys_buffer *sb,
                        char *buf, size_t buflen)
 {
     struct membuf *mb = buf ? mem_tobuffer(L, idx)
-     : checkudata(L, idx, MEM_TYPENAME);
+     : mem_checkbuffer(L, idx);
 
     if (mb) {
 	sb->ptr.w = mb->data + mb->offset;
@@ -182,7 +270,7 @@ sys_buffer_write_next (lua_State *L, struct sys_buffer *sb,
 	    memcpy(p, buf, size);
 	}
 	else {
-	    size = 2 * osb->size;
+	    size = (sb->ptr.w - osb->ptr.w) + sb->size;
 	    p = realloc(osb->ptr.w, 2 * size);
 	    if (!p) return 0;
 	    sb->size = size;
@@ -194,6 +282,37 @@ sys_buffer_write_next (lua_State *L, struct sys_buffer *sb,
     return 1;
 }
 
+/*
+ * Ensure room for n bytes before the first write.
+ * The allocated memory is released by sys_buffer_write_done().
+ */
+int
+sys_buffer_write_reserve (lua_State *L, struct sys_buffer *sb,
+                          char *buf, size_t n)
+{
+    struct membuf *mb = sb->mb;
+
+    if (sb->size >= n) return 1;
+
+    if (mb) {
+	if (!membuf_addlstring(L, mb, NULL, n))
+	    return 0;
+	sb->ptr.w = mb->data + mb->offset;
+	sb->size = mb->len - mb->offset;
+    }
+    else {
+	struct sys_buffer *osb = (void *) buf;
+	char *p = malloc(n);
+
+	if (!p) return 0;
+	sb->ptr.w = p;
+	sb->size = n;
+	osb->ptr.w = p;
+	osb->size = 0;
+    }
+    return 1;
+}
+
 int
 sys_buffer_write_done (lua_State *L, struct sys_buffer *sb,
                        char *buf, size_t tail)
@@ -216,6 +335,73 @@ sys_buffer_write_done (lua_State *L, struct sys_buffer *sb,
     }
 }
 
+#ifndef _WIN32
+
+#if defined(IOV_MAX) && (IOV_MAX < 64)
+#define SYS_IOVMAX	IOV_MAX
+#else
+#define SYS_IOVMAX	64  /* max. number of buffers per writev() */
+#endif
+
+/*
+ * Arguments: ..., {string | membuf_udata} ...
+ * Returns: number of bytes written or -1
+ */
+ssize_t
+sys_buffer_writev (lua_State *L, int idx, int fd, int *donep)
+{
+    struct sys_buffer sbs[SYS_IOVMAX];
+    struct iovec iov[SYS_IOVMAX];
+    const int nargs = lua_gettop(L);
+    ssize_t n = 0;  /* number of chars actually write */
+    int i = idx;
+
+    *donep = 0;
+    while (i <= nargs) {
+	ssize_t nw;
+	int k, cnt = 0;
+
+	/* gather the buffers */
+	for (; i <= nargs && cnt < SYS_IOVMAX; ++i) {
+	    struct sys_buffer *sb = &sbs[cnt];
+
+	    if (!sys_buffer_read_init(L, i, sb) || !sb->size)
+		continue;
+	    iov[cnt].iov_base = (char *) sb->ptr.r;
+	    iov[cnt].iov_len = sb->size;
+	    ++cnt;
+	}
+	if (!cnt) break;
+
+	sys_vm_leave();
+	do nw = writev(fd, iov, cnt);
+	while (nw == -1 && SYS_ERRNO == EINTR);
+	sys_vm_enter();
+
+	if (nw == -1) {
+	    if (n > 0 || SYS_EAGAIN(SYS_ERRNO)) return n;
+	    return -1;
+	}
+	n += nw;
+
+	/* advance the written buffers */
+	for (k = 0; k < cnt; ++k) {
+	    const size_t len = sbs[k].size;
+
+	    if ((size_t) nw < len) {
+		if (nw) sys_buffer_read_next(&sbs[k], nw);
+		return n;
+	    }
+	    sys_buffer_read_next(&sbs[k], len);
+	    nw -= len;
+	}
+    }
+    *donep = 1;
+    return n;
+}
+
+#endif
+
 
 /*
  * Arguments: [num_bytes (number)]
@@ -247,7 +433,7 @@ mem_new (lua_State *L)
 static int
 mem_type (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
 
     if (lua_gettop(L) > 1) {
 	const int type = type_flags[luaL_checkoption(L, 2, NULL, type_names)];
@@ -270,43 +456,185 @@ mem_type (lua_State *L)
 static int
 mem_typesize (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
 
     lua_pushinteger(L, memtypesize(mb));
     return 1;
 }
 
+
+#ifdef SYSMEM_HAVE_MMAP
+
+/* Mapping options */
+enum {
+    SYSMEM_OPT_POPULATE		= 0x01,  /* prefault pages */
+    SYSMEM_OPT_HUGETLB		= 0x02,  /* use huge pages */
+    SYSMEM_OPT_HUGEPAGE		= 0x04,  /* use transparent huge pages */
+    SYSMEM_OPT_SEQUENTIAL	= 0x08,
+    SYSMEM_OPT_RANDOM		= 0x10,
+    SYSMEM_OPT_WILLNEED		= 0x20,
+    SYSMEM_OPT_DONTNEED		= 0x40,
+    SYSMEM_OPT_LOCK		= 0x80   /* lock pages in memory */
+};
+
+static const char *const mem_optnames[] = {
+    "populate", "hugetlb", "hugepage", "sequential", "random",
+    "willneed", "dontneed", "lock", NULL
+};
+
+/*
+ * Arguments: ..., [options (string: "populate,hugepage,...")]
+ */
+static int
+mem_checkopts (lua_State *L, int idx)
+{
+    const char *s = luaL_optstring(L, idx, "");
+    int opts = 0;
+
+    while (*s) {
+	const char *endp = s + strcspn(s, ", ");
+	const size_t n = endp - s;
+	int i;
+
+	for (i = 0; n && mem_optnames[i]; ++i) {
+	    if (!strncmp(s, mem_optnames[i], n) && !mem_optnames[i][n])
+		break;
+	}
+	if (n) {
+	    if (!mem_optnames[i])
+		luaL_argerror(L, idx, "invalid option");
+	    opts |= 1 << i;
+	}
+	s = *endp ? endp + 1 : endp;
+    }
+    return opts;
+}
+
+/*
+ * Apply hints to the mapped memory.
+ * Returns: 0 | -1 (failed to lock)
+ */
+static int
+mem_applyopts (char *p, size_t len, int opts)
+{
+#ifndef _WIN32
+#ifdef MADV_HUGEPAGE
+    if (opts & SYSMEM_OPT_HUGEPAGE)
+	madvise(p, len, MADV_HUGEPAGE);
+#endif
+    if (opts & SYSMEM_OPT_SEQUENTIAL)
+	madvise(p, len, MADV_SEQUENTIAL);
+    if (opts & SYSMEM_OPT_RANDOM)
+	madvise(p, len, MADV_RANDOM);
+#ifdef MAP_POPULATE
+    if ((opts & SYSMEM_OPT_WILLNEED) && !(opts & SYSMEM_OPT_POPULATE))
+#else
+    if (opts & (SYSMEM_OPT_WILLNEED | SYSMEM_OPT_POPULATE))
+#endif
+	madvise(p, len, MADV_WILLNEED);
+    if (opts & SYSMEM_OPT_DONTNEED)
+	madvise(p, len, MADV_DONTNEED);
+    if (opts & SYSMEM_OPT_LOCK)
+	return mlock(p, len);
+#else
+    if (opts & SYSMEM_OPT_LOCK)
+	return VirtualLock(p, len) ? 0 : -1;
+#endif
+    return 0;
+}
+
+#endif /* SYSMEM_HAVE_MMAP */
+
 /*
- * Arguments: membuf_udata, [num_bytes (number), zerofill (boolean)]
+ * Arguments: membuf_udata, [num_bytes (number), zerofill (boolean),
+ *	options (string: "populate,hugetlb,hugepage,lock,...")]
  * Returns: [membuf_udata]
  */
 static int
 mem_alloc (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int len = luaL_optinteger(L, 2, BUFF_INITIALSIZE);
-    const int zerofill = lua_isboolean(L, -1) && lua_toboolean(L, -1);
+    const int zerofill = lua_toboolean(L, 3);
 
-    mb->flags |= SYSMEM_ALLOC;
+    memchanged(mb);
+    mb->flags &= ~(SYSMEM_VIEW | SYSMEM_ALLOC | SYSMEM_MAP | SYSMEM_MAP_SHARED);
     mb->len = len;
     mb->offset = 0;
+
+#if defined(SYSMEM_HAVE_MMAP) && !defined(_WIN32) && defined(MAP_ANON)
+    /* anonymous mapping */
+    if (!lua_isnoneornil(L, 4)) {
+	const int opts = mem_checkopts(L, 4);
+	int flags = MAP_PRIVATE | MAP_ANON;
+	void *ptr;
+
+#ifdef MAP_POPULATE
+	if (opts & SYSMEM_OPT_POPULATE) flags |= MAP_POPULATE;
+#endif
+#ifdef MAP_HUGETLB
+	if (opts & SYSMEM_OPT_HUGETLB) flags |= MAP_HUGETLB;
+#endif
+	sys_vm_leave();
+	ptr = mmap(0, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (ptr != MAP_FAILED && mem_applyopts(ptr, len, opts)) {
+	    munmap(ptr, len);
+	    ptr = MAP_FAILED;
+	}
+	sys_vm_enter();
+
+	if (ptr == MAP_FAILED) {
+	    mb->data = NULL;
+	    return sys_seterror(L, 0);
+	}
+	mb->flags |= SYSMEM_MAP;
+	mb->data = ptr;
+	mb->map_off = -1;
+	lua_settop(L, 1);
+	return 1;
+    }
+#endif
+
+    mb->flags |= SYSMEM_ALLOC;
     mb->data = zerofill ? calloc(len, 1) : malloc(len);
+#if defined(SYSMEM_HAVE_MMAP) && (defined(_WIN32) || !defined(MAP_ANON))
+    if (mb->data && !lua_isnoneornil(L, 4)
+     && mem_applyopts(mb->data, len, mem_checkopts(L, 4))) {
+	free(mb->data);
+	mb->data = NULL;
+	return sys_seterror(L, 0);
+    }
+#endif
     lua_settop(L, 1);
     return mb->data ? 1 : 0;
 }
 
+#ifdef SYSMEM_HAVE_MMAP
+static int mem_remap (lua_State *L, struct membuf *mb, size_t len);
+#endif
+
 /*
- * Arguments: membuf_udata, num_bytes (number)
+ * Arguments: membuf_udata, num_bytes (number), [fd_udata]
  * Returns: [membuf_udata]
  */
 static int
 mem_realloc (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int len = luaL_checkinteger(L, 2);
-    void *p = realloc(mb->data, len);
+    void *p;
+
+    if (mb->flags & SYSMEM_VIEW)
+	luaL_argerror(L, 1, "membuf is view");
+
+#ifdef SYSMEM_HAVE_MMAP
+    if (mb->flags & SYSMEM_MAP)
+	return mem_remap(L, mb, len);
+#endif
 
+    p = realloc(mb->data, len);
     if (!p) return 0;
+    memchanged(mb);
     mb->data = p;
     mb->len = len;
     lua_settop(L, 1);
@@ -318,20 +646,22 @@ mem_realloc (lua_State *L)
 
 /*
  * Arguments: membuf_udata, fd_udata, [protection (string: "rw"),
- *	offset (number), num_bytes (number), private/shared (boolean)]
+ *	offset (number), num_bytes (number), private/shared (boolean),
+ *	options (string: "populate,hugetlb,hugepage,lock,...")]
  * Returns: [membuf_udata]
  */
 static int
 mem_map (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const fd_t *fdp = checkudata(L, 2, FD_TYPENAME);
     fd_t fd = fdp ? (fd_t) *fdp : (fd_t) -1;  /* named or anonymous mapping */
     const char *protstr = lua_tostring(L, 3);
     const lua_Number offset = lua_tonumber(L, 4);
     const int64_t off = (int64_t) offset;  /* to avoid warning */
     size_t len = (size_t) lua_tointeger(L, 5);
-    const int is_private = lua_isboolean(L, -1) && lua_toboolean(L, -1);
+    const int is_private = lua_toboolean(L, 6);
+    const int opts = mem_checkopts(L, 7);
     int prot = 0, flags;
     void *ptr;
 
@@ -347,7 +677,11 @@ mem_map (lua_State *L)
 	if (fd == -1 || fstat(fd, &sb) == -1)
 	    goto err;
 	sb.st_size -= off;
-	len = (sb.st_size < (off_t) ~((size_t) 0))
+	if (sb.st_size <= 0) {
+	    errno = EINVAL;
+	    goto err;
+	}
+	len = ((uint64_t) sb.st_size < (uint64_t) ~((size_t) 0))
 	 ? (size_t) sb.st_size : ~((size_t) 0);
     }
     /* protection and flags */
@@ -359,6 +693,12 @@ mem_map (lua_State *L)
 	    prot |= PROT_WRITE;
     }
     flags = is_private ? MAP_PRIVATE : MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (opts & SYSMEM_OPT_POPULATE) flags |= MAP_POPULATE;
+#endif
+#ifdef MAP_HUGETLB
+    if (opts & SYSMEM_OPT_HUGETLB) flags |= MAP_HUGETLB;
+#endif
     /* anonymous shared memory? */
     if (fd == -1) {
 #ifdef MAP_ANON
@@ -375,6 +715,10 @@ mem_map (lua_State *L)
     if (is_anon) close(fd);
 #endif
     if (ptr == MAP_FAILED) goto err;
+    if (mem_applyopts(ptr, len, opts)) {
+	munmap(ptr, len);
+	goto err;
+    }
 
 #else
     sys_vm_leave();
@@ -413,13 +757,21 @@ mem_map (lua_State *L)
 	ptr = MapViewOfFile(hmap, flags, off_hi, off_lo, len);
 	CloseHandle(hmap);
 	if (!ptr) goto err;
+	if (mem_applyopts(ptr, len, opts)) {
+	    UnmapViewOfFile(ptr);
+	    goto err;
+	}
     }
 #endif /* !Win32 */
     sys_vm_enter();
 
+    memchanged(mb);
+    mb->flags &= ~(SYSMEM_VIEW | SYSMEM_MAP_SHARED);
     mb->flags |= SYSMEM_MAP;
+    if (!is_private) mb->flags |= SYSMEM_MAP_SHARED;
     mb->len = len;
     mb->data = ptr;
+    mb->map_off = (fd == (fd_t) -1) ? -1 : off;
     lua_settop(L, 1);
     return 1;
  err:
@@ -434,7 +786,7 @@ mem_map (lua_State *L)
 static int
 mem_sync (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     int res;
 
     sys_vm_leave();
@@ -448,6 +800,155 @@ mem_sync (lua_State *L)
     return !res ? 1 : 0;
 }
 
+/*
+ * Grow or shrink the mapping, extending the mapped file when fd_udata given.
+ * Without mremap() only private anonymous mappings can be resized.
+ * Arguments: membuf_udata, num_bytes (number), [fd_udata]
+ * Returns: [membuf_udata]
+ */
+static int
+mem_remap (lua_State *L, struct membuf *mb, size_t len)
+{
+    const fd_t *fdp = lua_isnoneornil(L, 3) ? NULL
+     : checkudata(L, 3, FD_TYPENAME);
+    void *ptr;
+
+#ifndef _WIN32
+    sys_vm_leave();
+    /* extend the file */
+    if (fdp) {
+	const off_t size = mb->map_off + len;
+	struct stat sb;
+
+	if (mb->map_off < 0) {
+	    errno = EINVAL;
+	    goto err;
+	}
+	if (fstat(*fdp, &sb) == -1
+	 || (sb.st_size < size && ftruncate(*fdp, size) == -1))
+	    goto err;
+    }
+#ifdef MREMAP_MAYMOVE
+    ptr = mremap(mb->data, mb->len, len, MREMAP_MAYMOVE);
+#else
+    /* only private anonymous memory can be moved by copying:
+     * a copy of shared memory would not be seen by other processes */
+    if (mb->map_off >= 0 || (mb->flags & SYSMEM_MAP_SHARED)) {
+	errno = ENOSYS;
+	goto err;
+    }
+    ptr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (ptr != MAP_FAILED) {
+	memcpy(ptr, mb->data, ((size_t) mb->len < len) ? (size_t) mb->len : len);
+	munmap(mb->data, mb->len);
+    }
+#endif
+    if (ptr == MAP_FAILED) goto err;
+    sys_vm_enter();
+
+    memchanged(mb);
+    mb->data = ptr;
+    mb->len = len;
+    if ((size_t) mb->offset > len)
+	mb->offset = len;
+    lua_settop(L, 1);
+    return 1;
+ err:
+    sys_vm_enter();
+#else
+    (void) mb;
+    (void) len;
+    (void) fdp;
+    (void) ptr;
+    SetLastError(ERROR_NOT_SUPPORTED);
+#endif
+    return sys_seterror(L, 0);
+}
+
+/*
+ * Arguments: membuf_udata, offset (number), num_bytes (number),
+ *	hint (string: "normal", "sequential", "random", "willneed",
+ *	"dontneed", "hugepage", "nohugepage", "lock", "unlock")
+ * Returns: [membuf_udata]
+ *
+ * Hints after "willneed" apply to memory mapped buffers only.
+ * "dontneed" drops the whole pages inside the range.
+ */
+static int
+mem_advise (lua_State *L)
+{
+    static const char *const hint_names[] = {
+	"normal", "sequential", "random", "willneed", "dontneed",
+	"hugepage", "nohugepage", "lock", "unlock", NULL
+    };
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    const size_t off = (size_t) luaL_checkinteger(L, 2);
+    size_t len = (size_t) luaL_checkinteger(L, 3);
+    const int hint = luaL_checkoption(L, 4, NULL, hint_names);
+    char *p = mb->data + off;
+    int res = 0;
+
+    if (!mb->data || (mb->len && (off > (size_t) mb->len
+     || len > (size_t) mb->len - off)))
+	luaL_argerror(L, 2, "out of bounds");
+
+    /* the pages of malloc'ed memory are shared with other data */
+    if (hint > 3 && !(mb->flags & SYSMEM_MAP))
+	return sys_seterror(L, EINVAL);
+
+#ifndef _WIN32
+    /* align to page boundary: the mapping starts on it */
+    {
+	const size_t mask = (size_t) sysconf(_SC_PAGESIZE) - 1;
+	const size_t skip = (size_t) p & mask;
+
+	if (hint == 4) {
+	    /* don't drop the data around the range */
+	    const size_t head = skip ? mask + 1 - skip : 0;
+
+	    if (len <= head) goto done;
+	    p += head;
+	    len = (len - head) & ~mask;
+	    if (!len) goto done;
+	}
+	else {
+	    p -= skip;
+	    len += skip;
+	}
+    }
+
+    sys_vm_leave();
+    switch (hint) {
+    case 0: res = madvise(p, len, MADV_NORMAL); break;
+    case 1: res = madvise(p, len, MADV_SEQUENTIAL); break;
+    case 2: res = madvise(p, len, MADV_RANDOM); break;
+    case 3: res = madvise(p, len, MADV_WILLNEED); break;
+    case 4: res = madvise(p, len, MADV_DONTNEED); break;
+#ifdef MADV_HUGEPAGE
+    case 5: res = madvise(p, len, MADV_HUGEPAGE); break;
+    case 6: res = madvise(p, len, MADV_NOHUGEPAGE); break;
+#else
+    case 5: case 6: res = -1; errno = ENOTSUP; break;
+#endif
+    case 7: res = mlock(p, len); break;
+    case 8: res = munlock(p, len); break;
+    }
+    sys_vm_enter();
+#else
+    switch (hint) {
+    case 5: case 6: res = -1; SetLastError(ERROR_NOT_SUPPORTED); break;
+    case 7: res = !VirtualLock(p, len); break;
+    case 8: res = !VirtualUnlock(p, len); break;
+    }
+#endif
+    if (res) return sys_seterror(L, 0);
+#ifndef _WIN32
+ done:
+#endif
+    lua_settop(L, 1);
+    return 1;
+}
+
 #endif /* SYSMEM_HAVE_MMAP */
 
 
@@ -458,7 +959,7 @@ mem_sync (lua_State *L)
 static int
 mem_free (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
 
     if (mb->data) {
 	const unsigned int mb_flags = mb->flags;
@@ -477,6 +978,7 @@ mem_free (lua_State *L)
 	    break;
 #endif /* SYSMEM_HAVE_MMAP */
 	}
+	memchanged(mb);
 	mb->data = NULL;
 	mb->flags &= SYSMEM_TYPE_MASK;
     }
@@ -490,8 +992,8 @@ mem_free (lua_State *L)
 static int
 mem_memcpy (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
-    struct membuf *src = checkudata(L, 2, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
+    struct membuf *src = mem_checkbuffer(L, 2);
     const int len = luaL_checkinteger(L, 3);
 
     lua_settop(L, 1);
@@ -505,7 +1007,7 @@ mem_memcpy (lua_State *L)
 static int
 mem_memset (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int ch = lua_tointeger(L, 2);
     const int len = luaL_checkinteger(L, 3);
 
@@ -520,7 +1022,7 @@ mem_memset (lua_State *L)
 static int
 mem_length (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
 
     if (lua_gettop(L) == 1)
 	lua_pushinteger(L, mb->len);
@@ -528,6 +1030,7 @@ mem_length (lua_State *L)
 	if (mb->flags & SYSMEM_MAP)
 	    luaL_argerror(L, 1, "membuf is mapped");
 
+	memchanged(mb);
 	mb->len = lua_tointeger(L, 2);
 	lua_settop(L, 1);
     }
@@ -541,7 +1044,7 @@ mem_length (lua_State *L)
 static int
 mem_getptr (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int off = lua_tointeger(L, 2);
     void *ptr = mb->data + memtypesize(mb) * off;
 
@@ -556,11 +1059,12 @@ mem_getptr (lua_State *L)
 static int
 mem_setptr (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     char *ptr = lua_touserdata(L, 2);
     const int off = lua_tointeger(L, 3);
 
     if (memisptr(mb)) {
+	memchanged(mb);
 	mb->data = ptr;
 	mb->offset = off;
 	lua_settop(L, 1);
@@ -576,17 +1080,18 @@ mem_setptr (lua_State *L)
 static int
 mem_call (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int off = lua_tointeger(L, 2);
     void *ptr = mb->data + memtypesize(mb) * off;
 
     if (lua_gettop(L) < 3)
 	lua_settop(L, 1);
     else {
-	mb = checkudata(L, 3, MEM_TYPENAME);
+	mb = mem_checkbuffer(L, 3);
 	lua_settop(L, 3);
     }
     if (memisptr(mb)) {
+	memchanged(mb);
 	mb->data = ptr;
 	return 1;
     }
@@ -601,7 +1106,7 @@ static int
 mem_index (lua_State *L)
 {
     if (lua_type(L, 2) == LUA_TNUMBER) {
-	struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+	struct membuf *mb = mem_checkbuffer(L, 1);
 	const int off = lua_tointeger(L, 2);
 	const int type = memtype(mb);
 	char *ptr = mb->data + memlen(type, off);
@@ -634,7 +1139,7 @@ mem_index (lua_State *L)
 static int
 mem_newindex (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
     const int off = lua_tointeger(L, 2);
     const int type = memtype(mb);
     char *ptr = mb->data + memlen(type, off);
@@ -691,7 +1196,7 @@ mem_newindex (lua_State *L)
 static int
 mem_tostring (lua_State *L)
 {
-    struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
+    struct membuf *mb = mem_checkbuffer(L, 1);
 
     if (mb->data)
 	lua_pushfstring(L, MEM_TYPENAME " (%p)", mb->data);
@@ -702,6 +1207,18 @@ mem_tostring (lua_State *L)
 
 
 #include "membuf.c"
+#include "mem_pack.c"
+#include "mem_view.c"
+#include "mem_atomic.c"
+#include "mem_ring.c"
+#include "mem_bits.c"
+#include "mem_hash.c"
+#include "mem_sketch.c"
+#include "mem_codec.c"
+#include "mem_csv.c"
+#include "mem_lines.c"
+#include "mem_format.c"
+#include "mem_search.c"
 
 
 static luaL_reg mem_meth[] = {
@@ -712,6 +1229,7 @@ static luaL_reg mem_meth[] = {
 #ifdef SYSMEM_HAVE_MMAP
     {"map",		mem_map},
     {"sync",		mem_sync},
+    {"advise",		mem_advise},
 #endif
     {"free",		mem_free},
     {"__gc",		mem_free},
@@ -735,12 +1253,63 @@ static luaL_reg mem_meth[] = {
     {"read",		membuf_read},
     {"flush",		membuf_flush},
     {"close",		membuf_close},
+    /* formatted output */
+    {"writef",		mem_writef},
+    {"append_int",	mem_append_int},
+    {"append_float",	mem_append_float},
+    {"append_escaped_json",	mem_append_escaped_json},
+    /* binary packing */
+    {"pack",		mem_pack},
+    {"unpack",		mem_unpack},
+    /* views */
+    {"view",		mem_view},
+    {"compare",		mem_compare},
+    {"find",		mem_find},
+    {"bsearch",		mem_bsearch},
+    /* bitsets */
+    {"band",		mem_bits_and},
+    {"bor",		mem_bits_or},
+    {"bxor",		mem_bits_xor},
+    {"bandnot",		mem_bits_andnot},
+    {"popcount",	mem_bits_popcount},
+    {"nextbit",		mem_bits_next},
+    {"bitindexes",	mem_bits_indexes},
+    /* delimited text */
+    {"tokenize",	mem_tokenize},
+    /* hashing */
+    {"crc32c",		mem_crc32c},
+    {"hash64",		mem_hash64},
+#ifdef SYSMEM_HAVE_ATOMIC
+    /* atomic operations */
+    {"add",		mem_atomic_add},
+    {"sub",		mem_atomic_sub},
+    {"cas",		mem_atomic_cas},
+    {"xchg",		mem_atomic_xchg},
+    {"load",		mem_atomic_load},
+    {"store",		mem_atomic_store},
+#endif
     {SYS_BUFIO_TAG,	NULL},  /* can operate with buffers */
     {NULL, NULL}
 };
 
 static luaL_reg mem_lib[] = {
     {"pointer",		mem_new},
+    {"crc32c",		mem_crc32c},
+    {"hash64",		mem_hash64},
+    {"hash_records",	mem_hash_records},
+    {"hasher",		mem_hasher},
+    {"encode",		mem_encode},
+    {"decode",		mem_decode},
+    {"encoder",		mem_encoder},
+    {"decoder",		mem_decoder},
+    {"lineindex",	mem_lineindex},
+    {"matcher",		mem_matcher},
+#ifdef SYSMEM_HAVE_ATOMIC
+    {"ring",		mem_ring},
+    {"bloom",		mem_bloom},
+    {"countmin",	mem_countmin},
+    {"hll",		mem_hll},
+#endif
     {NULL, NULL}
 };
 
@@ -752,5 +1321,52 @@ luaopen_sys_mem (lua_State *L)
     luaL_register(L, NULL, mem_meth);
     luaL_register(L, "sys.mem", mem_lib);
     lua_pop(L, 2);
+
+    luaL_newmetatable(L, HASHER_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, hasher_meth);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, CODEC_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, codec_meth);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LINES_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, lines_meth);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MATCHER_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, matcher_meth);
+    lua_pop(L, 1);
+
+#ifdef SYSMEM_HAVE_ATOMIC
+    luaL_newmetatable(L, RING_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, ring_meth);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, SKETCH_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, sketch_meth);
+    lua_pop(L, 1);
+#endif
+
+    /* create cache of compiled pack formats */
+    lua_pushlightuserdata(L, (void *) &pack_cache_key);
+    lua_newtable(L);
+    lua_newtable(L);  /* metatable */
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
 }
 
@@ -0,0 +1,431 @@
+/* Lua System: Networking: Relay through splice() */
+
+#if defined(__linux__) && defined(SPLICE_F_NONBLOCK)
+
+#define SOCK_HAVE_RELAY
+
+#define RELAY_TYPENAME	"sys.sock.relay"
+
+#define RELAY_CHUNK	(64 * 1024)  /* max. bytes per splice() */
+
+/* Relay environ. table indexes */
+enum {
+    RELAY_HANDLE = 1,  /* endpoint handles: 1, 2 */
+    RELAY_CALLBACK = 3,
+    RELAY_EVQ,
+    RELAY_EVENT  /* event ludata: 5, 6 */
+};
+
+/* Direction flags */
+#define RELAY_EOF	0x01  /* source reached EOF */
+#define RELAY_DONE	0x02  /* EOF delivered to destination */
+
+/* Endpoint flags */
+#define RELAY_FILE	0x01  /* regular file: not pollable */
+#define RELAY_WATCHED	0x02  /* added to event queue */
+
+/*
+ * Direction i relays from endpoint i to endpoint 1-i through pipe[i].
+ */
+struct sock_relay {
+    int fd[2];
+    int pipe[2][2];
+    unsigned int dir_flags[2];
+    unsigned int fd_flags[2];
+    int fd_events[2];  /* current event interest: "r", "w" bits */
+    size_t pending[2];  /* bytes in pipe */
+    uint64_t count[2];  /* bytes relayed */
+    uint64_t threshold, next_notify;
+    uint64_t idle_count[2];  /* total count at last endpoint activity */
+};
+
+
+/*
+ * Arguments: ..., sd_udata | fd_udata, ...
+ */
+static int
+relay_checkfd (lua_State *L, int idx, unsigned int *flagsp)
+{
+    struct stat st;
+    int fd;
+
+    if (!lua_isuserdata(L, idx) || !lua_getmetatable(L, idx))
+	luaL_typeerror(L, idx, SD_TYPENAME);
+    luaL_getmetatable(L, SD_TYPENAME);
+    luaL_getmetatable(L, FD_TYPENAME);
+    if (!lua_rawequal(L, -3, -2) && !lua_rawequal(L, -3, -1))
+	luaL_typeerror(L, idx, SD_TYPENAME);
+    lua_pop(L, 3);
+
+    fd = (int) *((lua_Integer *) lua_touserdata(L, idx));
+    if (fd == -1)
+	luaL_argerror(L, idx, "closed handle");
+
+    *flagsp = (!fstat(fd, &st) && S_ISREG(st.st_mode)) ? RELAY_FILE : 0;
+    return fd;
+}
+
+static void
+relay_closepipes (struct sock_relay *rp)
+{
+    int i, j;
+
+    for (i = 0; i < 2; ++i) {
+	for (j = 0; j < 2; ++j) {
+	    if (rp->pipe[i][j] != -1) {
+		close(rp->pipe[i][j]);
+		rp->pipe[i][j] = -1;
+	    }
+	}
+    }
+}
+
+/*
+ * Arguments: sd_udata | fd_udata, sd_udata | fd_udata,
+ *	[threshold (number)]
+ * Returns: [relay_udata]
+ */
+static int
+sock_relay (lua_State *L)
+{
+    struct sock_relay *rp;
+    unsigned int flags[2];
+    int fd[2], i;
+    lua_Number threshold;
+
+    fd[0] = relay_checkfd(L, 1, &flags[0]);
+    fd[1] = relay_checkfd(L, 2, &flags[1]);
+    if ((flags[0] & flags[1] & RELAY_FILE))
+	luaL_argerror(L, 2, "one endpoint must be pollable");
+    threshold = luaL_optnumber(L, 3, 0);
+    lua_settop(L, 2);
+
+    rp = lua_newuserdata(L, sizeof(struct sock_relay));
+    memset(rp, 0, sizeof(struct sock_relay));
+    rp->pipe[0][0] = rp->pipe[0][1] = rp->pipe[1][0] = rp->pipe[1][1] = -1;
+    luaL_getmetatable(L, RELAY_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    for (i = 0; i < 2; ++i) {
+	rp->fd[i] = fd[i];
+	rp->fd_flags[i] = flags[i];
+
+	/* regular file is either source or destination */
+	if (flags[i] & RELAY_FILE) {
+	    if ((fcntl(fd[i], F_GETFL) & O_ACCMODE) == O_WRONLY)
+		rp->dir_flags[i] = RELAY_EOF | RELAY_DONE;
+	    else
+		rp->dir_flags[1 - i] = RELAY_EOF | RELAY_DONE;
+	}
+
+	if (pipe(rp->pipe[i])
+	 || fcntl(rp->pipe[i][0], F_SETFL, O_NONBLOCK)
+	 || fcntl(rp->pipe[i][1], F_SETFL, O_NONBLOCK)) {
+	    relay_closepipes(rp);
+	    return sys_seterror(L, 0);
+	}
+    }
+    rp->threshold = rp->next_notify = (uint64_t) threshold;
+
+    lua_createtable(L, RELAY_EVENT + 1, 0);  /* environ. */
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, RELAY_HANDLE);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, RELAY_HANDLE + 1);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+/*
+ * Move the data of direction.
+ * Returns: 0 on success, -1 on error
+ */
+static int
+relay_pump (struct sock_relay *rp, int i)
+{
+    const int src = rp->fd[i], dst = rp->fd[1 - i];
+    unsigned int *dir_flags = &rp->dir_flags[i];
+
+    while (!(*dir_flags & RELAY_DONE)) {
+	ssize_t n;
+
+	if (!rp->pending[i] && !(*dir_flags & RELAY_EOF)) {
+	    do n = splice(src, NULL, rp->pipe[i][1], NULL, RELAY_CHUNK,
+	     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	    while (n == -1 && SYS_ERRNO == EINTR);
+
+	    if (n == -1) {
+		if (SYS_EAGAIN(SYS_ERRNO)) break;
+		return -1;
+	    }
+	    if (!n) *dir_flags |= RELAY_EOF;
+	    rp->pending[i] = n;
+	}
+
+	if (rp->pending[i]) {
+	    do n = splice(rp->pipe[i][0], NULL, dst, NULL, rp->pending[i],
+	     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	    while (n == -1 && SYS_ERRNO == EINTR);
+
+	    if (n == -1) {
+		if (SYS_EAGAIN(SYS_ERRNO)) break;
+		return -1;
+	    }
+	    rp->pending[i] -= n;
+	    rp->count[i] += n;
+	    if (rp->pending[i]) break;  /* destination is full */
+	}
+	else if (*dir_flags & RELAY_EOF) {
+	    /* propagate EOF */
+	    if (!(rp->fd_flags[1 - i] & RELAY_FILE))
+		shutdown(dst, SHUT_WR);
+	    *dir_flags |= RELAY_DONE;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Returns: event interest of endpoint
+ */
+static int
+relay_interest (struct sock_relay *rp, int k)
+{
+    const int j = 1 - k;  /* direction into the endpoint */
+    int events = 0;
+
+    if (!(rp->dir_flags[k] & RELAY_EOF) && !rp->pending[k])
+	events |= SYS_EVREAD;
+    if (rp->pending[j] || ((rp->fd_flags[j] & RELAY_FILE)
+     && !(rp->dir_flags[j] & RELAY_DONE)))
+	events |= SYS_EVWRITE;
+    return events;
+}
+
+/*
+ * Arguments: relay_udata, ...
+ * Returns: [relay_udata]
+ */
+static int
+relay_stop (lua_State *L)
+{
+    struct sock_relay *rp = checkudata(L, 1, RELAY_TYPENAME);
+    int k;
+
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, RELAY_EVQ);
+    for (k = 0; k < 2; ++k) {
+	if (!(rp->fd_flags[k] & RELAY_WATCHED))
+	    continue;
+	rp->fd_flags[k] &= ~RELAY_WATCHED;
+
+	lua_getfield(L, -1, "del");
+	lua_pushvalue(L, -2);  /* evq_udata */
+	lua_rawgeti(L, -4, RELAY_EVENT + k);
+	lua_pushboolean(L, 1);  /* reuse_fd: endpoints stay open */
+	lua_call(L, 3, 0);
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: ..., [message (string)]
+ */
+static void
+relay_notify (lua_State *L, const char *event, int stop, int has_msg)
+{
+    const int ridx = lua_upvalueindex(1);
+    const int top = lua_gettop(L);
+
+    if (stop) {
+	lua_pushcfunction(L, relay_stop);
+	lua_pushvalue(L, ridx);
+	lua_call(L, 1, 0);
+    }
+
+    lua_getfenv(L, ridx);
+    lua_rawgeti(L, -1, RELAY_CALLBACK);
+    lua_pushvalue(L, ridx);
+    lua_pushstring(L, event);
+    if (has_msg) lua_pushvalue(L, top);
+    lua_call(L, 2 + has_msg, 0);
+    lua_settop(L, top);
+}
+
+/*
+ * Arguments: evq_udata, ev_ludata, obj_udata, read (boolean),
+ *	write (boolean), timeout (number), eof (number)
+ */
+static int
+relay_handler (lua_State *L)
+{
+    struct sock_relay *rp = lua_touserdata(L, lua_upvalueindex(1));
+    const int ep = lua_tointeger(L, lua_upvalueindex(2));
+    int k;
+
+    lua_settop(L, 7);
+
+    if (!lua_isnil(L, 6)) {
+	/* timeout: no endpoint activity, is relay idle? */
+	if (rp->count[0] + rp->count[1] == rp->idle_count[ep]) {
+	    relay_notify(L, "timeout", 1, 0);
+	    return 0;
+	}
+	rp->idle_count[ep] = rp->count[0] + rp->count[1];
+	if (!lua_toboolean(L, 4) && !lua_toboolean(L, 5))
+	    return 0;
+    }
+
+    if (relay_pump(rp, 0) || relay_pump(rp, 1)) {
+	sys_seterror(L, 0);
+	relay_notify(L, "error", 1, 1);
+	return 0;
+    }
+    rp->idle_count[ep] = rp->count[0] + rp->count[1];
+
+    if (rp->threshold && rp->idle_count[ep] >= rp->next_notify) {
+	rp->next_notify = rp->idle_count[ep] + rp->threshold;
+	relay_notify(L, "threshold", 0, 0);
+    }
+
+    if ((rp->dir_flags[0] & rp->dir_flags[1] & RELAY_DONE)) {
+	relay_notify(L, "eof", 1, 0);
+	return 0;
+    }
+
+    /* update event interests */
+    for (k = 0; k < 2; ++k) {
+	const int events = relay_interest(rp, k);
+
+	if (!(rp->fd_flags[k] & RELAY_WATCHED) || events == rp->fd_events[k])
+	    continue;
+	rp->fd_events[k] = events;
+
+	lua_getfenv(L, lua_upvalueindex(1));
+	lua_rawgeti(L, -1, RELAY_EVQ);
+	lua_getfield(L, -1, "mod_socket");
+	lua_insert(L, -2);  /* evq_udata */
+	lua_rawgeti(L, -3, RELAY_EVENT + k);
+	lua_pushstring(L, (events == (SYS_EVREAD | SYS_EVWRITE)) ? "rw"
+	 : (events == SYS_EVREAD) ? "r" : (events == SYS_EVWRITE) ? "w" : "-rw");
+	lua_call(L, 3, 0);
+	lua_pop(L, 1);  /* environ. */
+    }
+    return 0;
+}
+
+/*
+ * Arguments: relay_udata, evq_udata, callback (function),
+ *	[timeout (milliseconds)]
+ * Returns: [relay_udata]
+ */
+static int
+relay_start (lua_State *L)
+{
+    struct sock_relay *rp = checkudata(L, 1, RELAY_TYPENAME);
+    int k;
+
+    luaL_checktype(L, 2, LUA_TUSERDATA);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_settop(L, 4);
+
+    if (rp->pipe[0][0] == -1)
+	luaL_argerror(L, 1, "relay is closed");
+    if ((rp->fd_flags[0] | rp->fd_flags[1]) & RELAY_WATCHED)
+	luaL_argerror(L, 1, "relay is started");
+
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, 5, RELAY_EVQ);
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, 5, RELAY_CALLBACK);
+
+    for (k = 0; k < 2; ++k) {
+	int events = relay_interest(rp, k);
+
+	if (rp->fd_flags[k] & RELAY_FILE)
+	    continue;
+	if (!events) events = SYS_EVREAD;
+
+	lua_getfield(L, 2, "add_socket");
+	lua_pushvalue(L, 2);  /* evq_udata */
+	lua_rawgeti(L, 5, RELAY_HANDLE + k);
+	lua_pushstring(L, (events == (SYS_EVREAD | SYS_EVWRITE)) ? "rw"
+	 : (events == SYS_EVREAD) ? "r" : "w");
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, k);
+	lua_pushcclosure(L, relay_handler, 2);
+	lua_pushvalue(L, 4);  /* timeout */
+	lua_call(L, 5, 1);
+	if (lua_isnil(L, -1)) {
+	    const int err = SYS_ERRNO;
+
+	    relay_stop(L);
+	    return sys_seterror(L, err);
+	}
+	lua_rawseti(L, 5, RELAY_EVENT + k);
+
+	rp->fd_events[k] = events;
+	rp->fd_flags[k] |= RELAY_WATCHED;
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: relay_udata
+ * Returns: count_a_to_b (number), count_b_to_a (number)
+ */
+static int
+relay_counters (lua_State *L)
+{
+    struct sock_relay *rp = checkudata(L, 1, RELAY_TYPENAME);
+
+    lua_pushnumber(L, (lua_Number) rp->count[0]);
+    lua_pushnumber(L, (lua_Number) rp->count[1]);
+    return 2;
+}
+
+/*
+ * Arguments: relay_udata
+ */
+static int
+relay_close (lua_State *L)
+{
+    struct sock_relay *rp = checkudata(L, 1, RELAY_TYPENAME);
+
+    if ((rp->fd_flags[0] | rp->fd_flags[1]) & RELAY_WATCHED)
+	relay_stop(L);
+    relay_closepipes(rp);
+    return 0;
+}
+
+/*
+ * Arguments: relay_udata
+ * Returns: string
+ */
+static int
+relay_tostring (lua_State *L)
+{
+    struct sock_relay *rp = checkudata(L, 1, RELAY_TYPENAME);
+
+    lua_pushfstring(L, RELAY_TYPENAME " (%d <-> %d)", rp->fd[0], rp->fd[1]);
+    return 1;
+}
+
+
+#define RELAY_METHODS \
+    {"relay",		sock_relay}
+
+static luaL_reg relay_meth[] = {
+    {"start",		relay_start},
+    {"stop",		relay_stop},
+    {"counters",	relay_counters},
+    {"close",		relay_close},
+    {"__gc",		relay_close},
+    {"__tostring",	relay_tostring},
+    {NULL, NULL}
+};
+
+#endif
@@ -0,0 +1,643 @@
+/* Lua System: Networking: Asynchronous resolver */
+
+#if !defined(_WIN32) && defined(USE_GAI)
+
+#define SOCK_HAVE_RESOLVER
+
+#include <pthread.h>
+
+#define RESOLVER_TYPENAME	"sys.sock.resolver"
+
+#define RES_THREADS		2  /* default number of lookup threads */
+#define RES_THREADS_MAX		16
+#define RES_CACHE_SIZE		256  /* default max. number of cached names */
+#define RES_TTL			60000  /* default TTL of answers (milliseconds) */
+#define RES_NEG_TTL		10000  /* default TTL of failures (milliseconds) */
+
+/* Resolver environ. table indexes */
+enum {
+    RES_EVQ = 1,
+    RES_EVENT,  /* event ludata of the pipe */
+    RES_HANDLE,  /* boxed read end of the pipe */
+    RES_CACHE,  /* host_name -> entry */
+    RES_PENDING  /* host_name -> callbacks */
+};
+
+/* Cache entry table indexes */
+enum {
+    RES_ENTRY_EXPIRES = 1,
+    RES_ENTRY_ADDRS,  /* binary_addresses (table) | false */
+    RES_ENTRY_NAME  /* canon_name | error message */
+};
+
+struct res_job {
+    struct res_job *next;
+    struct addrinfo *result;
+    int gai_errno;
+    char host[1];
+};
+
+/* Shared with the detached lookup threads */
+struct res_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct res_job *head, **tailp;  /* queue of lookups */
+    int stop;
+    int nref;  /* resolver and running threads */
+
+    int pipe[2];  /* completed lookups */
+};
+
+struct sock_resolver {
+    struct res_queue *q;  /* NULL when closed */
+
+    int cache_n, cache_max;
+    msec_t ttl, neg_ttl;
+};
+
+
+static void
+res_freejob (struct res_job *job)
+{
+    if (job->result)
+	freeaddrinfo(job->result);
+    free(job);
+}
+
+/*
+ * The last reference frees the queue, so a closed resolver
+ * does not wait for the threads stuck in getaddrinfo().
+ */
+static void
+res_release (struct res_queue *q)
+{
+    struct res_job *job;
+    int nref, res;
+
+    pthread_mutex_lock(&q->mutex);
+    nref = --q->nref;
+    pthread_mutex_unlock(&q->mutex);
+    if (nref) return;
+
+    /* not started and completed lookups */
+    while ((job = q->head)) {
+	q->head = job->next;
+	res_freejob(job);
+    }
+    do {
+	do res = read(q->pipe[0], &job, sizeof(struct res_job *));
+	while (res == -1 && SYS_ERRNO == EINTR);
+	if (res == sizeof(struct res_job *))
+	    res_freejob(job);
+    } while (res > 0);
+
+    close(q->pipe[0]);
+    close(q->pipe[1]);
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+    free(q);
+}
+
+static void *
+res_worker (void *arg)
+{
+    struct res_queue *q = arg;
+
+    for (; ; ) {
+	struct res_job *job;
+	struct addrinfo hints;
+	int stop, res;
+
+	pthread_mutex_lock(&q->mutex);
+	while (!q->head && !q->stop)
+	    pthread_cond_wait(&q->cond, &q->mutex);
+	job = q->stop ? NULL : q->head;
+	if (job) {
+	    q->head = job->next;
+	    if (!q->head) q->tailp = &q->head;
+	}
+	pthread_mutex_unlock(&q->mutex);
+
+	if (!job) break;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;  /* an entry per address */
+	hints.ai_flags = AI_ADDRCONFIG | AI_CANONNAME;
+
+	job->gai_errno = getaddrinfo(job->host, NULL, &hints, &job->result);
+	if (job->gai_errno) job->result = NULL;
+
+	pthread_mutex_lock(&q->mutex);
+	stop = q->stop;
+	pthread_mutex_unlock(&q->mutex);
+	if (stop) {
+	    res_freejob(job);
+	    break;
+	}
+
+	do res = write(q->pipe[1], &job, sizeof(struct res_job *));
+	while (res == -1 && SYS_ERRNO == EINTR);
+	if (res == -1) res_freejob(job);
+    }
+    res_release(q);
+    return NULL;
+}
+
+/*
+ * Arguments: ..., binary_addresses (table)
+ * Returns: ..., binary_addresses (table), copy (table)
+ */
+static void
+res_copyaddrs (lua_State *L)
+{
+    const int n = lua_objlen(L, -1);
+    int i;
+
+    lua_createtable(L, n, 0);
+    for (i = 1; i <= n; ++i) {
+	lua_rawgeti(L, -2, i);
+	lua_rawseti(L, -2, i);
+    }
+}
+
+/*
+ * Arguments: resolver_udata, ...
+ */
+static void
+res_evict (lua_State *L, struct sock_resolver *rp, int cache_idx)
+{
+    const msec_t now = get_milliseconds();
+
+    /* drop expired entries */
+    lua_pushnil(L);
+    while (lua_next(L, cache_idx)) {
+	msec_t expires;
+
+	lua_rawgeti(L, -1, RES_ENTRY_EXPIRES);
+	expires = (msec_t) lua_tointeger(L, -1);
+	lua_pop(L, 2);
+
+	if ((msec_t) (expires - now) <= 0) {
+	    lua_pushvalue(L, -1);
+	    lua_pushnil(L);
+	    lua_rawset(L, cache_idx);
+	    --rp->cache_n;
+	}
+    }
+
+    /* drop any entry */
+    if (rp->cache_n >= rp->cache_max) {
+	lua_pushnil(L);
+	if (lua_next(L, cache_idx)) {
+	    lua_pop(L, 1);
+	    lua_pushnil(L);
+	    lua_rawset(L, cache_idx);
+	    --rp->cache_n;
+	}
+    }
+}
+
+/*
+ * Arguments: resolver_udata, ...
+ * Returns: ..., value_1, value_2 (results of lookup)
+ */
+static void
+res_complete (lua_State *L, struct sock_resolver *rp, struct res_job *job,
+              int cache_idx)
+{
+    const int top = lua_gettop(L);
+    msec_t ttl;
+
+    if (job->gai_errno) {
+	lua_pushboolean(L, 0);
+	lua_pushstring(L, gai_strerror(job->gai_errno));
+	ttl = rp->neg_ttl;
+    }
+    else {
+	struct addrinfo *ai;
+	int i;
+
+	lua_newtable(L);
+	for (i = 1, ai = job->result; ai; ai = ai->ai_next) {
+	    if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+		continue;
+	    sock_pushaddr(L, (struct sock_addr *) ai->ai_addr);
+	    lua_rawseti(L, -2, i++);
+	}
+	lua_pushstring(L, (job->result && job->result->ai_canonname)
+	 ? job->result->ai_canonname : job->host);
+	ttl = rp->ttl;
+    }
+
+    if (ttl > 0 && rp->cache_max > 0) {
+	lua_pushstring(L, job->host);
+	lua_rawget(L, cache_idx);
+	if (lua_isnil(L, -1)) {
+	    if (rp->cache_n >= rp->cache_max)
+		res_evict(L, rp, cache_idx);
+	    ++rp->cache_n;
+	}
+	lua_pop(L, 1);
+
+	lua_pushstring(L, job->host);
+	lua_createtable(L, 3, 0);
+	lua_pushinteger(L, get_milliseconds() + ttl);
+	lua_rawseti(L, -2, RES_ENTRY_EXPIRES);
+	lua_pushvalue(L, top + 1);
+	lua_rawseti(L, -2, RES_ENTRY_ADDRS);
+	lua_pushvalue(L, top + 2);
+	lua_rawseti(L, -2, RES_ENTRY_NAME);
+	lua_rawset(L, cache_idx);
+    }
+}
+
+/*
+ * Arguments: evq_udata, ev_ludata, obj_udata, read (boolean), ...
+ */
+static int
+res_handler (lua_State *L)
+{
+    struct sock_resolver *rp = lua_touserdata(L, lua_upvalueindex(1));
+    struct res_job *job;
+    int i, n, res, err_idx = 0;
+
+    lua_settop(L, 0);
+    if (!rp->q)
+	return 0;
+
+    do res = read(rp->q->pipe[0], &job, sizeof(struct res_job *));
+    while (res == -1 && SYS_ERRNO == EINTR);
+    if (res != sizeof(struct res_job *))
+	return 0;
+
+    lua_getfenv(L, lua_upvalueindex(1));  /* 1: environ. */
+    lua_rawgeti(L, 1, RES_CACHE);  /* 2 */
+    lua_rawgeti(L, 1, RES_PENDING);  /* 3 */
+
+    res_complete(L, rp, job, 2);  /* 4, 5 */
+
+    /* waiting callbacks */
+    lua_pushstring(L, job->host);  /* 6 */
+    lua_pushvalue(L, 6);
+    lua_rawget(L, 3);  /* 7 */
+    lua_pushvalue(L, 6);
+    lua_pushnil(L);
+    lua_rawset(L, 3);
+    res_freejob(job);
+
+    n = lua_istable(L, 7) ? lua_objlen(L, 7) : 0;
+    for (i = 1; i <= n; ++i) {
+	lua_rawgeti(L, 7, i);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, 6);
+	if (lua_toboolean(L, 4)) {
+	    lua_pushvalue(L, 4);
+	    res_copyaddrs(L);
+	    lua_remove(L, -2);
+	}
+	else
+	    lua_pushnil(L);
+	lua_pushvalue(L, 5);
+	/* an error must not drop the other waiters */
+	if (lua_pcall(L, 4, 0, 0)) {
+	    if (!err_idx)
+		err_idx = lua_gettop(L);
+	    else
+		lua_pop(L, 1);
+	}
+    }
+    if (err_idx)
+	return lua_error(L);  /* the first error */
+    return 0;
+}
+
+static int
+res_optfield (lua_State *L, int idx, const char *name, int def)
+{
+    int v = def;
+
+    if (lua_istable(L, idx)) {
+	lua_getfield(L, idx, name);
+	if (lua_isnumber(L, -1))
+	    v = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+    }
+    return v;
+}
+
+/*
+ * Arguments: resolver_udata
+ *
+ * Callbacks of lookups in progress are called with the error.
+ */
+static int
+resolver_close (lua_State *L)
+{
+    struct sock_resolver *rp = checkudata(L, 1, RESOLVER_TYPENAME);
+    struct res_queue *q = rp->q;
+    int i, n, err_idx, pending_idx;
+
+    if (!q) return 0;
+    rp->q = NULL;
+
+    /* the threads are detached: don't wait for them */
+    pthread_mutex_lock(&q->mutex);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, RES_EVQ);
+    if (!lua_isnil(L, -1)) {
+	lua_getfield(L, -1, "del");
+	lua_insert(L, -2);  /* evq_udata */
+	lua_rawgeti(L, -3, RES_EVENT);
+	lua_call(L, 2, 0);
+    }
+    else
+	lua_pop(L, 1);
+
+    res_release(q);
+
+    /* waiting callbacks */
+    lua_pushnil(L);  /* the first error */
+    err_idx = lua_gettop(L);
+    lua_rawgeti(L, -2, RES_PENDING);
+    pending_idx = lua_gettop(L);
+    lua_newtable(L);
+    lua_rawseti(L, -4, RES_PENDING);
+
+    lua_pushnil(L);
+    while (lua_next(L, pending_idx)) {
+	n = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+	for (i = 1; i <= n; ++i) {
+	    lua_rawgeti(L, -1, i);
+	    lua_pushvalue(L, 1);
+	    lua_pushvalue(L, -4);  /* host_name */
+	    lua_pushnil(L);
+	    lua_pushliteral(L, "resolver closed");
+	    if (lua_pcall(L, 4, 0, 0)) {
+		if (lua_isnil(L, err_idx))
+		    lua_replace(L, err_idx);
+		else
+		    lua_pop(L, 1);
+	    }
+	}
+	lua_pop(L, 1);
+    }
+    if (!lua_isnil(L, err_idx)) {
+	lua_pushvalue(L, err_idx);
+	return lua_error(L);
+    }
+    return 0;
+}
+
+/*
+ * Arguments: evq_udata, [options (table: {threads = number,
+ *	cache_size = number, ttl = milliseconds, negative_ttl = milliseconds})]
+ * Returns: [resolver_udata]
+ */
+static int
+sock_resolver (lua_State *L)
+{
+    struct sock_resolver *rp;
+    struct res_queue *q;
+    pthread_attr_t attr;
+    int nthreads, i;
+
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    lua_settop(L, 2);
+
+    nthreads = res_optfield(L, 2, "threads", RES_THREADS);
+    if (nthreads < 1 || nthreads > RES_THREADS_MAX)
+	luaL_argerror(L, 2, "invalid number of threads");
+
+    rp = lua_newuserdata(L, sizeof(struct sock_resolver));  /* 3 */
+    memset(rp, 0, sizeof(struct sock_resolver));
+    rp->cache_max = res_optfield(L, 2, "cache_size", RES_CACHE_SIZE);
+    rp->ttl = res_optfield(L, 2, "ttl", RES_TTL);
+    rp->neg_ttl = res_optfield(L, 2, "negative_ttl", RES_NEG_TTL);
+
+    q = calloc(1, sizeof(struct res_queue));
+    if (!q)
+	return sys_seterror(L, ENOMEM);
+    q->tailp = &q->head;
+    q->nref = 1;
+
+    if (pipe(q->pipe)) {
+	free(q);
+	return sys_seterror(L, 0);
+    }
+    if (fcntl(q->pipe[0], F_SETFL, O_NONBLOCK)
+     || pthread_mutex_init(&q->mutex, NULL)) {
+	const int err = SYS_ERRNO;
+
+	close(q->pipe[0]);
+	close(q->pipe[1]);
+	free(q);
+	return sys_seterror(L, err);
+    }
+    pthread_cond_init(&q->cond, NULL);
+    rp->q = q;
+
+    luaL_getmetatable(L, RESOLVER_TYPENAME);
+    lua_setmetatable(L, 3);
+
+    lua_createtable(L, RES_PENDING, 0);  /* environ. */
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, RES_EVQ);
+    lua_boxinteger(L, q->pipe[0]);  /* closed by resolver */
+    lua_rawseti(L, -2, RES_HANDLE);
+    lua_newtable(L);
+    lua_rawseti(L, -2, RES_CACHE);
+    lua_newtable(L);
+    lua_rawseti(L, -2, RES_PENDING);
+    lua_setfenv(L, 3);
+
+    /* watch the completions */
+    lua_getfield(L, 1, "add_socket");
+    lua_pushvalue(L, 1);
+    lua_getfenv(L, 3);
+    lua_rawgeti(L, -1, RES_HANDLE);
+    lua_remove(L, -2);
+    lua_pushliteral(L, "r");
+    lua_pushvalue(L, 3);
+    lua_pushcclosure(L, res_handler, 1);
+    lua_call(L, 4, 1);
+    if (lua_isnil(L, -1)) {
+	const int err = SYS_ERRNO;
+
+	lua_pop(L, 1);
+	lua_getfenv(L, 3);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, RES_EVQ);
+	lua_settop(L, 3);
+	lua_insert(L, 1);
+	resolver_close(L);
+	return sys_seterror(L, err);
+    }
+    lua_getfenv(L, 3);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, RES_EVENT);
+    lua_pop(L, 1);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < nthreads; ++i) {
+	pthread_t tid;
+
+	pthread_mutex_lock(&q->mutex);
+	++q->nref;
+	pthread_mutex_unlock(&q->mutex);
+	if (pthread_create(&tid, &attr, res_worker, q)) {
+	    pthread_mutex_lock(&q->mutex);
+	    --q->nref;
+	    pthread_mutex_unlock(&q->mutex);
+	    break;
+	}
+    }
+    pthread_attr_destroy(&attr);
+    if (!i) {
+	lua_settop(L, 3);
+	lua_insert(L, 1);
+	resolver_close(L);
+	return sys_seterror(L, 0);
+    }
+    lua_settop(L, 3);
+    return 1;
+}
+
+/*
+ * Arguments: resolver_udata, host_name (string), callback (function)
+ * Returns: [binary_addresses (table), canon_name (string)
+ *	| false (queued)]
+ */
+static int
+resolver_getaddrinfo (lua_State *L)
+{
+    struct sock_resolver *rp = checkudata(L, 1, RESOLVER_TYPENAME);
+    size_t len;
+    const char *host = luaL_checklstring(L, 2, &len);
+    struct res_job *job;
+
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_settop(L, 3);
+
+    if (!rp->q)
+	luaL_argerror(L, 1, "closed resolver");
+
+    lua_getfenv(L, 1);  /* 4 */
+    lua_rawgeti(L, 4, RES_CACHE);  /* 5 */
+    lua_rawgeti(L, 4, RES_PENDING);  /* 6 */
+
+    /* cached? */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, 5);
+    if (!lua_isnil(L, -1)) {
+	msec_t expires;
+
+	lua_rawgeti(L, -1, RES_ENTRY_EXPIRES);
+	expires = (msec_t) lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	if ((msec_t) (expires - get_milliseconds()) > 0) {
+	    lua_rawgeti(L, 7, RES_ENTRY_ADDRS);
+	    lua_rawgeti(L, 7, RES_ENTRY_NAME);
+	    if (!lua_toboolean(L, -2)) {
+		lua_pushnil(L);
+		lua_replace(L, -3);
+		lua_pushvalue(L, -1);
+		lua_setglobal(L, SYS_ERROR_MESSAGE);
+		return 2;
+	    }
+	    lua_insert(L, -2);
+	    res_copyaddrs(L);
+	    lua_remove(L, -2);
+	    lua_insert(L, -2);
+	    return 2;
+	}
+	lua_pushvalue(L, 2);
+	lua_pushnil(L);
+	lua_rawset(L, 5);
+	--rp->cache_n;
+    }
+    lua_pop(L, 1);
+
+    /* coalesce with lookup in progress */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, 6);
+    if (!lua_isnil(L, -1)) {
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+	lua_pushboolean(L, 0);
+	return 1;
+    }
+
+    job = malloc(sizeof(struct res_job) + len);
+    if (!job)
+	return sys_seterror(L, 0);
+    memset(job, 0, sizeof(struct res_job));
+    memcpy(job->host, host, len + 1);
+
+    lua_pushvalue(L, 2);
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, 1);
+    lua_rawset(L, 6);
+
+    pthread_mutex_lock(&rp->q->mutex);
+    *rp->q->tailp = job;
+    rp->q->tailp = &job->next;
+    pthread_cond_signal(&rp->q->cond);
+    pthread_mutex_unlock(&rp->q->mutex);
+
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+/*
+ * Arguments: resolver_udata
+ * Returns: resolver_udata
+ */
+static int
+resolver_flush (lua_State *L)
+{
+    struct sock_resolver *rp = checkudata(L, 1, RESOLVER_TYPENAME);
+
+    lua_settop(L, 1);
+    lua_getfenv(L, 1);
+    lua_newtable(L);
+    lua_rawseti(L, -2, RES_CACHE);
+    rp->cache_n = 0;
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: resolver_udata
+ * Returns: string
+ */
+static int
+resolver_tostring (lua_State *L)
+{
+    struct sock_resolver *rp = checkudata(L, 1, RESOLVER_TYPENAME);
+
+    lua_pushfstring(L, RESOLVER_TYPENAME " (%p)", rp);
+    return 1;
+}
+
+
+#define RESOLVER_METHODS \
+    {"resolver",	sock_resolver}
+
+static luaL_reg resolver_meth[] = {
+    {"getaddrinfo",	resolver_getaddrinfo},
+    {"flush",		resolver_flush},
+    {"close",		resolver_close},
+    {"__gc",		resolver_close},
+    {"__tostring",	resolver_tostring},
+    {NULL, NULL}
+};
+
+#endif
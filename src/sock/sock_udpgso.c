@@ -0,0 +1,181 @@
+/* Lua System: Networking: UDP segmentation offload */
+
+#if defined(__linux__) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+
+#define SOCK_HAVE_UDP_GSO
+
+#ifndef SOL_UDP
+#define SOL_UDP		IPPROTO_UDP
+#endif
+
+#define GSO_MAX_SEGMENTS	64  /* kernel limit per send */
+#define GSO_MAX_PAYLOAD		65507  /* max. UDP payload over IPv4 */
+
+
+/*
+ * Send one buffer as many equal-size datagrams.
+ * Arguments: sd_udata, {string | membuf_udata},
+ *	[to (sock_addr_udata), segment_size (number)]
+ * Returns: [success/partial (boolean), count (number)]
+ *
+ * Without segment_size the socket's "udp_segment" option applies.
+ * Only whole segments are sent while the buffer exceeds one send's limits.
+ */
+static int
+sock_sendmsg (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    const struct sock_addr *to = !lua_isuserdata(L, 3) ? NULL
+     : checkudata(L, 3, SA_TYPENAME);
+    const int segsize = (int) luaL_optinteger(L, 4, 0);
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(unsigned short))];
+    } ctl;
+    struct msghdr msg;
+    struct iovec iov;
+    struct sys_buffer sb;
+    size_t len;
+    int nw;
+
+    if (!sys_buffer_read_init(L, 2, &sb))
+	luaL_argerror(L, 2, "buffer expected");
+    if (segsize < 0 || segsize > GSO_MAX_PAYLOAD)
+	luaL_argerror(L, 4, "invalid segment size");
+
+    len = sb.size;
+    memset(&msg, 0, sizeof(struct msghdr));
+    if (segsize) {
+	size_t max = (size_t) segsize * GSO_MAX_SEGMENTS;
+	struct cmsghdr *cm;
+
+	if (max > GSO_MAX_PAYLOAD)
+	    max = GSO_MAX_PAYLOAD - GSO_MAX_PAYLOAD % segsize;
+	if (len > max) len = max;
+
+	memset(&ctl, 0, sizeof(ctl));
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+	*((unsigned short *) CMSG_DATA(cm)) = (unsigned short) segsize;
+    }
+    iov.iov_base = (char *) sb.ptr.r;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (to) {
+	msg.msg_name = (void *) &to->u.addr;
+	msg.msg_namelen = to->addrlen;
+    }
+
+    sys_vm_leave();
+    do nw = sendmsg(sd, &msg, 0);
+    while (nw == -1 && SYS_ERRNO == EINTR);
+    sys_vm_enter();
+
+    if (nw == -1) {
+	if (!SYS_EAGAIN(SYS_ERRNO))
+	    return sys_seterror(L, 0);
+	nw = 0;
+    }
+    else {
+	sys_buffer_read_next(&sb, nw);
+    }
+    lua_pushboolean(L, ((size_t) nw == sb.size));
+    lua_pushinteger(L, nw);
+    return 2;
+}
+
+/*
+ * Receive datagrams coalesced by the "udp_gro" option.
+ * Arguments: sd_udata, membuf_udata,
+ *	[offsets (table), lengths (table), from (sock_addr_udata)]
+ * Returns: [count (number) | false (EAGAIN)]
+ */
+static int
+sock_recvmsg (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    struct sock_addr *from = !lua_isuserdata(L, 5) ? NULL
+     : checkudata(L, 5, SA_TYPENAME);
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct iovec iov;
+    struct sys_buffer sb, rsb;
+    size_t off, pos, segsize;
+    int nr, i;
+
+    sys_buffer_write_init(L, 2, &sb, NULL, 0);
+    if (sb.size <= 65535
+     && !sys_buffer_write_next(L, &sb, NULL, 65535))
+	return sys_seterror(L, ENOMEM);
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    iov.iov_base = sb.ptr.w;
+    iov.iov_len = 65535;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    if (from) {
+	msg.msg_name = &from->u.addr;
+	msg.msg_namelen = sizeof(from->u);
+    }
+
+    sys_vm_leave();
+    do nr = recvmsg(sd, &msg, 0);
+    while (nr == -1 && SYS_ERRNO == EINTR);
+    sys_vm_enter();
+
+    if (nr == -1) {
+	if (!SYS_EAGAIN(SYS_ERRNO))
+	    return sys_seterror(L, 0);
+	lua_pushboolean(L, 0);
+	return 1;
+    }
+    if (from) from->addrlen = msg.msg_namelen;
+
+    segsize = nr;
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+	if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+	    const int gso_size = *((int *) CMSG_DATA(cm));
+
+	    if (gso_size > 0) segsize = gso_size;
+	    break;
+	}
+    }
+
+    /* split the payload by segment size */
+    sys_buffer_read_init(L, 2, &rsb);
+    off = rsb.size;
+    pos = 0;
+    i = 0;
+    do {
+	const size_t n = ((size_t) nr - pos < segsize)
+	 ? (size_t) nr - pos : segsize;
+
+	++i;
+	if (lua_istable(L, 3)) {
+	    lua_pushnumber(L, (lua_Number) (off + pos));
+	    lua_rawseti(L, 3, i);
+	}
+	if (lua_istable(L, 4)) {
+	    lua_pushnumber(L, (lua_Number) n);
+	    lua_rawseti(L, 4, i);
+	}
+	pos += n;
+    } while (pos < (size_t) nr);
+    sys_buffer_write_done(L, &sb, NULL, nr);
+
+    lua_pushinteger(L, i);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,254 @@
+/* Lua System: Networking: Zero-copy sends */
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+
+#define SOCK_HAVE_ZEROCOPY
+
+#include <linux/errqueue.h>
+
+#define ZC_PINS_KEY	"sys.sock.zerocopy"  /* registry: sd_udata -> pins */
+#define ZC_LINGER_KEY	"sys.sock.zerocopy.closed"  /* registry: sd_udata -> pins */
+
+/* Pins table fields */
+#define ZC_SEQ		"seq"  /* next notification id */
+#define ZC_PENDING	"n"  /* number of pinned buffers */
+#define ZC_PREV		"prev"  /* older pins of the same sd_udata */
+
+#define ZC_CMSG_SIZE	256
+
+#define zc_seqnext(seq)	((seq) == 0xFFFFFFFFU ? 0 : (seq) + 1)
+
+
+/*
+ * Arguments: sd_udata, ...
+ * Returns: pins table or nil on top of stack
+ */
+static void
+zc_getpins (lua_State *L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, ZC_PINS_KEY);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+}
+
+static lua_Number
+zc_getfield (lua_State *L, int idx, const char *field)
+{
+    lua_Number num;
+
+    lua_getfield(L, idx, field);
+    num = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return num;
+}
+
+static void
+zc_setfield (lua_State *L, int idx, const char *field, lua_Number num)
+{
+    lua_pushnumber(L, num);
+    lua_setfield(L, (idx < 0) ? idx - 1 : idx, field);
+}
+
+/*
+ * Enable SO_ZEROCOPY on first use.
+ * Arguments: sd_udata, ...
+ * Returns: 0 on success, -1 on error
+ */
+static int
+zc_prepare (lua_State *L, sd_t sd)
+{
+    int res = 0;
+
+    zc_getpins(L);
+    if (lua_isnil(L, -1)) {
+	const int on = 1;
+
+	res = setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(int));
+	if (!res) {
+	    lua_getfield(L, LUA_REGISTRYINDEX, ZC_PINS_KEY);
+	    lua_pushvalue(L, 1);
+	    lua_createtable(L, 0, 2);
+	    zc_setfield(L, -1, ZC_SEQ, 0);
+	    zc_setfield(L, -1, ZC_PENDING, 0);
+	    lua_rawset(L, -3);
+	    lua_pop(L, 1);
+	}
+    }
+    lua_pop(L, 1);
+    return res;
+}
+
+/*
+ * Keep the buffer referenced until the kernel notifies the send.
+ * Arguments: sd_udata, {string | membuf_udata}, ...
+ */
+static void
+zc_pin (lua_State *L)
+{
+    lua_Number num;
+    unsigned int seq;
+    int idx;
+
+    zc_getpins(L);
+    idx = lua_gettop(L);
+    num = zc_getfield(L, idx, ZC_SEQ);
+    seq = (unsigned int) num;
+
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, idx, (int) seq);
+    zc_setfield(L, idx, ZC_SEQ, zc_seqnext(seq));
+    zc_setfield(L, idx, ZC_PENDING, zc_getfield(L, idx, ZC_PENDING) + 1);
+    lua_pop(L, 1);
+}
+
+/*
+ * Release the buffers of completed sends.
+ * Arguments: sd_udata, ..., pins (table), ...
+ * Returns: 0 | -1 (error)
+ */
+static int
+zc_drain (lua_State *L, sd_t sd, int idx, lua_Number *completedp,
+          int *copiedp)
+{
+    lua_Number completed = 0;
+    lua_Number pending = zc_getfield(L, idx, ZC_PENDING);
+    int res;
+
+    while (pending > 0) {
+	char cbuf[ZC_CMSG_SIZE];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do res = recvmsg(sd, &msg, MSG_ERRQUEUE);
+	while (res == -1 && SYS_ERRNO == EINTR);
+
+	if (res == -1) {
+	    if (SYS_EAGAIN(SYS_ERRNO)) break;
+	    zc_setfield(L, idx, ZC_PENDING, pending);
+	    return -1;
+	}
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+	    struct sock_extended_err *serr;
+	    unsigned int seq, hi;
+
+	    if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+	     || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+		continue;
+
+	    serr = (struct sock_extended_err *) CMSG_DATA(cm);
+	    if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+		continue;
+
+	    if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+		*copiedp = 1;
+
+	    /* range of notification ids: [ee_info .. ee_data] */
+	    hi = serr->ee_data;
+	    for (seq = serr->ee_info; ; seq = zc_seqnext(seq)) {
+		lua_rawgeti(L, idx, (int) seq);
+		if (!lua_isnil(L, -1)) {
+		    lua_pushnil(L);
+		    lua_rawseti(L, idx, (int) seq);
+		    ++completed;
+		    --pending;
+		}
+		lua_pop(L, 1);
+		if (seq == hi) break;
+	    }
+	}
+    }
+    zc_setfield(L, idx, ZC_PENDING, pending);
+    *completedp = completed;
+    return 0;
+}
+
+/*
+ * Called before the socket is closed. The kernel may still send from
+ * the pending buffers, so they stay referenced while sd_udata lives.
+ * Arguments: sd_udata, ...
+ */
+static void
+zc_close (lua_State *L, sd_t sd)
+{
+    lua_Number completed;
+    int copied, idx;
+
+    zc_getpins(L);
+    idx = lua_gettop(L);
+    if (!lua_isnil(L, idx)
+     && (zc_drain(L, sd, idx, &completed, &copied)
+     || zc_getfield(L, idx, ZC_PENDING) > 0)) {
+	lua_getfield(L, LUA_REGISTRYINDEX, ZC_LINGER_KEY);
+	lua_pushvalue(L, 1);
+	lua_rawget(L, -2);
+	lua_setfield(L, idx, ZC_PREV);  /* chain of closed sockets */
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, idx);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    /* the next socket of sd_udata starts a new sequence */
+    lua_getfield(L, LUA_REGISTRYINDEX, ZC_PINS_KEY);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+/*
+ * Release the buffers of completed sends.
+ * Arguments: sd_udata
+ * Returns: [completed (number), pending (number), copied (boolean)]
+ */
+static int
+sock_zerocopy_done (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    lua_Number completed = 0;
+    int copied = 0, idx;
+
+    lua_settop(L, 1);
+    zc_getpins(L);
+    if (lua_isnil(L, -1)) {
+	lua_pushinteger(L, 0);
+	lua_pushinteger(L, 0);
+	lua_pushboolean(L, 0);
+	return 3;
+    }
+    idx = lua_gettop(L);
+    if (zc_drain(L, sd, idx, &completed, &copied))
+	return sys_seterror(L, 0);
+
+    lua_pushnumber(L, completed);
+    lua_pushnumber(L, zc_getfield(L, idx, ZC_PENDING));
+    lua_pushboolean(L, copied);
+    return 3;
+}
+
+static void
+zc_init (lua_State *L)
+{
+    lua_createtable(L, 0, 1);  /* metatable */
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+
+    lua_newtable(L);  /* pins of sockets */
+    lua_pushvalue(L, -2);
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, ZC_PINS_KEY);
+
+    lua_newtable(L);  /* pins of closed sockets */
+    lua_insert(L, -2);
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, ZC_LINGER_KEY);
+}
+
+#endif
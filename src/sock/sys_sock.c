@@ -26,9 +26,11 @@ typedef int		socklen_t;
 #include <arpa/inet.h>
 #include <netinet/tcp.h>	/* TCP_NODELAY */
 #include <netdb.h>
+#include <sys/stat.h>
 
 #if defined(__linux__)
 #include <sys/sendfile.h>
+#include <netinet/udp.h>	/* UDP_SEGMENT */
 #else
 #include <sys/uio.h>		/* sendfile */
 #endif
@@ -43,10 +45,22 @@ typedef int		socklen_t;
 
 #endif /* !WIN32 */
 
+#define SOCK_MMSG_MAX		256  /* max. number of datagrams per batch */
+#define SOCK_PACKET_SIZE	2048  /* default datagram slot size */
+#define SOCK_ACCEPT_MAX		128  /* max. number of connections per batch */
+#define SOCK_RSIZE_MAX		(1024 * 1024)  /* max. predicted read size */
+
+struct sock_handle {
+    lua_Integer sd;  /* boxed socket: lua_unboxinteger() */
+    size_t rsize;  /* history of read sizes */
+};
 
-#define SD_TYPENAME	"sys.sock.handle"
 
 #include "sock_addr.c"
+#include "sock_relay.c"
+#include "sock_resolv.c"
+#include "sock_zcopy.c"
+#include "sock_udpgso.c"
 
 
 /*
@@ -55,7 +69,10 @@ typedef int		socklen_t;
 static int
 sock_new (lua_State *L)
 {
-    lua_boxinteger(L, -1);
+    struct sock_handle *sh = lua_newuserdata(L, sizeof(struct sock_handle));
+
+    sh->sd = -1;
+    sh->rsize = 0;
     luaL_getmetatable(L, SD_TYPENAME);
     lua_setmetatable(L, -2);
     return 1;
@@ -158,19 +175,24 @@ sock_socket (lua_State *L)
 static int
 sock_close (lua_State *L)
 {
-    sd_t *sdp = checkudata(L, 1, SD_TYPENAME);
+    struct sock_handle *sh = checkudata(L, 1, SD_TYPENAME);
+    const sd_t sd = (sd_t) sh->sd;
 
-    if (*sdp != (sd_t) -1) {
+    if (sd != (sd_t) -1) {
 #ifndef _WIN32
 	int res;
 
-	do res = close(*sdp);
+#ifdef SOCK_HAVE_ZEROCOPY
+	zc_close(L, sd);
+#endif
+	do res = close(sd);
 	while (res == -1 && SYS_ERRNO == EINTR);
 	lua_pushboolean(L, !res);
 #else
-	lua_pushboolean(L, !closesocket(*sdp));
+	lua_pushboolean(L, !closesocket(sd));
 #endif
-	*sdp = (sd_t) -1;
+	sh->sd = -1;
+	sh->rsize = 0;
 	return 1;
     }
     return 0;
@@ -223,21 +245,30 @@ sock_sockopt (lua_State *L)
 #define OPTNAMES_TCP	12
 	TCP_NODELAY,
 #define OPTNAMES_IP	13
-	IP_MULTICAST_TTL, IP_MULTICAST_IF, IP_MULTICAST_LOOP
+	IP_MULTICAST_TTL, IP_MULTICAST_IF, IP_MULTICAST_LOOP,
+#define OPTNAMES_UDP	16
+#ifdef SOCK_HAVE_UDP_GSO
+	UDP_SEGMENT, UDP_GRO
+#endif
     };
     static const char *const opt_names[] = {
 	"reuseaddr", "type", "error", "dontroute",
 	"sndbuf", "rcvbuf", "sndlowat", "rcvlowat",
 	"broadcast", "keepalive", "oobinline", "linger",
 	"tcp_nodelay",
-	"multicast_ttl", "multicast_if", "multicast_loop", NULL
+	"multicast_ttl", "multicast_if", "multicast_loop",
+#ifdef SOCK_HAVE_UDP_GSO
+	"udp_segment", "udp_gro",
+#endif
+	NULL
     };
 #undef OPT_START
 #define OPT_START	2
     sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
     const int optname = luaL_checkoption(L, OPT_START, NULL, opt_names);
     const int level = (optname < OPTNAMES_TCP) ? SOL_SOCKET
-     : (optname < OPTNAMES_IP ? IPPROTO_TCP : IPPROTO_IP);
+     : (optname < OPTNAMES_IP ? IPPROTO_TCP
+     : (optname < OPTNAMES_UDP ? IPPROTO_IP : IPPROTO_UDP));
     const int optflag = opt_flags[optname];
     int optval[4];
     socklen_t optlen = sizeof(int);
@@ -390,6 +421,125 @@ sock_accept (lua_State *L)
     return sys_seterror(L, 0);
 }
 
+/*
+ * Arguments: ..., table, ...
+ */
+static void
+sock_checkslots (lua_State *L, int idx, int count, const char *tname)
+{
+    int i;
+
+    for (i = 1; i <= count; ++i) {
+	lua_rawgeti(L, idx, i);
+	if (!lua_isnil(L, -1))
+	    checkudata(L, -1, tname);
+	lua_pop(L, 1);
+    }
+}
+
+/*
+ * Accept connections in nonblocking and close-on-exec mode.
+ * The listening socket should be in nonblocking mode to accept
+ * more than one connection at once.
+ * Closed handles in the table are reused; open ones are replaced with
+ * new handles, and the replaced ones get closed by the garbage collector
+ * unless referenced elsewhere.
+ *
+ * Arguments: sd_udata, count (number), handles (table of sd_udata),
+ *	[addresses (table of sock_addr_udata)]
+ * Returns: [count (number)]
+ */
+static int
+sock_accept_many (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    const int count = luaL_checkinteger(L, 2);
+    const int with_addr = lua_istable(L, 4);
+    sd_t sds[SOCK_ACCEPT_MAX];
+    struct sock_addr addrs[SOCK_ACCEPT_MAX];
+    int i, n, once = 0;
+
+    if (count <= 0 || count > SOCK_ACCEPT_MAX)
+	luaL_argerror(L, 2, "invalid count");
+    luaL_checktype(L, 3, LUA_TTABLE);
+    sock_checkslots(L, 3, count, SD_TYPENAME);
+    if (with_addr)
+	sock_checkslots(L, 4, count, SA_TYPENAME);
+
+#ifndef _WIN32
+    /* blocking listener would wait for each connection */
+    once = !(fcntl(sd, F_GETFL) & O_NONBLOCK);
+#endif
+
+    sys_vm_leave();
+    for (n = 0; n < count; ) {
+	struct sockaddr *sap = NULL;
+	socklen_t *slp = NULL;
+	sd_t nsd;
+
+	if (with_addr) {
+	    sap = &addrs[n].u.addr;
+	    slp = &addrs[n].addrlen;
+	    *slp = sizeof(addrs[n].u);
+	}
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	do nsd = accept4(sd, sap, slp, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	while (nsd == -1 && SYS_ERRNO == EINTR);
+#else
+#ifndef _WIN32
+	do nsd = accept(sd, sap, slp);
+	while (nsd == -1 && SYS_ERRNO == EINTR);
+	if (nsd != -1) fcntl(nsd, F_SETFD, FD_CLOEXEC);
+#else
+	nsd = accept(sd, sap, slp);
+#endif
+	if (nsd != (sd_t) -1) {
+	    unsigned long opt = 1;
+	    ioctlsocket(nsd, FIONBIO, &opt);
+	}
+#endif
+	if (nsd == (sd_t) -1) break;
+	sds[n++] = nsd;
+	if (once) break;
+    }
+    sys_vm_enter();
+
+    if (!n && !SYS_EAGAIN(SYS_ERRNO))
+	return sys_seterror(L, 0);
+
+    for (i = 0; i < n; ++i) {
+	struct sock_handle *sh;
+
+	/* reuse closed handles */
+	lua_rawgeti(L, 3, i + 1);
+	sh = lua_touserdata(L, -1);
+	if (!sh || (sd_t) sh->sd != (sd_t) -1) {
+	    sock_new(L);
+	    sh = lua_touserdata(L, -1);
+	    lua_rawseti(L, 3, i + 1);
+	}
+	sh->sd = sds[i];
+	sh->rsize = 0;
+	lua_pop(L, 1);
+
+	if (with_addr) {
+	    struct sock_addr *sap;
+
+	    lua_rawgeti(L, 4, i + 1);
+	    sap = lua_touserdata(L, -1);
+	    if (!sap) {
+		sock_addr_new(L);
+		sap = lua_touserdata(L, -1);
+		lua_rawseti(L, 4, i + 1);
+	    }
+	    memcpy(sap, &addrs[i], sizeof(struct sock_addr));
+	    lua_pop(L, 1);
+	}
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
 /*
  * Arguments: sd_udata, sock_addr_udata
  * Returns: [sd_udata | false (EINPROGRESS)]
@@ -422,15 +572,27 @@ sock_connect (lua_State *L)
  * Arguments: sd_udata, {string | membuf_udata},
  *	[to (sock_addr_udata), options (string) ...]
  * Returns: [success/partial (boolean), count (number)]
+ *
+ * With "zerocopy" option the buffer is not consumed and stays referenced
+ * until sd_udata:zerocopy_done() reports its completion.
+ * The kernel may send from it even after close: buffers of sends pending
+ * at close stay referenced while sd_udata lives; don't modify them.
  */
 static int
 sock_send (lua_State *L)
 {
     static const int o_flags[] = {
 	MSG_OOB, MSG_DONTROUTE,
+#ifdef SOCK_HAVE_ZEROCOPY
+	MSG_ZEROCOPY,
+#endif
     };
     static const char *const o_names[] = {
-	"oob", "dontroute", NULL
+	"oob", "dontroute",
+#ifdef SOCK_HAVE_ZEROCOPY
+	"zerocopy",
+#endif
+	NULL
     };
     sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
     const struct sock_addr *to = !lua_isuserdata(L, 3) ? NULL
@@ -444,6 +606,10 @@ sock_send (lua_State *L)
     for (i = lua_gettop(L); i > 3; --i) {
 	flags |= o_flags[luaL_checkoption(L, i, NULL, o_names)];
     }
+#ifdef SOCK_HAVE_ZEROCOPY
+    if ((flags & MSG_ZEROCOPY) && zc_prepare(L, sd))
+	return sys_seterror(L, 0);
+#endif
     sys_vm_leave();
     do nw = !to ? send(sd, sb.ptr.r, sb.size, flags)
      : sendto(sd, sb.ptr.r, sb.size, flags, &to->u.addr, to->addrlen);
@@ -453,7 +619,13 @@ sock_send (lua_State *L)
 	if (!SYS_EAGAIN(SYS_ERRNO))
 	    return sys_seterror(L, 0);
 	nw = 0;
-    } else {
+    }
+#ifdef SOCK_HAVE_ZEROCOPY
+    else if (flags & MSG_ZEROCOPY) {
+	if (nw) zc_pin(L);
+    }
+#endif
+    else {
 	sys_buffer_read_next(&sb, nw);
     }
     lua_pushboolean(L, ((size_t) nw == sb.size));
@@ -461,6 +633,51 @@ sock_send (lua_State *L)
     return 2;
 }
 
+/*
+ * Returns: number of bytes pending to read
+ */
+static size_t
+sock_pending (sd_t sd)
+{
+#ifndef _WIN32
+    int n;
+#else
+    u_long n;
+#endif
+
+    return (!ioctlsocket(sd, FIONREAD, &n) && n > 0) ? (size_t) n : 0;
+}
+
+/*
+ * Size the read buffer after large reads: by the bytes pending in the
+ * socket or, for a memory buffer, by the history of read sizes.
+ * Returns: 0 on memory error
+ */
+static int
+sock_rsize_reserve (lua_State *L, struct sock_handle *sh,
+                    struct sys_buffer *sb, char *buf, size_t count)
+{
+    size_t n;
+
+    if (sh->rsize <= SYS_BUFSIZE)
+	return 1;  /* small reads: don't ask the kernel */
+
+    n = sock_pending((sd_t) sh->sd);
+    if (!n && sb->mb) n = sh->rsize;
+    if (n >= count) n = count;
+    else ++n;  /* draining read is short to stop reading */
+    return sys_buffer_write_reserve(L, sb, buf, n);
+}
+
+static void
+sock_rsize_update (struct sock_handle *sh, size_t nread)
+{
+    const size_t half = sh->rsize / 2;
+    const size_t n = (nread > half) ? nread : half;
+
+    sh->rsize = (n < SOCK_RSIZE_MAX) ? n : SOCK_RSIZE_MAX;
+}
+
 /*
  * Arguments: sd_udata, [count (number) | membuf_udata,
  *	from (sock_addr_udata), options (string) ...]
@@ -482,7 +699,8 @@ sock_recv (lua_State *L)
 #endif
 	NULL
     };
-    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    struct sock_handle *sh = checkudata(L, 1, SD_TYPENAME);
+    const sd_t sd = (sd_t) sh->sd;
     size_t n = !lua_isnumber(L, 2) ? ~((size_t) 0)
      : (size_t) lua_tointeger(L, 2);
     struct sock_addr *from = !lua_isuserdata(L, 3) ? NULL
@@ -505,6 +723,8 @@ sock_recv (lua_State *L)
 	sap = &from->u.addr;
 	slp = &from->addrlen;
     }
+    if (!sock_rsize_reserve(L, sh, &sb, buf, n))
+	return sys_seterror(L, ENOMEM);
     do {
 	rlen = (n <= sb.size) ? n : sb.size;
 	sys_vm_leave();
@@ -520,18 +740,503 @@ sock_recv (lua_State *L)
     } while ((n != 0L && nr == (int) rlen)  /* until end of count or eof */
      && sys_buffer_write_next(L, &sb, buf, 0));
     if (nr <= 0 && len == n) {
-	if (!nr || !SYS_EAGAIN(SYS_ERRNO)) goto err;
+	const int err = nr ? SYS_ERRNO : 0;
+
+	if (sys_buffer_write_done(L, &sb, buf, 0))
+	    lua_pop(L, 1);  /* release the reserved memory */
+	if (!nr || !SYS_EAGAIN(err))
+	    return sys_seterror(L, err);
 	lua_pushboolean(L, 0);
     } else {
+	if (nr < 0) nr = 0;  /* error after partial read */
+	sock_rsize_update(sh, len - n);
 	if (!sys_buffer_write_done(L, &sb, buf, nr))
 	    lua_pushinteger(L, len - n);
     }
     return 1;
- err:
-    return sys_seterror(L, 0);
 }
 
 
+/*
+ * Returns: number of datagrams received or -1
+ */
+static int
+sock_recvbatch (sd_t sd, char *p, size_t size, int count,
+                struct sock_addr **from, size_t *lens)
+{
+#if defined(__linux__)
+    struct mmsghdr msgs[SOCK_MMSG_MAX];
+    struct iovec iov[SOCK_MMSG_MAX];
+    int i, n;
+
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for (i = 0; i < count; ++i) {
+	struct msghdr *mh = &msgs[i].msg_hdr;
+
+	iov[i].iov_base = p + i * size;
+	iov[i].iov_len = size;
+	mh->msg_iov = &iov[i];
+	mh->msg_iovlen = 1;
+	if (from[i]) {
+	    mh->msg_name = &from[i]->u.addr;
+	    mh->msg_namelen = sizeof(from[i]->u);
+	}
+    }
+
+    do n = recvmmsg(sd, msgs, count, MSG_WAITFORONE, NULL);
+    while (n == -1 && SYS_ERRNO == EINTR);
+
+    for (i = 0; i < n; ++i) {
+	lens[i] = msgs[i].msg_len;
+	if (from[i]) from[i]->addrlen = msgs[i].msg_hdr.msg_namelen;
+    }
+    return n;
+#else
+    int i, flags = 0;
+
+    for (i = 0; i < count; ++i) {
+	struct sockaddr *sap = NULL;
+	socklen_t *slp = NULL;
+	int nr;
+
+	if (from[i]) {
+	    sap = &from[i]->u.addr;
+	    slp = &from[i]->addrlen;
+	    *slp = sizeof(from[i]->u);
+	}
+#ifndef _WIN32
+	do nr = recvfrom(sd, p + i * size, size, flags, sap, slp);
+	while (nr == -1 && SYS_ERRNO == EINTR);
+#else
+	nr = recvfrom(sd, p + i * size, size, flags, sap, slp);
+#endif
+	if (nr == -1) break;
+	lens[i] = nr;
+
+	/* don't wait for the rest of batch */
+#ifdef MSG_DONTWAIT
+	flags = MSG_DONTWAIT;
+#else
+	return i + 1;
+#endif
+    }
+    return i ? i : -1;
+#endif
+}
+
+/*
+ * Arguments: sd_udata, membuf_udata, count (number),
+ *	[packet_size (number), offsets (table), lengths (table),
+ *	from (table of sock_addr_udata)]
+ * Returns: [count (number) | false (EAGAIN)]
+ */
+static int
+sock_recvmany (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    const int count = luaL_checkinteger(L, 3);
+    const size_t size = (size_t) luaL_optinteger(L, 4, SOCK_PACKET_SIZE);
+    struct sock_addr *from[SOCK_MMSG_MAX];
+    size_t lens[SOCK_MMSG_MAX];
+    struct sys_buffer sb, rsb;
+    size_t off, tail;
+    int i, n;
+
+    if (count <= 0 || count > SOCK_MMSG_MAX)
+	luaL_argerror(L, 3, "invalid count");
+    if (!size || size > 65536)
+	luaL_argerror(L, 4, "invalid packet size");
+
+    sys_buffer_write_init(L, 2, &sb, NULL, 0);
+    if (sb.size <= count * size
+     && !sys_buffer_write_next(L, &sb, NULL, count * size))
+	return sys_seterror(L, ENOMEM);
+
+    /* reuse the address objects */
+    for (i = 0; i < count; ++i) {
+	from[i] = NULL;
+	if (!lua_istable(L, 7)) continue;
+
+	lua_rawgeti(L, 7, i + 1);
+	if (lua_isnil(L, -1)) {
+	    lua_pop(L, 1);
+	    sock_addr_new(L);
+	    lua_pushvalue(L, -1);
+	    lua_rawseti(L, 7, i + 1);
+	}
+	from[i] = checkudata(L, -1, SA_TYPENAME);
+	lua_pop(L, 1);
+    }
+
+    sys_vm_leave();
+    n = sock_recvbatch(sd, sb.ptr.w, size, count, from, lens);
+    sys_vm_enter();
+
+    if (n == -1) {
+	if (!SYS_EAGAIN(SYS_ERRNO))
+	    return sys_seterror(L, 0);
+	lua_pushboolean(L, 0);
+	return 1;
+    }
+
+    /* pack the datagrams together */
+    sys_buffer_read_init(L, 2, &rsb);
+    off = rsb.size;
+    tail = 0;
+    for (i = 0; i < n; ++i) {
+	if (tail != i * size)
+	    memmove(sb.ptr.w + tail, sb.ptr.w + i * size, lens[i]);
+	if (lua_istable(L, 5)) {
+	    lua_pushnumber(L, (lua_Number) (off + tail));
+	    lua_rawseti(L, 5, i + 1);
+	}
+	if (lua_istable(L, 6)) {
+	    lua_pushnumber(L, (lua_Number) lens[i]);
+	    lua_rawseti(L, 6, i + 1);
+	}
+	tail += lens[i];
+    }
+    sys_buffer_write_done(L, &sb, NULL, tail);
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/*
+ * Arguments: sd_udata, packets (table of strings | membuf_udata),
+ *	[to (sock_addr_udata | table of sock_addr_udata)]
+ * Returns: [count (number) | false (EAGAIN)]
+ *
+ * Up to SOCK_MMSG_MAX (256) packets are sent per call; the rest of the
+ * table is left for the next call.
+ */
+static int
+sock_sendmany (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    const int to_table = lua_istable(L, 3);
+    const struct sock_addr *to_single = (to_table || lua_isnoneornil(L, 3))
+     ? NULL : checkudata(L, 3, SA_TYPENAME);
+    const struct sock_addr *to[SOCK_MMSG_MAX];
+    struct sys_buffer sbs[SOCK_MMSG_MAX];
+    size_t len;
+    int i, n, count;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    len = lua_rawlen(L, 2);
+    count = (len < SOCK_MMSG_MAX) ? (int) len : SOCK_MMSG_MAX;
+
+    for (i = 0; i < count; ++i) {
+	lua_rawgeti(L, 2, i + 1);
+	if (!sys_buffer_read_init(L, -1, &sbs[i]))
+	    luaL_argerror(L, 2, "buffers expected");
+	lua_pop(L, 1);  /* referenced by the table */
+
+	if (to_table) {
+	    lua_rawgeti(L, 3, i + 1);
+	    to[i] = checkudata(L, -1, SA_TYPENAME);
+	    lua_pop(L, 1);
+	}
+	else
+	    to[i] = to_single;
+    }
+    if (!count) {
+	lua_pushinteger(L, 0);
+	return 1;
+    }
+
+    sys_vm_leave();
+#if defined(__linux__)
+    {
+	struct mmsghdr msgs[SOCK_MMSG_MAX];
+	struct iovec iov[SOCK_MMSG_MAX];
+
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for (i = 0; i < count; ++i) {
+	    struct msghdr *mh = &msgs[i].msg_hdr;
+
+	    iov[i].iov_base = (char *) sbs[i].ptr.r;
+	    iov[i].iov_len = sbs[i].size;
+	    mh->msg_iov = &iov[i];
+	    mh->msg_iovlen = 1;
+	    if (to[i]) {
+		mh->msg_name = (void *) &to[i]->u.addr;
+		mh->msg_namelen = to[i]->addrlen;
+	    }
+	}
+	do n = sendmmsg(sd, msgs, count, 0);
+	while (n == -1 && SYS_ERRNO == EINTR);
+    }
+#else
+    for (n = 0; n < count; ++n) {
+	int nw;
+
+#ifndef _WIN32
+	do nw = !to[n] ? send(sd, sbs[n].ptr.r, sbs[n].size, 0)
+	 : sendto(sd, sbs[n].ptr.r, sbs[n].size, 0,
+	 &to[n]->u.addr, to[n]->addrlen);
+	while (nw == -1 && SYS_ERRNO == EINTR);
+#else
+	nw = !to[n] ? send(sd, sbs[n].ptr.r, sbs[n].size, 0)
+	 : sendto(sd, sbs[n].ptr.r, sbs[n].size, 0,
+	 &to[n]->u.addr, to[n]->addrlen);
+#endif
+	if (nw == -1) {
+	    if (!n) n = -1;
+	    break;
+	}
+    }
+#endif
+    sys_vm_enter();
+
+    if (n == -1) {
+	if (!SYS_EAGAIN(SYS_ERRNO))
+	    return sys_seterror(L, 0);
+	lua_pushboolean(L, 0);
+	return 1;
+    }
+    for (i = 0; i < n; ++i)
+	sys_buffer_read_next(&sbs[i], sbs[i].size);
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+
+#ifndef _WIN32
+
+#define SOCK_FDS_MAX	253  /* max. number of descriptors per message */
+
+/*
+ * Returns: descriptor of sys.handle or sys.sock.handle, -1 otherwise
+ */
+static int
+sock_tofd (lua_State *L, int idx)
+{
+    const lua_Integer *fdp = lua_touserdata(L, idx);
+    int fd = -1;
+
+    if (fdp && lua_getmetatable(L, idx)) {
+	luaL_getmetatable(L, SD_TYPENAME);
+	luaL_getmetatable(L, FD_TYPENAME);
+	if (lua_rawequal(L, -3, -2) || lua_rawequal(L, -3, -1))
+	    fd = (int) *fdp;
+	lua_pop(L, 3);
+    }
+    return fd;
+}
+
+/*
+ * Arguments: sd_udata, {string | membuf_udata},
+ *	handles (table of fd_udata | sd_udata)
+ * Returns: [success/partial (boolean), count (number)]
+ *
+ * The descriptors go with the first byte sent.
+ */
+static int
+sock_send_fds (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(SOCK_FDS_MAX * sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct iovec iov;
+    struct sys_buffer sb;
+    int *fds;
+    int i, n, nw;
+
+    if (!sys_buffer_read_init(L, 2, &sb))
+	luaL_argerror(L, 2, "buffer expected");
+    if (!sb.size)
+	luaL_argerror(L, 2, "empty buffer");
+    luaL_checktype(L, 3, LUA_TTABLE);
+    n = lua_rawlen(L, 3);
+    if (n > SOCK_FDS_MAX)
+	luaL_argerror(L, 3, "too many handles");
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    iov.iov_base = (char *) sb.ptr.r;
+    iov.iov_len = sb.size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (n) {
+	memset(&ctl, 0, sizeof(ctl));
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+	fds = (int *) CMSG_DATA(cm);
+
+	for (i = 0; i < n; ++i) {
+	    lua_rawgeti(L, 3, i + 1);
+	    fds[i] = sock_tofd(L, -1);
+	    if (fds[i] == -1)
+		luaL_argerror(L, 3, "handles expected");
+	    lua_pop(L, 1);
+	}
+    }
+
+    sys_vm_leave();
+    do nw = sendmsg(sd, &msg, 0);
+    while (nw == -1 && SYS_ERRNO == EINTR);
+    sys_vm_enter();
+
+    if (nw == -1) {
+	if (!SYS_EAGAIN(SYS_ERRNO))
+	    return sys_seterror(L, 0);
+	nw = 0;
+    }
+    else {
+	sys_buffer_read_next(&sb, nw);
+    }
+    lua_pushboolean(L, ((size_t) nw == sb.size));
+    lua_pushinteger(L, nw);
+    return 2;
+}
+
+/*
+ * Arguments: handles (table of sd_udata), fds (lightuserdata),
+ *	count (number)
+ */
+static int
+sock_fds_wrap (lua_State *L)
+{
+    int *fds = lua_touserdata(L, 2);
+    const int n = lua_tointeger(L, 3);
+    int i;
+
+    for (i = 0; i < n; ++i) {
+	struct sock_handle *sh;
+
+	/* reuse closed handles */
+	lua_rawgeti(L, 1, i + 1);
+	sh = lua_touserdata(L, -1);
+	if (!sh || (sd_t) sh->sd != (sd_t) -1) {
+	    sock_new(L);
+	    sh = lua_touserdata(L, -1);
+	    lua_rawseti(L, 1, i + 1);
+	}
+	sh->sd = fds[i];
+	fds[i] = -1;  /* owned by the handle */
+	lua_pop(L, 1);
+    }
+    return 0;
+}
+
+/*
+ * Arguments: sd_udata, {count (number) | membuf_udata},
+ *	handles (table of sd_udata)
+ * Returns: [string | count (number) | false (EAGAIN),
+ *	number_of_handles (number)]
+ */
+static int
+sock_recv_fds (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    const size_t n = !lua_isnumber(L, 2) ? SYS_BUFSIZE
+     : (size_t) lua_tointeger(L, 2);
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(SOCK_FDS_MAX * sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct iovec iov;
+    struct sys_buffer sb;
+    char buf[SYS_BUFSIZE];
+    int fds[SOCK_FDS_MAX];
+    int flags = 0;
+    int i, nr, nfds = 0;
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+    if (!n) luaL_argerror(L, 2, "invalid count");
+    sock_checkslots(L, 3, SOCK_FDS_MAX, SD_TYPENAME);
+
+    lua_settop(L, 3);
+    lua_pushcfunction(L, sock_fds_wrap);  /* 4 */
+
+    sys_buffer_write_init(L, 2, &sb, buf, sizeof(buf));
+    if (!sys_buffer_write_reserve(L, &sb, buf, n))
+	return sys_seterror(L, ENOMEM);
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    iov.iov_base = sb.ptr.w;
+    iov.iov_len = (n < sb.size) ? n : sb.size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+#ifdef MSG_CMSG_CLOEXEC
+    flags = MSG_CMSG_CLOEXEC;
+#endif
+
+    sys_vm_leave();
+    do nr = recvmsg(sd, &msg, flags);
+    while (nr == -1 && SYS_ERRNO == EINTR);
+    sys_vm_enter();
+
+    if (nr > 0) {
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+	    int k;
+
+	    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+		continue;
+
+	    k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	    if (k > SOCK_FDS_MAX - nfds) k = SOCK_FDS_MAX - nfds;
+	    memcpy(fds + nfds, CMSG_DATA(cm), k * sizeof(int));
+	    nfds += k;
+	}
+#ifndef MSG_CMSG_CLOEXEC
+	for (i = 0; i < nfds; ++i)
+	    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+#endif
+	if (msg.msg_flags & MSG_CTRUNC) {
+	    nr = -1;  /* descriptors were dropped */
+	    errno = EMSGSIZE;
+	}
+	else {
+	    lua_pushvalue(L, 3);
+	    lua_pushlightuserdata(L, fds);
+	    lua_pushinteger(L, nfds);
+	    if (lua_pcall(L, 3, 0, 0)) {
+		for (i = 0; i < nfds; ++i) {
+		    if (fds[i] != -1) close(fds[i]);
+		}
+		if (sys_buffer_write_done(L, &sb, buf, 0))
+		    lua_pop(L, 1);  /* release the reserved memory */
+		return lua_error(L);
+	    }
+	}
+    }
+
+    if (nr <= 0) {
+	const int err = nr ? SYS_ERRNO : 0;
+
+	for (i = 0; i < nfds; ++i)
+	    close(fds[i]);
+	if (sys_buffer_write_done(L, &sb, buf, 0))
+	    lua_pop(L, 1);  /* release the reserved memory */
+	if (!nr || !SYS_EAGAIN(err))
+	    return sys_seterror(L, err);
+	lua_pushboolean(L, 0);
+	return 1;
+    }
+
+    if (!sys_buffer_write_done(L, &sb, buf, nr))
+	lua_pushinteger(L, nr);
+    lua_pushinteger(L, nfds);
+    return 2;
+}
+
+#endif
+
+
 #ifdef _WIN32
 
 #define SYS_GRAN_MASK	(64 * 1024 - 1)
@@ -580,57 +1285,209 @@ TransmitFileMap (SOCKET sd, HANDLE fd, DWORD n)
 #endif
 
 
+#ifdef MSG_MORE
+#define SOCK_MSG_MORE	MSG_MORE
+#else
+#define SOCK_MSG_MORE	0
+#endif
+
+#if defined(TCP_CORK)
+#define SOCK_TCP_CORK	TCP_CORK
+#elif defined(TCP_NOPUSH)
+#define SOCK_TCP_CORK	TCP_NOPUSH
+#endif
+
+static void
+sock_cork (sd_t sd, int on)
+{
+#ifdef SOCK_TCP_CORK
+    /* fails on non-TCP sockets */
+    setsockopt(sd, IPPROTO_TCP, SOCK_TCP_CORK, (char *) &on, sizeof(int));
+#else
+    (void) sd;
+    (void) on;
+#endif
+}
+
+/*
+ * Send the header or trailer; unsent tail of string is stored back
+ * into options table, membuf is consumed.
+ * Returns: 1 when all is sent, 0 on partial send, -1 on error
+ */
+static int
+sock_sendpart (lua_State *L, sd_t sd, int idx, const char *field,
+               int flags, size_t *countp)
+{
+    struct sys_buffer sb;
+    int nw = 0;
+
+    lua_getfield(L, idx, field);
+    if (lua_isnil(L, -1)) {
+	lua_pop(L, 1);
+	return 1;
+    }
+    if (!sys_buffer_read_init(L, -1, &sb))
+	luaL_error(L, "sendfile: bad option '%s' (string or membuf expected)",
+	 field);
+
+    if (sb.size) {
+	sys_vm_leave();
+	do nw = send(sd, sb.ptr.r, sb.size, flags);
+	while (nw == -1 && SYS_ERRNO == EINTR);
+	sys_vm_enter();
+
+	if (nw == -1) {
+	    lua_pop(L, 1);
+	    return SYS_EAGAIN(SYS_ERRNO) ? 0 : -1;
+	}
+	*countp += nw;
+    }
+
+    if (sb.mb)
+	sys_buffer_read_next(&sb, nw);
+    else {
+	if ((size_t) nw < sb.size)
+	    lua_pushlstring(L, sb.ptr.r + nw, sb.size - nw);
+	else
+	    lua_pushnil(L);
+	lua_setfield(L, idx, field);
+    }
+    lua_pop(L, 1);
+    return ((size_t) nw == sb.size);
+}
+
 /*
- * Arguments: sd_udata, fd_udata, [count (number)]
- * Returns: [count (number) | false (EAGAIN)]
+ * Arguments: sd_udata, fd_udata, [offset (number), count (number),
+ *	options (table: {headers = string | membuf_udata,
+ *	trailers = string | membuf_udata})]
+ * Returns: [done (boolean), count (number), next_offset (number)]
+ *
+ * Note: formerly (sd_udata, fd_udata, [count]) returning [count | false];
+ * count is now the 4th argument and the sent bytes are the 2nd result.
+ * done is false on EAGAIN or a partial send: call again with next_offset
+ * and the same options, where unsent header/trailer strings are kept.
+ * Without offset the current file position is used and advanced.
  */
 static int
 sock_sendfile (lua_State *L)
 {
     sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
     fd_t fd = (fd_t) lua_unboxinteger(L, 2, FD_TYPENAME);
-    size_t n = (size_t) lua_tointeger(L, 3);
-    ssize_t res;
+    const int has_off = !lua_isnoneornil(L, 3);
+    const lua_Number offset = lua_tonumber(L, 3);
+    size_t n = (size_t) lua_tointeger(L, 4);
+    const int has_opts = lua_istable(L, 5);
+    size_t count = 0;  /* number of bytes sent */
+    int done = 0, res;
+#ifndef _WIN32
+    struct stat st;
+    off_t off;
+#else
+    LONG off_hi = 0L, off_lo;
+    int64_t off;
+#endif
 
-    sys_vm_leave();
+    /* file range */
 #ifndef _WIN32
+    off = has_off ? (off_t) offset : lseek(fd, 0, SEEK_CUR);
+    if (off == (off_t) -1 || fstat(fd, &st))
+	return sys_seterror(L, 0);
+    if (off >= st.st_size)
+	n = 0;
+    else if (!n || (off_t) n > st.st_size - off)
+	n = (size_t) (st.st_size - off);
+#else
+    if (has_off) {
+	off = (int64_t) offset;
+	off_hi = (LONG) (off >> 32);
+	off_lo = SetFilePointer(fd, (LONG) off, &off_hi, SEEK_SET);
+    } else
+	off_lo = SetFilePointer(fd, 0, &off_hi, SEEK_CUR);
+    if (off_lo == INVALID_SET_FILE_POINTER && SYS_ERRNO != NO_ERROR)
+	return sys_seterror(L, 0);
+    off = INT64_MAKE(off_lo, off_hi);
+#endif
+
+    if (has_opts) {
+	sock_cork(sd, 1);
+	res = sock_sendpart(L, sd, 5, "headers", SOCK_MSG_MORE, &count);
+	if (res != 1) goto end;
+    }
+
+#ifndef _WIN32
+    while (n) {
+	ssize_t nw;
+
+	sys_vm_leave();
 #if defined(__linux__)
-    do res = sendfile(sd, fd, NULL, n ? n : ~((size_t) 0));
-    while (res == -1 && SYS_ERRNO == EINTR);
+	do nw = sendfile(sd, fd, &off, n);
+	while (nw == -1 && SYS_ERRNO == EINTR);
 #else
-    {
-	off_t nw, off = lseek(fd, 0, SEEK_CUR);
+	{
+	    off_t len;
 
 #if defined(__APPLE__) && defined(__MACH__)
-	nw = n;
-	do res = sendfile(fd, sd, off, &nw, NULL, 0);
+	    len = n;
+	    do nw = sendfile(fd, sd, off, &len, NULL, 0);
 #else
-	do res = sendfile(fd, sd, off, n, NULL, &nw, 0);
+	    do nw = sendfile(fd, sd, off, n, NULL, &len, 0);
 #endif
-	while (res == -1 && SYS_ERRNO == EINTR);
-	if (res != -1) {
-	    res = (size_t) nw;
-	    lseek(fd, nw, SEEK_CUR);
+	    while (nw == -1 && SYS_ERRNO == EINTR && !len);
+
+	    /* partial send is reported along with EAGAIN */
+	    if (nw != -1 || len) {
+		nw = (ssize_t) len;
+		off += len;
+	    }
 	}
-    }
 #endif
-    sys_vm_enter();
+	sys_vm_enter();
 
-    if (res != -1 || SYS_EAGAIN(SYS_ERRNO)) {
-	if (res == -1) {
-	    lua_pushboolean(L, 0);
-	    return 1;
+	if (nw == -1) {
+	    res = SYS_EAGAIN(SYS_ERRNO) ? 0 : -1;
+	    goto end;
 	}
+	if (!nw) break;  /* file is truncated */
+	n -= nw;
+	count += nw;
+    }
 #else
-    res = TransmitFileMap(sd, fd, n);
-    sys_vm_enter();
+    {
+	DWORD nw;
+
+	sys_vm_leave();
+	nw = TransmitFileMap(sd, fd, (DWORD) n);
+	sys_vm_enter();
 
-    if (res != 0L) {
+	if (!nw && SYS_ERRNO != NO_ERROR) {
+	    res = SYS_EAGAIN(SYS_ERRNO) ? 0 : -1;
+	    goto end;
+	}
+	off += nw;
+	count += nw;
+    }
 #endif
-	lua_pushinteger(L, res);
-	return 1;
+
+    res = 1;
+    if (has_opts)
+	res = sock_sendpart(L, sd, 5, "trailers", 0, &count);
+ end:
+    if (has_opts) sock_cork(sd, 0);
+
+    if (res == -1) {
+	/* report the error on next call */
+	if (!count) return sys_seterror(L, 0);
     }
-    return sys_seterror(L, 0);
+    else done = res;
+
+#ifndef _WIN32
+    if (!has_off) lseek(fd, off, SEEK_SET);
+#endif
+
+    lua_pushboolean(L, done);
+    lua_pushnumber(L, (lua_Number) count);
+    lua_pushnumber(L, (lua_Number) off);
+    return 3;
 }
 
 /*
@@ -642,6 +1499,14 @@ sock_write (lua_State *L)
 {
     sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
     ssize_t n = 0;  /* number of chars actually write */
+#ifndef _WIN32
+    int done;
+
+    n = sys_buffer_writev(L, 2, sd, &done);
+    if (n == -1)
+	return sys_seterror(L, 0);
+    lua_pushboolean(L, done);
+#else
     int i, nargs = lua_gettop(L);
 
     for (i = 2; i <= nargs; ++i) {
@@ -651,16 +1516,11 @@ sock_write (lua_State *L)
 	if (!sys_buffer_read_init(L, i, &sb))
 	    continue;
 	sys_vm_leave();
-#ifndef _WIN32
-	do nw = write(sd, sb.ptr.r, sb.size);
-	while (nw == -1 && SYS_ERRNO == EINTR);
-#else
 	{
 	    WSABUF buf = {sb.size, sb.ptr.w};
 	    DWORD l;
 	    nw = !WSASend(sd, &buf, 1, &l, 0, NULL, NULL) ? l : -1;
 	}
-#endif
 	sys_vm_enter();
 	if (nw == -1) {
 	    if (n > 0 || SYS_EAGAIN(SYS_ERRNO)) break;
@@ -671,6 +1531,7 @@ sock_write (lua_State *L)
 	if ((size_t) nw < sb.size) break;
     }
     lua_pushboolean(L, (i > nargs));
+#endif
     lua_pushinteger(L, n);
     return 2;
 }
@@ -682,7 +1543,8 @@ sock_write (lua_State *L)
 static int
 sock_read (lua_State *L)
 {
-    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    struct sock_handle *sh = checkudata(L, 1, SD_TYPENAME);
+    const sd_t sd = (sd_t) sh->sd;
     size_t n = !lua_isnumber(L, -1) ? ~((size_t) 0)
      : (size_t) lua_tointeger(L, -1);
     const size_t len = n;  /* how much total to read */
@@ -692,6 +1554,8 @@ sock_read (lua_State *L)
     char buf[SYS_BUFSIZE];
 
     sys_buffer_write_init(L, 2, &sb, buf, sizeof(buf));
+    if (!sock_rsize_reserve(L, sh, &sb, buf, n))
+	return sys_seterror(L, ENOMEM);
     do {
 	rlen = (n <= sb.size) ? n : sb.size;
 	sys_vm_leave();
@@ -711,15 +1575,20 @@ sock_read (lua_State *L)
     } while ((n != 0L && nr == (int) rlen)  /* until end of count or eof */
      && sys_buffer_write_next(L, &sb, buf, 0));
     if (nr <= 0 && len == n) {
-	if (!nr || !SYS_EAGAIN(SYS_ERRNO)) goto err;
+	const int err = nr ? SYS_ERRNO : 0;
+
+	if (sys_buffer_write_done(L, &sb, buf, 0))
+	    lua_pop(L, 1);  /* release the reserved memory */
+	if (!nr || !SYS_EAGAIN(err))
+	    return sys_seterror(L, err);
 	lua_pushboolean(L, 0);
     } else {
+	if (nr < 0) nr = 0;  /* error after partial read */
+	sock_rsize_update(sh, len - n);
 	if (!sys_buffer_write_done(L, &sb, buf, nr))
 	    lua_pushinteger(L, len - n);
     }
     return 1;
- err:
-    return sys_seterror(L, 0);
 }
 
 /*
@@ -749,10 +1618,24 @@ static luaL_reg sock_meth[] = {
     {"bind",		sock_bind},
     {"listen",		sock_listen},
     {"accept",		sock_accept},
+    {"accept_many",	sock_accept_many},
     {"connect",		sock_connect},
     {"send",		sock_send},
     {"recv",		sock_recv},
+    {"recvmany",	sock_recvmany},
+    {"sendmany",	sock_sendmany},
     {"sendfile",	sock_sendfile},
+#ifndef _WIN32
+    {"send_fds",	sock_send_fds},
+    {"recv_fds",	sock_recv_fds},
+#endif
+#ifdef SOCK_HAVE_ZEROCOPY
+    {"zerocopy_done",	sock_zerocopy_done},
+#endif
+#ifdef SOCK_HAVE_UDP_GSO
+    {"sendmsg",		sock_sendmsg},
+    {"recvmsg",		sock_recvmsg},
+#endif
     {"write",		sock_write},
     {"read",		sock_read},
     {"__tostring",	sock_tostring},
@@ -764,6 +1647,12 @@ static luaL_reg sock_meth[] = {
 static luaL_reg sock_lib[] = {
     {"handle",		sock_new},
     ADDR_METHODS,
+#ifdef SOCK_HAVE_RELAY
+    RELAY_METHODS,
+#endif
+#ifdef SOCK_HAVE_RESOLVER
+    RESOLVER_METHODS,
+#endif
     {NULL, NULL}
 };
 
@@ -820,6 +1709,24 @@ luaopen_sys_sock (lua_State *L)
     lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
     luaL_register(L, NULL, addr_meth);
 
+#ifdef SOCK_HAVE_RELAY
+    luaL_newmetatable(L, RELAY_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, relay_meth);
+#endif
+
+#ifdef SOCK_HAVE_RESOLVER
+    luaL_newmetatable(L, RESOLVER_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, resolver_meth);
+#endif
+
+#ifdef SOCK_HAVE_ZEROCOPY
+    zc_init(L);
+#endif
+
     luaL_register(L, LUA_SOCKLIBNAME, sock_lib);
 
 #ifdef _WIN32
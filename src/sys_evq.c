@@ -406,7 +406,7 @@ levq_mod_socket (lua_State *L)
     flags = ev->flags & (EVENT_READ | EVENT_WRITE);
     for (; *evstr; ++evstr) {
 	if (*evstr == '+' || *evstr == '-')
-	    change = (*evstr++ == '+') ? 1 : -1;
+	    change = (*evstr == '+') ? 1 : -1;
 	else {
 	    int rw = (*evstr == 'r') ? EVENT_READ : EVENT_WRITE;
 	    switch (change) {
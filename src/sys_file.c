@@ -564,6 +564,14 @@ sys_write (lua_State *L)
 {
     fd_t fd = (fd_t) lua_unboxinteger(L, 1, FD_TYPENAME);
     ssize_t n = 0;  /* number of chars actually write */
+#ifndef _WIN32
+    int done;
+
+    n = sys_buffer_writev(L, 2, fd, &done);
+    if (n == -1)
+	return sys_seterror(L, 0);
+    lua_pushboolean(L, done);
+#else
     int i, nargs = lua_gettop(L);
 
     for (i = 2; i <= nargs; ++i) {
@@ -573,15 +581,10 @@ sys_write (lua_State *L)
 	if (!sys_buffer_read_init(L, i, &sb))
 	    continue;
 	sys_vm_leave();
-#ifndef _WIN32
-	do nw = write(fd, sb.ptr.r, sb.size);
-	while (nw == -1 && SYS_ERRNO == EINTR);
-#else
 	{
 	    DWORD l;
 	    nw = WriteFile(fd, sb.ptr.r, sb.size, &l, NULL) ? l : -1;
 	}
-#endif
 	sys_vm_enter();
 	if (nw == -1) {
 	    if (n > 0 || SYS_EAGAIN(SYS_ERRNO)) break;
@@ -592,6 +595,7 @@ sys_write (lua_State *L)
 	if ((size_t) nw < sb.size) break;
     }
     lua_pushboolean(L, (i > nargs));
+#endif
     lua_pushinteger(L, n);
     return 2;
 }
@@ -634,6 +638,7 @@ sys_read (lua_State *L)
 	if (!nr || SYS_EAGAIN(SYS_ERRNO)) goto err;
 	lua_pushboolean(L, 0);
     } else {
+	if (nr < 0) nr = 0;  /* error after partial read */
 	if (!sys_buffer_write_done(L, &sb, buf, nr))
 	    lua_pushinteger(L, len - n);
     }
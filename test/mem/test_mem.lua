@@ -106,3 +106,631 @@ do
 end
 
 
+
+
+print"-- Binary Packing"
+do
+	local buf = assert(mem.pointer(64))
+	local fmt = "<i2 >I4 v z sv s1 d"
+	local off = buf:pack(0, fmt, -2, 0x01020304, 300, -1, "abc", "hello", 1.5)
+
+	local a, b, v, z, s1, s2, d, next_off = buf:unpack(0, fmt)
+	assert(a == -2 and b == 0x01020304 and v == 300 and z == -1)
+	assert(s1 == "abc" and s2 == "hello" and d == 1.5)
+	assert(next_off == off)
+
+	local stream = assert(mem.pointer():alloc(4))
+	for i = 1, 100 do stream:pack(nil, ">I4", i) end  -- append
+	assert(stream:seek() == 400 and stream:unpack(396, ">I4") == 100)
+	stream:close()
+	print"OK"
+end
+
+
+print"-- Buffer Views"
+do
+	local buf = assert(mem.pointer():alloc(16))
+	buf:write("header:", "payload")
+
+	local v = buf:view(7)
+	assert(v:tostring() == "payload" and v:compare("payload") == 0)
+	assert(v:compare("payloae") < 0 and buf:find("load") == 10)
+
+	local w = v:view(3, 4)
+	assert(w:tostring() == "load" and v:find(w) == 3)
+
+	-- consuming a view does not touch parent's memory
+	assert(v:read(3) == "pay" and v:tostring() == "load")
+	assert(buf:tostring() == "header:payload")
+
+	-- views follow relocated parent
+	buf:write(string.rep("x", 64))
+	assert(w:tostring() == "load")
+
+	buf:free()
+	assert(w:length() == 0)
+	print"OK"
+end
+
+
+print"-- Native Streams"
+do
+	local filename = "fstream"
+	local f = assert(sys.handle():open(filename, "rw", 0x180, "creat"))
+
+	local out = assert(mem.pointer():alloc(16))
+	out:output(f)
+	for i = 1, 100 do assert(out:write("line ", i, "\n")) end
+	assert(out:write(string.rep("x", 100), "\n"))  -- larger than buffer
+	assert(out:flush())
+
+	f:seek(0, "set")
+	local inp = assert(mem.pointer():alloc(16))
+	inp:input(f)
+	for i = 1, 100 do assert(inp:read"*l" == "line " .. i) end
+	assert(inp:read(4) == "xxxx" and inp:read"*l" == string.rep("x", 96))
+	assert(inp:read"*l" == nil)
+
+	-- line longer than fixed-size buffer is not the end of stream
+	local small = assert(mem.pointer(8))
+	small:input(f)
+	f:seek(792, "set")
+	local line, err = small:read"*l"
+	assert(line == nil and err)
+
+	-- write errors are reported
+	local ro = assert(sys.handle():open(filename, "r"))
+	out:output(ro)
+	line, err = out:write(string.rep("y", 100))
+	assert(line == nil and err)
+	out:seek(0)
+	assert(out:write("ab"))
+	line, err = out:flush()
+	assert(line == nil and err)
+	ro:close()
+
+	inp:free(); out:free()
+	f:close()
+	sys.remove(filename)
+	print"OK"
+end
+
+
+print"-- Mapping Options"
+do
+	local size = 1024 * 1024
+	local p = assert(mem.pointer():alloc(size, nil, "populate,hugepage"))
+	p[100] = 7
+	assert(p[100] == 7 and p[size - 1] == 0)
+
+	assert(p:advise(0, size, "sequential"))
+	assert(p:advise(0, 4096, "dontneed") and p[100] == 0)
+	assert(not pcall(p.advise, p, 0, size + 1, "random"))
+	p[8192] = 5
+	assert(p:advise(8000, 4200, "dontneed") and p[8192] == 5)
+	p:free()
+
+	-- malloc'ed memory shares pages with the heap
+	local m = assert(mem.pointer():alloc(64, nil, nil))
+	assert(m:advise(8, 8, "willneed"))
+	assert(not m:advise(8, 8, "dontneed"))
+	assert(not m:advise(0, 64, "lock"))
+	m:free()
+	print"OK"
+end
+
+
+print"-- Map Growth"
+do
+	local filename = "fgrow"
+	local f = assert(sys.handle():open(filename, "rw", 0x180, "creat"))
+	f:write("head")
+
+	local p = assert(mem.pointer():map(f, "rw"))
+	local v = p:view(0, 4)
+	assert(p:realloc(8192, f) and p:length() == 8192)
+	p[8188] = "tail"
+	assert(v:tostring() == "head")  -- view follows the mapping
+	p:free()
+
+	f:seek(-4, "end")
+	assert(f:read() == "tail")
+	f:close()
+	sys.remove(filename)
+
+	local a = assert(mem.pointer():alloc(4096, nil, "populate"))
+	a[0] = "anon"
+	assert(a:realloc(65536) and a:tostring(4) == "anon")
+	a:free()
+	print"OK"
+end
+
+
+print"-- Atomic Operations"
+do
+	local counters = assert(mem.pointer(4 * 4)):type"int"
+
+	assert(counters:add(1, 5) == 0 and counters:sub(1, 2) == 5)
+	assert(counters:load(1, "acquire") == 3)
+	assert(counters:xchg(1, -1) == 3 and counters[1] == -1)
+
+	local ok, old = counters:cas(1, 0, 10)
+	assert(not ok and old == -1)
+	ok, old = counters:cas(1, -1, 10, "acq_rel")
+	assert(ok and old == -1 and counters:load(1) == 10)
+
+	counters:type"uint":store(0, 4294967295, "release")
+	assert(counters:add(0, 1) == 4294967295 and counters[0] == 0)
+
+	assert(not pcall(counters.add, counters, 4, 1))  -- out of bounds
+	assert(not pcall(counters:type"char".add, counters, 0, 1))
+	print"OK"
+end
+
+
+print"-- Ring Queue"
+do
+	local filename = "fring"
+	local f = assert(sys.handle():open(filename, "rw", 0x180, "creat"))
+	f:seek(4096 + 256, "set")
+	f:write"\0"
+
+	-- producer and consumer attach to the same file
+	local producer = assert(mem.ring(mem.pointer():map(f, "rw"), true))
+	local consumer = assert(mem.ring(mem.pointer():map(f, "rw")))
+	assert(consumer:get(0) == false)
+
+	local n = 0
+	for _ = 1, 50 do  -- wrap around
+		for i = 1, 20 do assert(producer:put("rec" .. (n + i), 0)) end
+		for _ = 1, 20 do
+			n = n + 1
+			assert(consumer:get(0) == "rec" .. n)
+		end
+	end
+
+	local rec = string.rep("x", 1000)
+	while producer:put(rec, 0) do end
+	assert(producer:put(rec, 10) == false)  -- full
+
+	local buf = assert(mem.pointer():alloc(16))
+	assert(consumer:get(buf, 0) == 1000 and buf:seek() == 1000)
+	buf:free()
+
+	f:close()
+	sys.remove(filename)
+
+	-- records larger than the stack buffer; the whole timeout is waited
+	local mem_q = assert(mem.pointer():alloc(65536))
+	local q = assert(mem.ring(mem_q, true, "mpmc"))
+	rec = string.rep("y", 10000)
+	assert(q:put(rec, 0) and q:get(0) == rec)
+	local period = sys.period():start()
+	assert(q:get(100) == false and period:get() >= 100000)
+	mem_q:free()
+
+	-- corrupt shared header and records
+	local mem_r = assert(mem.pointer():alloc(1024))
+	mem_r:memset(0, 1024)
+	mem_r:write"Ring"  -- magic with zero capacity
+	assert(not pcall(mem.ring, mem_r))
+	local r = assert(mem.ring(mem_r, true))
+	assert(r:put("abc", 0))
+	mem_r[192 + 3] = 0x7F  -- length of the first record
+	assert(not pcall(r.get, r, 0))
+	mem_r:free()
+	print"OK"
+end
+
+
+print"-- Bitsets"
+do
+	local nbits = 1000
+	local a = assert(mem.pointer(nbits / 8)):type"bitstring"
+	local b = assert(mem.pointer(nbits / 8)):type"bitstring"
+
+	for i = 0, nbits - 1, 3 do a[i] = true end
+	for i = 0, nbits - 1, 5 do b[i] = true end
+	assert(a:popcount() == 334 and b:popcount() == 200)
+	assert(a:popcount(3, 7) == 3)  -- bits 3, 6, 9
+
+	a:band(b)  -- multiples of 15
+	assert(a:popcount() == 67)
+	assert(a:nextbit() == 0 and a:nextbit(1) == 15 and a:nextbit(991) == nil)
+	assert(a:nextbit(0, false) == 1)
+
+	local idx = assert(mem.pointer(4 * 10)):type"int"
+	local n, next_bit = a:bitindexes(idx)
+	assert(n == 10 and next_bit == 150 and idx[9] == 135)
+	n, next_bit = a:bitindexes(idx, 991)
+	assert(n == 0 and next_bit == nil)
+
+	a:bor(b):bxor(b)
+	assert(a:popcount() == 0)
+	b:bandnot(b)
+	assert(b:nextbit() == nil)
+
+	-- operands must be bitstrings
+	assert(not pcall(a.band, a, assert(mem.pointer(nbits / 8))))
+	assert(not pcall(a.popcount, assert(mem.pointer(8))))
+	print"OK"
+end
+
+
+print"-- Sketches"
+do
+	local keys = {}
+	for i = 1, 1000 do keys[i] = "key" .. i end
+
+	local bloom = assert(mem.bloom(mem.pointer():alloc(16 + 2048), true, 5))
+	assert(bloom:add(keys) > 990)
+	assert(bloom:add("key1", "key2") == 0)
+	local a, b = bloom:check("key1", "key1000")
+	assert(a and b)
+	local fp = 0
+	for i = 1001, 2000 do
+		if bloom:check("key" .. i) then fp = fp + 1 end
+	end
+	assert(fp < 50)
+	assert(math.abs(bloom:count() - 1000) < 50)
+
+	local buf = assert(mem.pointer():alloc(16 + 4 * 4 * 256))
+	local cm = assert(mem.countmin(buf, true, 4))
+	cm:add(keys, keys, "hot", "hot", "hot")
+	assert(cm:count() == 2003)
+	local hot, cold = cm:count("hot", "key1")
+	assert(hot >= 3 and hot < 40 and cold >= 2)
+	-- attach to the existing sketch
+	local cm2 = assert(mem.countmin(buf))
+	assert(cm2:count("hot") == hot)
+	cm:merge(cm2)
+	assert(cm:count() == 4006)
+	assert(not pcall(cm.check, cm, "hot"))
+
+	local hll = assert(mem.hll(mem.pointer():alloc(16 + 4096), true))
+	local hll2 = assert(mem.hll(mem.pointer():alloc(16 + 4096), true, 12))
+	assert(hll:count() == 0)
+	for i = 1, 20000 do keys[i] = "client" .. i end
+	hll:add(keys)
+	hll2:add("client1", "other1", "other2")
+	assert(math.abs(hll:count() - 20000) < 1000)
+	hll:merge(hll2)
+	assert(math.abs(hll:count() - 20002) < 1000)
+	assert(not pcall(hll.merge, hll, bloom))
+
+	hll:clear()
+	assert(hll:count() == 0)
+
+	-- corrupt headers are not attached (k at offset 8, width at 12)
+	local hb = assert(mem.pointer():alloc(16 + 4096))
+	assert(mem.hll(hb, true, 12) and mem.hll(hb))
+	hb[8] = 20
+	assert(not pcall(mem.hll, hb))
+	hb[8] = 11
+	assert(not pcall(mem.hll, hb))
+	assert(mem.countmin(buf))
+	buf[8] = 200
+	assert(not pcall(mem.countmin, buf))
+	buf[8] = 4
+	buf[14] = 1
+	assert(not pcall(mem.countmin, buf))
+	print"OK"
+end
+
+
+print"-- Hashing"
+do
+	assert(mem.crc32c"123456789" == 0xE3069283)
+	assert(mem.crc32c("3456789", mem.crc32c"12") == 0xE3069283)
+	assert(mem.crc32c("xx123456789yy", nil, 2, 9) == 0xE3069283)
+
+	local t = {}
+	for i = 0, 255 do t[#t + 1] = string.char(i) end
+	local data = string.rep(table.concat(t), 4)
+
+	local lo, hi = mem.hash64("hello world")
+	assert(lo == 0xB21E6968 and hi == 0x45AB6734)
+	lo, hi = mem.hash64(data, 7, 0, 1000)
+	assert(lo == 0xD41096DB and hi == 0xD32EB2D2)
+
+	local buf = assert(mem.pointer():alloc(1024))
+	buf:write(data)
+	assert(buf:hash64(7, 0, 1000) == lo)
+	assert(buf:crc32c() == mem.crc32c(data))
+
+	-- mapped file
+	local filename = "fhash"
+	local f = assert(sys.handle():open(filename, "rw", 0x180, "creat"))
+	f:write(data)
+	local m = assert(mem.pointer():map(f, "r"))
+	assert(mem.crc32c(m) == mem.crc32c(data))
+	assert(m:hash64(7, 0, 1000) == lo)
+	m:free()
+	f:close()
+	sys.remove(filename)
+
+	-- streaming
+	local hs = mem.hasher("xxh64", 7)
+	for i = 1, 1000, 7 do
+		hs:update(data, i - 1, math.min(7, 1001 - i))
+	end
+	local lo2, hi2 = hs:digest()
+	assert(lo2 == lo and hi2 == hi)
+	assert(hs:reset():update(data, 0, 1000):digest() == lo)
+	assert(hs:reset(0):update"hello world":digest() == 0xB21E6968)
+	hs = mem.hasher"crc32c"
+	assert(hs:update"1234":update"56789":digest() == 0xE3069283)
+
+	-- fixed-size records
+	local out = assert(mem.pointer(4 * 3)):type"uint"
+	assert(mem.hash_records(data, 16, out, 1) == 3)
+	assert(out[0] == 0x7B0D28C1 and out[1] == 0x31F156A6 and out[2] == 0xCCD55002)
+	print"OK"
+end
+
+
+print"-- Base64 and Hex"
+do
+	assert(mem.encode("base64", "foobar") == "Zm9vYmFy")
+	assert(mem.encode("base64", "fooba") == "Zm9vYmE=")
+	assert(mem.encode("base64url", "\251\255") == "-_8")
+	assert(mem.encode("hex", "\1\171") == "01ab")
+	assert(mem.decode("base64", "Zm9vYmE=") == "fooba")
+	assert(mem.decode("base64url", "-_8") == "\251\255")
+	assert(mem.decode("hex", "01AB") == "\1\171")
+	assert(mem.decode("base64", "Zm9v*") == nil)
+
+	local data = string.rep("0123456789", 1000)
+	local buf = assert(mem.pointer():alloc(16))
+	assert(mem.encode("base64", data, buf) == buf:seek())
+	local out = assert(mem.pointer():alloc(16))
+	assert(mem.decode("base64", buf, out) == #data)
+	assert(out:tostring() == data)
+	local n = out:seek()
+	assert(mem.decode("base64", buf:tostring() .. "*", out) == nil)
+	assert(out:seek() == n)  -- nothing committed on error
+
+	-- chunked input
+	local dec = mem.decoder"base64"
+	local s = ""
+	for _, chunk in ipairs{"Zm", "9vY", "mE", "="} do
+		s = s .. dec:update(chunk)
+	end
+	assert(s .. dec:finish() == "fooba")
+
+	local enc = mem.encoder"hex"
+	out:seek(0)
+	enc:update("\1", out)
+	enc:update("\2\3", out)
+	enc:finish(out)
+	assert(out:tostring() == "010203")
+	print"OK"
+end
+
+
+print"-- Tokenize Delimited Text"
+do
+	local buf = assert(mem.pointer():alloc(64))
+	buf:write'a,"b ""q"", c",\r\nxyz,1\npart'
+
+	local fields = assert(mem.pointer(4 * 2 * 16)):type"int"
+	local records = assert(mem.pointer(4 * 4)):type"int"
+	local nf, nr, next_off = buf:tokenize(fields, records)
+	assert(nf == 5 and nr == 2 and records[0] == 3 and records[1] == 5)
+	assert(buf:view(fields[0], fields[1]):tostring() == "a")
+	assert(fields[3] < 0)  -- escaped quotes
+	assert(buf:view(fields[2], -fields[3]):tostring() == 'b ""q"", c')
+	assert(fields[5] == 0)  -- empty field before CRLF
+	assert(buf:view(fields[6], fields[7]):tostring() == "xyz")
+
+	-- incomplete record is left until eof
+	assert(buf:view(next_off):tostring() == "part")
+	nf, nr = buf:tokenize(fields, nil, next_off, true)
+	assert(nf == 1 and nr == 1 and fields[1] == 4)
+
+	-- TSV without quoting
+	buf:seek(0)
+	buf:write'"x\ty\n'
+	nf, nr = buf:tokenize(fields, nil, 0, false, "\t", "\n", "")
+	assert(nf == 2 and nr == 1 and fields[1] == 2)
+
+	-- record wider than the output
+	local narrow = assert(mem.pointer(4 * 2 * 2)):type"int"
+	buf:seek(0)
+	buf:write"a,b,c\n"
+	assert(not buf:tokenize(narrow))
+
+	-- mapped file
+	local filename = "fcsv"
+	local f = assert(sys.handle():open(filename, "rw", 0x180, "creat"))
+	f:write"a,b\nc,d\n"
+	local m = assert(mem.pointer():map(f, "r"))
+	nf, nr, next_off = m:tokenize(fields)
+	assert(nf == 4 and nr == 2 and next_off == 8)
+	m:free()
+	f:close()
+	sys.remove(filename)
+	print"OK"
+end
+
+
+print"-- Line Index"
+do
+	local filename = "lindex"
+	local f = assert(sys.handle():open(filename, "rw", 0x180, "creat"))
+	local t = {}
+	for i = 1, 2000 do t[i] = "line " .. i end
+	f:write(table.concat(t, "\n") .. "\n")
+
+	-- mapped text
+	local text = assert(mem.pointer():map(f, "r"))
+	local idx = assert(mem.lineindex(text))
+	assert(idx:update(true) == 2000)
+	assert(idx:line(1):tostring() == "line 1")
+	assert(idx:line(2000):tostring() == "line 2000")
+	assert(idx:line(2001) == nil)
+	local n = 0
+	for i, v in idx:lines(10, 12) do
+		assert(v:tostring() == "line " .. i)
+		n = n + 1
+	end
+	assert(n == 3)
+
+	-- file grows: partial last line
+	f:seek(0, "end")
+	f:write("line 2001\nline 20")
+	text:free()
+	text:map(f, "r")
+	assert(idx:update() == 2001)
+	assert(idx:line(2002):tostring() == "line 20")
+
+	-- persist and resume the index
+	local saved = idx:buffer():view():tostring()
+	local index = assert(mem.pointer():alloc(16))
+	index:write(saved)
+	local idx2 = assert(mem.lineindex(text, index))
+	assert(idx2:count() == 2001 and idx2:line(1500):tostring() == "line 1500")
+
+	-- sliding window over the file
+	local win = assert(mem.lineindex(f, nil, 4096))
+	assert(win:update() == 2001)
+	local v1 = win:line(1)
+	assert(v1:tostring() == "line 1")
+	assert(win:line(1999):tostring() == "line 1999")
+	assert(v1:length() == 0)  -- window moved
+	n = 0
+	for i, v in win:lines() do
+		assert(v:tostring() == (i == 2002 and "line 20" or "line " .. i))
+		n = n + 1
+	end
+	assert(n == 2002)
+
+	-- anonymous memory keeps the scanned pages
+	local anon = assert(mem.pointer():alloc(65536, nil, "populate"))
+	anon:write(table.concat(t, "\n") .. "\n")
+	local idx3 = assert(mem.lineindex(anon))
+	assert(idx3:update(true) == 2000)
+	assert(idx3:line(1):tostring() == "line 1")
+	anon:free()
+
+	text:free()
+	f:close()
+	sys.remove(filename)
+	print"OK"
+end
+
+
+print"-- Formatted Output"
+do
+	local buf = assert(mem.pointer():alloc())
+	assert(buf:writef("%d,%5.2f,%s|%-4s|%x%%", 42, 3.14159, "a", "b", 255))
+	assert(buf:tostring() == "42, 3.14,a|b   |ff%")
+	buf:seek(0)
+
+	assert(buf:writef("%d %g %g %.3s %c", -123.9, 1.5, 2^53, "abcdef", 65))
+	assert(buf:tostring() == "-123 1.5 " .. tostring(2^53) .. " abc A")
+	buf:seek(0)
+
+	assert(buf:append_int(-9007199254740993) and buf:append_int(0))
+	assert(buf:tostring() == "-90071992547409920")
+	buf:seek(0)
+
+	for _, v in ipairs{0, -0, 1, -17, 1e14, 1e100, 0.1, 1/3, 123456789012} do
+		buf:seek(0)
+		assert(buf:append_float(v) and buf:tostring() == tostring(v))
+	end
+	buf:seek(0)
+	assert(buf:append_float(2.5, 3) and buf:tostring() == "2.500")
+	buf:seek(0)
+
+	local s = 'say "hi"\\\n\t\1' .. string.rep("x", 40) .. "\031\127\200"
+	assert(buf:append_escaped_json(s))
+	assert(buf:tostring() == 'say \\"hi\\"\\\\\\n\\t\\u0001'
+		.. string.rep("x", 40) .. "\\u001f\127\200")
+	buf:seek(0)
+	assert(buf:writef('{"k":"%j"}', "a\"b"))
+	assert(buf:tostring() == '{"k":"a\\"b"}')
+
+	-- growth
+	buf:seek(0)
+	for i = 1, 1000 do buf:writef("%d;", i) end
+	assert(#buf:tostring() == 3893)
+
+	assert(not pcall(buf.writef, buf, "%z", 1))
+	assert(not pcall(buf.writef, buf, "%123d", 1))
+	buf:free()
+	print"OK"
+end
+
+
+print"-- Searching"
+do
+	local buf = assert(mem.pointer():alloc())
+	local text = string.rep("abcdefghij", 10) .. "needle" .. string.rep("z", 40) .. "needle"
+	buf:write(text)
+	assert(buf:find("needle") == 100)
+	assert(buf:find("needle", 101) == 146)
+	assert(buf:find("jab") == 9)
+	assert(not buf:find("needles"))
+	do
+		local filename = "fsearch"
+		local f = assert(sys.handle():open(filename, "rw", 0x180, "creat"))
+		f:write(text)
+		local m = assert(mem.pointer():map(f, "r"))
+		assert(m:find("needle") == 100 and m:find("needle", 101) == 146)
+		local mm = assert(mem.matcher{"zn", "dle"})
+		assert(select(2, mm:find(m)) == 103)
+		m:free()
+		f:close()
+		sys.remove(filename)
+	end
+	for i = 1, 200 do
+		local a = math.random(0, #text - 1)
+		local pat = text:sub(a + 1, a + math.random(1, 12))
+		assert(buf:find(pat) == text:find(pat, 1, true) - 1)
+	end
+
+	-- multiple patterns
+	local m = assert(mem.matcher{"he", "she", "his", "hers"})
+	assert(select(2, m:find("ushers")) == 1)
+	local matches = assert(mem.pointer(4 * 16)):type"int"
+	local n, off, state = m:match("ushers", matches)
+	assert(n == 3 and off == 6)
+	local found = {}
+	for i = 0, 2 * n - 1, 2 do
+		found[#found + 1] = matches[i] .. "@" .. matches[i + 1]
+	end
+	assert(table.concat(found, " ") == "2@1 1@2 4@2")
+
+	-- streaming across chunks
+	n, off, state = m:match("us", matches)
+	assert(n == 0)
+	n, off, state = m:match("hers", matches, 0, state)
+	assert(n == 3 and matches[1] == -1)
+
+	local mc = assert(mem.matcher({"GET", "Post"}, true))
+	assert(mc:find("xx post") == 2)
+	assert(not mc:find("PUT"))
+	buf:close()
+	buf:write(text)
+	assert(select(2, m:find(buf)) == nil)
+
+	-- binary search
+	local arr = assert(mem.pointer(4 * 100)):type"int"
+	for i = 0, 99 do arr[i] = i * 3 end
+	local i, ok = arr:bsearch(42)
+	assert(i == 14 and ok)
+	i, ok = arr:bsearch(43)
+	assert(i == 15 and not ok)
+	assert(arr:bsearch(1000) == 100)
+	assert(not pcall(arr.bsearch, arr, 3, 2^61))  -- count overflow
+	assert(not pcall(arr.bsearch, arr, 3, -1))
+
+	local recs = assert(mem.pointer():alloc())
+	recs:write("aaa1", "bbb2", "ccc3", "ddd4")
+	i, ok = recs:bsearch("ccc", 4)
+	assert(i == 2 and ok)
+	i, ok = recs:bsearch("bz", 4)
+	assert(i == 2 and not ok)
+	print"OK"
+end
@@ -0,0 +1,82 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local host, port = "127.0.0.1", 8086
+
+local srv = sock.handle()
+assert(srv:socket())
+assert(srv:sockopt("reuseaddr", 1))
+local addr = sock.addr():inet(port, sock.inet_pton(host))
+assert(srv:bind(addr))
+assert(srv:listen())
+
+local clients = {}
+
+local function connect(n)
+    for _ = 1, n do
+	local client = sock.handle()
+	assert(client:socket())
+	assert(client:connect(addr))
+	clients[#clients + 1] = client
+    end
+end
+
+local function close_all(handles, n)
+    for i = 1, n do handles[i]:close() end
+end
+
+
+print"-- Nonblocking listener drains the backlog"
+do
+    srv:nonblocking(true)
+    connect(5)
+
+    local handles, addrs = {}, {}
+    local n = assert(srv:accept_many(10, handles, addrs))
+    assert(n == 5 and #handles == 5 and #addrs == 5)
+    for i = 1, n do
+	local port_, ip = addrs[i]:inet()
+	assert(sock.inet_ntop(ip) == host and port_ ~= port)
+	assert(handles[i]:read() == false)  -- accepted in nonblocking mode
+    end
+
+    -- backlog is empty
+    assert(srv:accept_many(10, handles) == 0)
+
+    -- closed handles are reused, open ones are replaced
+    local closed, open = handles[1], handles[2]
+    closed:close()
+    connect(2)
+    n = assert(srv:accept_many(10, handles))
+    assert(n == 2 and handles[1] == closed and handles[2] ~= open)
+    assert(open:write("x"))  -- replaced handle is still open
+    open:close()
+    close_all(handles, 5)
+    print"OK"
+end
+
+print"-- Blocking listener accepts one connection"
+do
+    srv:nonblocking(false)
+    connect(3)
+
+    local handles = {}
+    for _ = 1, 3 do
+	assert(srv:accept_many(10, handles) == 1)
+	handles[1]:close()
+    end
+    print"OK"
+end
+
+print"-- Invalid arguments"
+do
+    assert(not pcall(srv.accept_many, srv, 0, {}))
+    assert(not pcall(srv.accept_many, srv, 1, {sys.handle()}))
+    print"OK"
+end
+
+for _, client in ipairs(clients) do client:close() end
+srv:close()
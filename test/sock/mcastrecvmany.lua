@@ -0,0 +1,30 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local MCAST_ADDR = "234.5.6.7"
+local MCAST_PORT = 25000
+
+local fd = sock.handle()
+assert(fd:socket("dgram"))
+
+assert(fd:sockopt("reuseaddr", 1))
+assert(fd:bind(sock.addr():inet(MCAST_PORT)))
+
+assert(fd:membership(sock.inet_pton(MCAST_ADDR)))
+
+-- receive datagrams in batches
+local buf = sys.mem.pointer():alloc()
+local offsets, lengths = {}, {}
+
+while true do
+	buf:seek(0)
+	local n = assert(fd:recvmany(buf, 64, nil, offsets, lengths))
+	local s = buf:tostring()
+	for i = 1, n do
+		local off = offsets[i]
+		sys.stdout:write(s:sub(off + 1, off + lengths[i]))
+	end
+end
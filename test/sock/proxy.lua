@@ -0,0 +1,57 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local listen_port = 8081
+local target_host, target_port = "127.0.0.1", 8080
+local IDLE_TIMEOUT = 30000
+
+local stderr = sys.stderr
+
+
+local evq = assert(sys.event_queue())
+
+local target_addr = sock.addr():inet(target_port, sock.inet_pton(target_host))
+
+local function on_relay(relay, event, msg)
+    local a, b = relay:counters()
+    stderr:write("- ", event, " (", a, " / ", b, " bytes) ",
+	msg or "", "\n")
+    relay:close()
+end
+
+local function on_accept(evq, evid, fd)
+    local handles = {}
+    local n = fd:accept_many(16, handles)
+    for i = 1, n or 0 do
+	local client = handles[i]
+	local server = sock.handle()
+
+	if server:socket() and server:connect(target_addr) then
+	    server:nonblocking(true)
+	    local relay = assert(sock.relay(client, server))
+	    assert(relay:start(evq, on_relay, IDLE_TIMEOUT))
+	    stderr:write("+ ", tostring(relay), "\n")
+	else
+	    stderr:write("Connect: ", errorMessage, "\n")
+	    client:close()
+	    server:close()
+	end
+    end
+end
+
+
+local fd = sock.handle()
+assert(fd:socket())
+assert(fd:sockopt("reuseaddr", 1))
+assert(fd:bind(sock.addr():inet(listen_port, sock.inet_pton("127.0.0.1"))))
+assert(fd:listen())
+fd:nonblocking(true)
+
+assert(evq:add_socket(fd, 'r', on_accept))
+
+stderr:write("Proxy 127.0.0.1:", listen_port, " -> ",
+    target_host, ":", target_port, "\n")
+evq:loop()
@@ -0,0 +1,80 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+-- Connected pair, both ends in nonblocking mode
+local a, b = sock.handle(), sock.handle()
+assert(a:socket("stream", nil, b))
+assert(a:sockopt("sndbuf", 1024 * 1024))
+assert(b:sockopt("rcvbuf", 1024 * 1024))
+a:nonblocking(true)
+b:nonblocking(true)
+
+local function payload(n, seed)
+    local t = {}
+    for i = 1, n / 10 do t[i] = string.format("%09d\n", seed + i) end
+    return table.concat(t)
+end
+
+local function send(s)
+    local done, n = a:write(s)
+    assert(done and n == #s, "short write")
+end
+
+print"-- Small reads"
+do
+    for i = 1, 3 do
+	send("hello")
+	assert(b:read() == "hello")
+    end
+    assert(b:read() == false)
+    print"OK"
+end
+
+print"-- Large reads followed by EAGAIN"
+do
+    for i = 1, 100 do
+	local s = payload(200000, i)
+	send(s)
+	assert(b:read() == s)
+	assert(b:read() == false)  -- releases the reserved memory
+	send(s)
+	assert(b:recv() == s)
+	assert(b:recv() == false)
+    end
+    print"OK"
+end
+
+print"-- Count limited reads"
+do
+    local s = payload(200000, 7)
+    send(s)
+    assert(b:read(nil, 150000) == s:sub(1, 150000))
+    assert(b:read() == s:sub(150001))
+    assert(b:read() == false)
+    print"OK"
+end
+
+print"-- Reads into membuf"
+do
+    local buf = assert(sys.mem.pointer():alloc())
+    local s = payload(200000, 9)
+    send(s)
+    assert(b:read(buf) == #s)
+    assert(b:read(buf) == false)
+    assert(buf:seek() == #s and buf:tostring() == s)
+    buf:free()
+    print"OK"
+end
+
+print"-- EOF after large reads"
+do
+    send(payload(200000, 11))
+    assert(b:read())
+    a:close()
+    assert(b:read() == nil)
+    b:close()
+    print"OK"
+end
@@ -0,0 +1,104 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+if not sock.resolver then
+    print"resolver: not supported"
+    return
+end
+
+local evq = assert(sys.event_queue())
+
+local calls = {}
+local function callback(res, host, addrs, name)
+    calls[#calls + 1] = {res = res, host = host, addrs = addrs, name = name}
+end
+
+print"-- Lookups, coalescing and cache"
+do
+    local r = assert(sock.resolver(evq, {threads = 2, cache_size = 2,
+	ttl = 1500, negative_ttl = 1500}))
+
+    calls = {}
+    assert(r:getaddrinfo("localhost", callback) == false)
+    assert(r:getaddrinfo("localhost", callback) == false)  -- coalesced
+    assert(r:getaddrinfo("no-such-host.invalid", callback) == false)
+    evq:loop(1000)
+    assert(#calls == 3)
+    for _, c in ipairs(calls) do
+	assert(c.res == r)
+	if c.host == "localhost" then
+	    assert(c.addrs and #c.addrs >= 1 and c.name)
+	else
+	    assert(c.addrs == nil and c.name)  -- error message
+	end
+    end
+    -- each waiter gets own copy of addresses
+    assert(calls[1].addrs ~= calls[2].addrs)
+
+    -- cache hit
+    local addrs, name = r:getaddrinfo("localhost", callback)
+    assert(type(addrs) == "table" and #addrs >= 1 and name)
+
+    -- negative cache
+    local res, err = r:getaddrinfo("no-such-host.invalid", callback)
+    assert(res == nil and err)
+
+    -- expired entries are looked up again
+    sys.thread.sleep(1600)
+    calls = {}
+    assert(r:getaddrinfo("localhost", callback) == false)
+    evq:loop(1000)
+    assert(#calls == 1)
+
+    -- flush
+    r:flush()
+    assert(r:getaddrinfo("localhost", callback) == false)
+    evq:loop(1000)
+    r:close()
+    print"OK"
+end
+
+print"-- Callback errors don't drop other waiters"
+do
+    local r = assert(sock.resolver(evq))
+    local n = 0
+    local function bad() n = n + 1; error"callback failed" end
+    local function good() n = n + 1 end
+
+    assert(r:getaddrinfo("localhost", bad) == false)
+    assert(r:getaddrinfo("localhost", good) == false)
+    assert(r:getaddrinfo("localhost", good) == false)
+    local ok, err = pcall(evq.loop, evq, 1000)
+    assert(not ok and err:find"callback failed")
+    assert(n == 3)
+    r:close()
+    print"OK"
+end
+
+print"-- Close with lookups in progress"
+do
+    local r = assert(sock.resolver(evq, {threads = 1}))
+
+    calls = {}
+    assert(r:getaddrinfo("localhost", callback) == false)
+    assert(r:getaddrinfo("slow.invalid", callback) == false)
+    r:close()
+    assert(#calls == 2)
+    for _, c in ipairs(calls) do
+	assert(c.addrs == nil and c.name == "resolver closed")
+    end
+    assert(not pcall(r.getaddrinfo, r, "localhost", callback))
+
+    -- the finalizer doesn't wait for the lookup threads
+    for i = 1, 10 do
+	local r2 = assert(sock.resolver(evq, {threads = 4}))
+	r2:getaddrinfo("host" .. i .. ".invalid", callback)
+    end
+    local period = sys.period():start()
+    collectgarbage()
+    assert(period:get() < 1000000)
+    print"OK"
+end
@@ -0,0 +1,111 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+-- Connected pair of unix domain sockets
+local a, b = sock.handle(), sock.handle()
+assert(a:socket("stream", "unix", b))
+
+-- Descriptors to pass: a file and a socket
+local filename = "sendfds.dat"
+local fh
+do
+    local fd = assert(sys.handle():open(filename, "w", 0x180, "creat"))
+    assert(fd:write("file-data"))
+    fd:close()
+    fh = assert(sys.handle():open(filename))
+end
+local c, d = sock.handle(), sock.handle()
+assert(c:socket("stream", "unix", d))
+
+print"-- Pass descriptors"
+do
+    assert(a:send_fds("hi", {fh, c}))
+    local handles = {}
+    local s, n = b:recv_fds(nil, handles)
+    assert(s == "hi" and n == 2)
+
+    -- any received descriptor is wrapped in sd_udata
+    assert(handles[1]:read() == "file-data")
+    assert(handles[2]:write("ping"))
+    assert(d:read(nil, 4) == "ping")
+
+    for i = 1, n do handles[i]:close() end
+    print"OK"
+end
+
+print"-- Data into membuf and reuse of closed handles"
+do
+    local buf = assert(sys.mem.pointer():alloc())
+    local handles = {}
+
+    assert(a:send_fds("first", {c}))
+    assert(b:recv_fds(nil, handles) == "first")
+    local old = handles[1]
+    old:close()
+
+    assert(a:send_fds("second", {c}))
+    local nr, n = b:recv_fds(buf, handles)
+    assert(nr == 6 and n == 1 and buf:tostring() == "second")
+    assert(handles[1] == old)  -- closed handle is reused
+    old:close()
+
+    assert(a:send_fds("plain", {}))
+    nr, n = b:recv_fds(buf, {})
+    assert(nr == 5 and n == 0 and buf:tostring() == "secondplain")
+    buf:free()
+    print"OK"
+end
+
+print"-- Limit of handles"
+do
+    local many = {}
+    for i = 1, 253 do many[i] = c end
+    assert(a:send_fds("x", many))
+    local handles = {}
+    local s, n = b:recv_fds(nil, handles)
+    assert(s == "x" and n == 253)
+    for i = 1, n do handles[i]:close() end
+
+    many[254] = c
+    assert(not pcall(a.send_fds, a, "x", many))
+
+    -- slots must be sd_udata
+    assert(not pcall(b.recv_fds, b, nil, {sys.handle()}))
+    print"OK"
+end
+
+print"-- Nonblocking"
+do
+    b:nonblocking(true)
+    assert(b:recv_fds(nil, {}) == false)
+    b:nonblocking(false)
+    print"OK"
+end
+
+print"-- Truncated descriptors (MSG_CTRUNC)"
+do
+    -- no room for more descriptors in this process
+    local fd = assert(sys.handle():open(filename))
+    local nfiles = tonumber(tostring(fd):match"%((%d+)%)") + 3
+    fd:close()
+    assert(sys.limit_nfiles(nfiles))
+
+    local many = {}
+    for i = 1, 10 do many[i] = c end
+    assert(a:send_fds("y", many))
+    local s, err = b:recv_fds(nil, {})
+    assert(s == nil and err)
+
+    -- all received descriptors were closed
+    fd = assert(sys.handle():open(filename))
+    fd:close()
+    print"OK"
+end
+
+fh:close()
+a:close(); b:close()
+c:close(); d:close()
+sys.remove(filename)
@@ -0,0 +1,115 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local host, port = "127.0.0.1", 8083
+
+-- File: "ABC..." pattern followed by filler
+local filename = "sendfile.dat"
+local data
+do
+    local t = {}
+    for i = 1, 200000 do t[i] = string.char(65 + i % 26) end
+    data = table.concat(t) .. string.rep("z", 1800000)
+
+    local fd = assert(sys.handle():open(filename, "w", 0x180, "creat"))
+    assert(fd:write(data))
+    fd:close()
+end
+local fd = assert(sys.handle():open(filename))
+
+-- Connected pair with small buffers to get EAGAIN
+local srv = sock.handle()
+assert(srv:socket())
+assert(srv:sockopt("reuseaddr", 1))
+local addr = sock.addr():inet(port, sock.inet_pton(host))
+assert(srv:bind(addr))
+assert(srv:listen())
+
+local client = sock.handle()
+assert(client:socket())
+assert(client:connect(addr))
+local sd = sock.handle()
+assert(srv:accept(sd))
+srv:close()
+
+sd:nonblocking(true)
+client:nonblocking(true)
+assert(sd:sockopt("sndbuf", 32768))
+assert(client:sockopt("rcvbuf", 32768))
+
+local function drain(t)
+    while true do
+	local s = client:read()
+	if not s then break end
+	t[#t + 1] = s
+    end
+end
+
+print"-- Range with headers and trailers, resumed after EAGAIN"
+do
+    local opts = {headers = "HEADER\r\n", trailers = "\r\nTRAILER"}
+    local start, count = 1000, 1500000
+    local off, got, calls = start, {}, 0
+
+    while true do
+	local done, n, next_off = sd:sendfile(fd, off, count - (off - start), opts)
+	assert(done ~= nil, errorMessage)
+	calls = calls + 1
+	off = next_off
+	drain(got)
+	if done then break end
+    end
+    drain(got)
+
+    got = table.concat(got)
+    assert(calls > 1, "EAGAIN expected")
+    assert(off == start + count)
+    assert(got == "HEADER\r\n" .. data:sub(start + 1, start + count)
+	.. "\r\nTRAILER")
+    assert(opts.headers == nil and opts.trailers == nil)
+    assert(fd:seek() == 0, "file position changed")
+    print"OK"
+end
+
+print"-- Current file position up to EOF"
+do
+    local pos = #data - 10000
+    fd:seek(pos)
+    local got = {}
+    while true do
+	local done, n, next_off = sd:sendfile(fd)
+	assert(done ~= nil, errorMessage)
+	drain(got)
+	if done then
+	    assert(next_off == #data and fd:seek() == #data)
+	    break
+	end
+    end
+    drain(got)
+    assert(table.concat(got) == data:sub(pos + 1))
+
+    local done, n = sd:sendfile(fd, #data + 10)
+    assert(done and n == 0)
+    print"OK"
+end
+
+print"-- Membuf headers are consumed"
+do
+    local buf = assert(sys.mem.pointer():alloc())
+    buf:write("HDR")
+    local done, n = sd:sendfile(fd, 0, 5, {headers = buf})
+    assert(done and n == 8 and buf:seek() == 0)
+
+    local got = {}
+    repeat drain(got) until #table.concat(got) >= 8
+    assert(table.concat(got) == "HDR" .. data:sub(1, 5))
+    print"OK"
+end
+
+fd:close()
+sd:close()
+client:close()
+sys.remove(filename)
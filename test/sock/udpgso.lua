@@ -0,0 +1,89 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local host, port = "127.0.0.1", 8087
+
+if not sock.handle().sendmsg then
+    print"udpgso: not supported"
+    return
+end
+
+local addr = sock.addr():inet(port, sock.inet_pton(host))
+
+local rd = sock.handle()
+assert(rd:socket("dgram"))
+assert(rd:bind(addr))
+rd:nonblocking(true)
+
+local wr = sock.handle()
+assert(wr:socket("dgram"))
+
+local data
+do
+    local t = {}
+    for i = 1, 1003 do t[i] = string.char(48 + i % 10) end
+    data = table.concat(t)
+end
+
+
+print"-- Segmentation by argument"
+do
+    local done, n = assert(wr:sendmsg(data, addr, 100))
+    assert(done and n == #data)
+
+    -- without GRO each segment is a datagram
+    local from = sock.addr()
+    for i = 1, 11 do
+	local buf = assert(sys.mem.pointer():alloc())
+	assert(rd:recvmsg(buf, nil, nil, from) == 1)
+	local s = buf:tostring()
+	assert(s == data:sub((i - 1) * 100 + 1, i * 100))
+	buf:free()
+    end
+    assert(rd:recvmsg(sys.mem.pointer():alloc()) == false)
+    print"OK"
+end
+
+print"-- Segmentation by option, coalesced by GRO"
+do
+    if not (wr:sockopt("udp_segment", 100) and rd:sockopt("udp_gro", 1)) then
+	print"SKIP"
+    else
+	assert(wr:sendmsg(data, addr))
+	sys.thread.sleep(10)
+
+	local buf = assert(sys.mem.pointer():alloc())
+	local offsets, lengths = {}, {}
+	local total, count, last = 0, 0
+	for _ = 1, 100 do
+	    local n = rd:recvmsg(buf, offsets, lengths)
+	    if n then
+		for i = 1, n do
+		    total = total + lengths[i]
+		    assert(offsets[i] + lengths[i] <= buf:seek())
+		end
+		count = count + n
+		last = lengths[n]
+	    end
+	    if total >= #data then break end
+	    sys.thread.sleep(1)
+	end
+	assert(total == #data and count == 11 and last == 3)
+	assert(buf:tostring() == data)
+	buf:free()
+    end
+    print"OK"
+end
+
+print"-- Invalid segment size"
+do
+    assert(not pcall(wr.sendmsg, wr, data, addr, -1))
+    assert(not pcall(wr.sendmsg, wr, data, addr, 70000))
+    print"OK"
+end
+
+rd:close()
+wr:close()
@@ -0,0 +1,79 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+-- Connected pair with a small send buffer to get partial writes
+local a, b = sock.handle(), sock.handle()
+assert(a:socket("stream", nil, b))
+assert(a:sockopt("sndbuf", 16384))
+a:nonblocking(true)
+b:nonblocking(true)
+
+local function membuf(s)
+    local buf = assert(sys.mem.pointer():alloc())
+    buf:write(s)
+    return buf
+end
+
+local function drain(t)
+    while true do
+	local s = b:read()
+	if not s then break end
+	t[#t + 1] = s
+    end
+end
+
+print"-- Partial writes across strings and membufs"
+do
+    local parts = {
+	string.rep("a", 30000),
+	membuf(string.rep("b", 50000)),
+	string.rep("c", 20000),
+	membuf(string.rep("d", 70000)),
+    }
+    -- expected contents of each part
+    local left = {}
+    for i, v in ipairs(parts) do
+	left[i] = type(v) == "string" and v or v:tostring()
+    end
+    local expect = table.concat(left)
+
+    local got, partial = {}, false
+    while #parts > 0 do
+	local done, n = a:write(unpack(parts))
+	assert(done ~= nil, errorMessage)
+	partial = partial or not done
+
+	-- drop the written bytes: strings by the caller, membufs by write
+	local i = 1
+	while parts[i] do
+	    local len = #left[i]
+	    local k = (n < len) and n or len
+	    left[i] = left[i]:sub(k + 1)
+	    n = n - k
+	    if type(parts[i]) == "string" then
+		parts[i] = left[i]
+	    else
+		assert(parts[i]:tostring() == left[i], "membuf accounting")
+	    end
+	    if #left[i] == 0 then
+		table.remove(parts, i)
+		table.remove(left, i)
+	    else
+		i = i + 1
+	    end
+	    if n == 0 then break end
+	end
+	drain(got)
+    end
+    drain(got)
+
+    assert(partial, "partial write expected")
+    assert(table.concat(got) == expect)
+    print"OK"
+end
+
+a:close()
+b:close()
@@ -0,0 +1,106 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local host, port = "127.0.0.1", 8085
+
+if not sock.handle().zerocopy_done then
+    print"zerocopy: not supported"
+    return
+end
+
+local srv = sock.handle()
+assert(srv:socket())
+assert(srv:sockopt("reuseaddr", 1))
+local addr = sock.addr():inet(port, sock.inet_pton(host))
+assert(srv:bind(addr))
+assert(srv:listen())
+
+local function connect()
+    local client = sock.handle()
+    assert(client:socket())
+    assert(client:connect(addr))
+    local sd = sock.handle()
+    assert(srv:accept(sd))
+    sd:nonblocking(true)
+    return client, sd
+end
+
+-- Wait for completion of the pending sends
+local function drain(sd)
+    local total = 0
+    for _ = 1, 100 do
+	local completed, pending = assert(sd:zerocopy_done())
+	total = total + completed
+	if pending == 0 then return total end
+	sys.thread.sleep(10)
+    end
+    error"zerocopy completions timed out"
+end
+
+local function recv(sd, n)
+    local t, len = {}, 0
+    while len < n do
+	local s = sd:read()
+	if s then
+	    t[#t + 1] = s
+	    len = len + #s
+	end
+    end
+    return table.concat(t)
+end
+
+
+print"-- Send and complete"
+do
+    local client, sd = connect()
+    assert(sd:zerocopy_done() == 0)  -- not enabled yet
+
+    local s = string.rep("0123456789", 10000)
+    local buf = assert(sys.mem.pointer():alloc(#s))
+    buf:write(s)
+
+    local n = 0
+    while n < 3 do
+	local done, nw = assert(sd:send(s, nil, "zerocopy"))
+	if done then n = n + 1 end
+    end
+    local done, nw = assert(sd:send(buf, nil, "zerocopy"))
+    assert(done and buf:seek() == #s)  -- not consumed
+
+    client:nonblocking(true)
+    assert(recv(client, 4 * #s) == string.rep(s, 4))
+    assert(drain(sd) == 4)
+    assert(select(2, sd:zerocopy_done()) == 0)
+
+    buf:free()
+    sd:close()
+    client:close()
+    print"OK"
+end
+
+print"-- Close with pending sends"
+do
+    local client, sd = connect()
+    local s = string.rep("x", 200000)
+
+    assert(sd:send(s, nil, "zerocopy"))
+    assert(sd:close())
+
+    -- the handle starts a new sequence with the next socket
+    client:close()
+    client, sd = connect()
+    assert(sd:zerocopy_done() == 0)
+    assert(sd:send("abc", nil, "zerocopy"))
+    client:nonblocking(true)
+    assert(recv(client, 3) == "abc")
+    assert(drain(sd) == 1)
+
+    sd:close()
+    client:close()
+    print"OK"
+end
+
+srv:close()